@@ -0,0 +1,469 @@
+#pragma once
+#include <new>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+/**
+ * Default alignment (in bytes) of memory handed out by nd::aligned_allocator.
+ * 64 bytes is one cache line on most hardware and satisfies AVX-512 loads.
+ */
+#ifndef ND_DEFAULT_ALIGNMENT
+#define ND_DEFAULT_ALIGNMENT 64
+#endif
+
+    template<typename T, std::size_t Alignment = ND_DEFAULT_ALIGNMENT> struct aligned_allocator;
+    struct buffer_cache_stats;
+    class buffer_cache;
+
+    namespace detail
+    {
+        /**
+         * Allocates memory aligned to the given boundary. The block is
+         * over-allocated, and a block_header just before the aligned pointer
+         * records the address returned by operator new, along with the usable
+         * size and alignment of the block, so that aligned_free (and the
+         * buffer cache) can recover them.
+         */
+        static inline void* aligned_malloc(std::size_t bytes, std::size_t alignment);
+        static inline void aligned_free(void* ptr);
+
+        struct block_header
+        {
+            void* raw;
+            std::size_t bytes;
+            std::size_t alignment;
+        };
+    }
+
+/**
+ * The allocator used by nd::buffer, and hence by ndarray constructors and
+ * factories, when none is given explicitly.
+ */
+    template<typename T> using default_allocator = aligned_allocator<T, ND_DEFAULT_ALIGNMENT>;
+} // ND_API_END
+
+
+
+
+// ============================================================================
+struct nd::buffer_cache_stats // ND_IMPL_START
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t cached_blocks = 0;
+    std::size_t cached_bytes = 0;
+    std::size_t released_blocks = 0;
+};
+
+
+
+
+// ============================================================================
+class nd::buffer_cache
+{
+public:
+
+    /**
+     * A process-wide cache of memory blocks freed by aligned_allocator (and
+     * so by buffers using the default allocator). While enabled, requests
+     * are rounded up to a size class (four classes per power of two, so at
+     * most 25% is wasted), and a freed block is kept on the list for its
+     * size class and alignment, to be handed to the next request of the
+     * same class. Loops that evaluate the same expressions every step then
+     * reuse the memory of the previous step's temporaries, rather than
+     * returning it to the system and faulting it back in.
+     *
+     * The cache holds at most capacity_bytes in total, and at most
+     * blocks_per_class blocks of each size class; blocks freed beyond those
+     * limits are released. Disabling the cache releases everything it holds.
+     */
+    static void enable(std::size_t capacity_bytes = std::size_t(1) << 30, std::size_t blocks_per_class = 16)
+    {
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        instance().capacity_bytes = capacity_bytes;
+        instance().blocks_per_class = blocks_per_class;
+        instance().on = true;
+    }
+
+    static void disable()
+    {
+        instance().on = false;
+        clear();
+    }
+
+    static bool enabled()
+    {
+        return instance().on.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Releases all cached blocks. The cache stays enabled if it was.
+     */
+    static void clear()
+    {
+        auto blocks = std::vector<void*>();
+        {
+            std::lock_guard<std::mutex> lock(instance().mutex);
+
+            for (auto& entry : instance().free_lists)
+            {
+                blocks.insert(blocks.end(), entry.second.begin(), entry.second.end());
+            }
+
+            instance().released += blocks.size();
+            instance().free_lists.clear();
+            instance().cached_bytes = 0;
+        }
+        for (auto block : blocks)
+        {
+            ::operator delete(header(block)->raw);
+        }
+    }
+
+    static buffer_cache_stats stats()
+    {
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto result = buffer_cache_stats();
+        result.hits = instance().hits;
+        result.misses = instance().misses;
+        result.cached_bytes = instance().cached_bytes;
+        result.released_blocks = instance().released;
+
+        for (const auto& entry : instance().free_lists)
+        {
+            result.cached_blocks += entry.second.size();
+        }
+
+        return result;
+    }
+
+    static void reset_stats()
+    {
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        instance().hits = 0;
+        instance().misses = 0;
+        instance().released = 0;
+    }
+
+    static std::size_t size_class(std::size_t bytes)
+    {
+        std::size_t step = 64;
+
+        while (step * 8 < bytes)
+        {
+            step *= 2;
+        }
+
+        return (bytes + step - 1) / step * step;
+    }
+
+private:
+    friend void* detail::aligned_malloc(std::size_t, std::size_t);
+    friend void detail::aligned_free(void*);
+
+    ~buffer_cache()
+    {
+        for (auto& entry : free_lists)
+        {
+            for (auto block : entry.second)
+            {
+                ::operator delete(header(block)->raw);
+            }
+        }
+    }
+
+    static buffer_cache& instance()
+    {
+        static buffer_cache cache;
+        return cache;
+    }
+
+    static detail::block_header* header(void* block)
+    {
+        return static_cast<detail::block_header*>(block) - 1;
+    }
+
+    /**
+     * Returns a cached block of exactly the given size class and alignment,
+     * or nullptr (counting a miss) if there is none.
+     */
+    static void* take(std::size_t bytes, std::size_t alignment)
+    {
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto entry = instance().free_lists.find(std::make_pair(bytes, alignment));
+
+        if (entry == instance().free_lists.end() || entry->second.empty())
+        {
+            ++instance().misses;
+            return nullptr;
+        }
+        auto block = entry->second.back();
+        entry->second.pop_back();
+        instance().cached_bytes -= bytes;
+        ++instance().hits;
+        return block;
+    }
+
+    /**
+     * Keeps a freed block if the cache is enabled, the block's size is a
+     * size class, and there is room for it. Returns false if the caller
+     * should release the block instead.
+     */
+    static bool give(void* block)
+    {
+        if (! enabled())
+        {
+            return false;
+        }
+        auto bytes = header(block)->bytes;
+        auto alignment = header(block)->alignment;
+
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto key = std::make_pair(bytes, alignment);
+        auto entry = instance().free_lists.find(key);
+        auto kept = entry == instance().free_lists.end() ? 0 : entry->second.size();
+
+        if (size_class(bytes) != bytes
+            || kept >= instance().blocks_per_class
+            || instance().cached_bytes + bytes > instance().capacity_bytes)
+        {
+            ++instance().released;
+            return false;
+        }
+        if (entry == instance().free_lists.end())
+        {
+            entry = instance().free_lists.emplace(key, std::vector<void*>()).first;
+        }
+        entry->second.push_back(block);
+        instance().cached_bytes += bytes;
+        return true;
+    }
+
+    std::mutex mutex;
+    std::atomic<bool> on {false};
+    std::map<std::pair<std::size_t, std::size_t>, std::vector<void*>> free_lists;
+    std::size_t capacity_bytes = 0;
+    std::size_t blocks_per_class = 0;
+    std::size_t cached_bytes = 0;
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t released = 0;
+};
+
+
+
+
+// ============================================================================
+void* nd::detail::aligned_malloc(std::size_t bytes, std::size_t alignment)
+{
+    alignment = std::max(alignment, alignof(block_header));
+
+    if (buffer_cache::enabled())
+    {
+        bytes = buffer_cache::size_class(bytes);
+
+        if (auto block = buffer_cache::take(bytes, alignment))
+        {
+            return block;
+        }
+    }
+    if (bytes > std::numeric_limits<std::size_t>::max() - alignment - sizeof(block_header))
+    {
+        throw std::bad_alloc();
+    }
+    auto raw = static_cast<char*>(::operator new(bytes + alignment + sizeof(block_header)));
+    auto pos = reinterpret_cast<std::uintptr_t>(raw + sizeof(block_header));
+    auto ptr = reinterpret_cast<block_header*>((pos + alignment - 1) & ~std::uintptr_t(alignment - 1));
+    ptr[-1] = block_header{raw, bytes, alignment};
+    return ptr;
+}
+
+void nd::detail::aligned_free(void* ptr)
+{
+    if (ptr && ! buffer_cache::give(ptr))
+    {
+        ::operator delete(static_cast<block_header*>(ptr)[-1].raw);
+    }
+}
+
+
+
+
+// ============================================================================
+template<typename T, std::size_t Alignment>
+struct nd::aligned_allocator
+{
+    /**
+     * A standard-conforming allocator that returns memory aligned to the given
+     * number of bytes. Any type satisfying the Allocator requirements (for
+     * example std::allocator, or a user-provided memory pool) may be given to
+     * nd::buffer in its place.
+     */
+
+    static_assert((Alignment & (Alignment - 1)) == 0, "aligned_allocator: alignment must be a power of two");
+    static_assert(Alignment >= alignof(T), "aligned_allocator: alignment is weaker than the type requires");
+
+    using value_type = T;
+    enum { alignment = Alignment };
+
+    template<typename U>
+    struct rebind { using other = aligned_allocator<U, Alignment>; };
+
+    aligned_allocator() {}
+
+    template<typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t count)
+    {
+        if (count == 0)
+        {
+            return nullptr;
+        }
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(detail::aligned_malloc(count * sizeof(T), Alignment));
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+        detail::aligned_free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
+
+    template<typename U>
+    bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_ALLOCATOR
+#include "catch.hpp"
+
+
+TEST_CASE("aligned_allocator returns aligned memory", "[allocator]")
+{
+    SECTION("Default alignment is respected for several sizes")
+    {
+        auto A = nd::aligned_allocator<double>();
+
+        for (std::size_t count : {1, 3, 17, 1000})
+        {
+            auto p = A.allocate(count);
+            REQUIRE(reinterpret_cast<std::uintptr_t>(p) % ND_DEFAULT_ALIGNMENT == 0);
+            A.deallocate(p, count);
+        }
+    }
+
+    SECTION("Custom alignment is respected")
+    {
+        auto A = nd::aligned_allocator<char, 4096>();
+        auto p = A.allocate(10);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(p) % 4096 == 0);
+        A.deallocate(p, 10);
+    }
+
+    SECTION("Zero-sized allocations return null")
+    {
+        REQUIRE(nd::aligned_allocator<int>().allocate(0) == nullptr);
+    }
+}
+
+TEST_CASE("buffer_cache recycles freed blocks by size class", "[allocator] [cache]")
+{
+    auto A = nd::aligned_allocator<double>();
+
+    SECTION("Size classes round up by at most 25%")
+    {
+        REQUIRE(nd::buffer_cache::size_class(1) == 64);
+        REQUIRE(nd::buffer_cache::size_class(512) == 512);
+        REQUIRE(nd::buffer_cache::size_class(513) == 640);
+        REQUIRE(nd::buffer_cache::size_class(1000001) == 1048576);
+    }
+
+    SECTION("A freed block is handed to the next request of its size class")
+    {
+        nd::buffer_cache::enable();
+        nd::buffer_cache::reset_stats();
+
+        auto p = A.allocate(1000);
+        A.deallocate(p, 1000);
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 1);
+
+        auto q = A.allocate(990);
+        REQUIRE(q == p);
+        REQUIRE(nd::buffer_cache::stats().hits == 1);
+        REQUIRE(nd::buffer_cache::stats().misses == 1);
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 0);
+        A.deallocate(q, 990);
+
+        auto r = nd::aligned_allocator<double, 4096>().allocate(1000);
+        REQUIRE(r != p);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(r) % 4096 == 0);
+        nd::aligned_allocator<double, 4096>().deallocate(r, 1000);
+
+        nd::buffer_cache::disable();
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 0);
+        REQUIRE(nd::buffer_cache::stats().cached_bytes == 0);
+    }
+
+    SECTION("The cache respects its capacity limits")
+    {
+        nd::buffer_cache::enable(4096, 2);
+        nd::buffer_cache::reset_stats();
+
+        auto p = std::vector<double*>();
+
+        for (int n = 0; n < 4; ++n)
+        {
+            p.push_back(A.allocate(64));
+        }
+
+        for (auto q : p)
+        {
+            A.deallocate(q, 64);
+        }
+
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 2);
+        REQUIRE(nd::buffer_cache::stats().released_blocks == 2);
+
+        auto big = A.allocate(1024);
+        A.deallocate(big, 1024);
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 2);
+
+        nd::buffer_cache::disable();
+    }
+
+    SECTION("Blocks allocated while the cache was off are released normally")
+    {
+        auto p = A.allocate(1000);
+        nd::buffer_cache::enable();
+        nd::buffer_cache::reset_stats();
+        A.deallocate(p, 1000);
+
+        REQUIRE(nd::buffer_cache::stats().cached_blocks == 0);
+        REQUIRE(nd::buffer_cache::stats().released_blocks == 1);
+        nd::buffer_cache::disable();
+    }
+}
+
+#endif // TEST_ALLOCATOR
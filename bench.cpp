@@ -0,0 +1,447 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <numeric>
+#include "include/ndarray.hpp"
+
+
+
+
+// ============================================================================
+/**
+ * Runs the given function repeatedly for at least a fixed time budget, and
+ * returns the best observed time per call in seconds.
+ */
+template<typename Function>
+static double best_time(Function&& function)
+{
+    using clock = std::chrono::high_resolution_clock;
+    auto best = 1e10;
+    auto total = 0.0;
+
+    while (total < 0.5)
+    {
+        auto start = clock::now();
+        function();
+        auto seconds = std::chrono::duration<double>(clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+static volatile double sink;
+
+static void report(const char* name, double seconds, double amount, const char* unit = "GB/s")
+{
+    std::printf("%-40s %8.3f ms %8.2f %s\n", name, seconds * 1e3, amount / seconds * 1e-9, unit);
+}
+
+
+
+
+// ============================================================================
+static void bench_copy()
+{
+    std::printf("\n-- copies of a 256 MB array of double --\n");
+
+    auto N = 1 << 25;
+    auto bytes = double(N) * sizeof(double);
+    auto A = nd::arange<double>(N);
+    auto S = nd::buffer<double>(A.begin(), A.end());
+    auto str = A.dumps();
+    auto dst = std::vector<double>(N);
+
+    report("memcpy (warm destination)", best_time([&] { std::memcpy(dst.data(), A.data(), bytes); }), bytes);
+    report("malloc + memcpy", best_time([&] { auto d = std::unique_ptr<double[]>(new double[N]); std::memcpy(d.get(), A.data(), bytes); sink = d[N - 1]; }), bytes);
+    report("nd::buffer copy constructor", best_time([&] { nd::buffer<double> B(S); }), bytes);
+    report("ndarray::copy", best_time([&] { A.copy(); }), bytes);
+    report("ndarray::astype<double>", best_time([&] { A.astype<double>(); }), bytes);
+    report("ndarray::loads", best_time([&] { nd::ndarray<double, 1>::loads(str); }), bytes);
+}
+
+
+
+
+// ============================================================================
+static void bench_iterate()
+{
+    std::printf("\n-- iteration over a 256^3 array of double --\n");
+
+    auto _ = nd::axis::all();
+    auto N = 256;
+    auto A = nd::ndarray<double, 3>(N, N, N);
+    const auto& C = A;
+    auto bytes = double(A.size()) * sizeof(double);
+
+    report("const_iterator, whole array", best_time([&] { auto s = 0.0; for (auto x : C) s += x; sink = s; }), bytes);
+    report("const_iterator, every other element", best_time([&] { auto s = 0.0; for (auto x : C.select(_, _, _|0|N|2)) s += x; sink = s; }), bytes / 2);
+    report("iterator, fill whole array", best_time([&] { for (auto& x : A) x = 1.0; }), bytes);
+    report("operator(), whole array", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int k = 0; k < N; ++k)
+                    s += C(i, j, k);
+        sink = s;
+    }), bytes);
+}
+
+
+
+
+// ============================================================================
+static void bench_scalar()
+{
+    std::printf("\n-- element access through rank-0 arrays, 64^3 elements --\n");
+
+    auto N = 64;
+    auto A = nd::ndarray<double, 3>(N, N, N);
+    const auto& C = A;
+    auto count = double(A.size());
+
+    report("operator[] chain, const", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            for (int j = 0; j < N; ++j)
+                for (int k = 0; k < N; ++k)
+                    s += double(C[i][j][k]);
+        sink = s;
+    }), count * sizeof(double));
+    report("rank-0 construct", best_time([&] {
+        auto s = 0.0;
+        for (int n = 0; n < N * N * N; ++n)
+        {
+            nd::ndarray<double, 0> x(n * 1.0);
+            s += double(x);
+        }
+        sink = s;
+    }), count * sizeof(double));
+}
+
+
+
+
+// ============================================================================
+static void bench_cache()
+{
+    std::printf("\n-- (A + B) * C on 2^22 doubles, with the buffer cache or a scratch scope --\n");
+
+    auto N = 1 << 22;
+    auto A = nd::arange<double>(N);
+    auto B = nd::ones<double>(N);
+    auto C = nd::linspace<double>(0, 1, N);
+    auto bytes = 4.0 * N * sizeof(double);
+
+    report("buffer cache disabled", best_time([&] { sink = ((A + B) * C)(0); }), bytes);
+
+    nd::buffer_cache::enable();
+    nd::buffer_cache::reset_stats();
+    report("buffer cache enabled", best_time([&] { sink = ((A + B) * C)(0); }), bytes);
+
+    auto stats = nd::buffer_cache::stats();
+    std::printf("%zu hits, %zu misses\n", stats.hits, stats.misses);
+    nd::buffer_cache::disable();
+
+    nd::scratch_scope scratch(std::size_t(1) << 27);
+    report("scratch_scope", best_time([&] { sink = ((A + B) * C)(0); }), bytes);
+}
+
+
+
+
+// ============================================================================
+static void bench_views()
+{
+#ifdef ND_SINGLE_THREADED
+    std::printf("\n-- creating 2^20 views, ND_SINGLE_THREADED --\n");
+#else
+    std::printf("\n-- creating 2^20 views, std::shared_ptr --\n");
+#endif
+
+    auto _ = nd::axis::all();
+    auto N = 1 << 20;
+    auto A = nd::ndarray<double, 2>(N, 4);
+    auto views = double(N);
+
+    report("operator[] (row views)", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            s += A[i](0);
+        sink = s;
+    }), views, "G views/s");
+    report("select (row views)", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            s += A.select(i, _|0|4)(0);
+        sink = s;
+    }), views, "G views/s");
+    report("take<0> (row blocks)", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            s += A.take<0>(_|i|(i + 1))(0, 0);
+        sink = s;
+    }), views, "G views/s");
+}
+
+
+
+
+// ============================================================================
+template<typename Array>
+static double row_sum(Array row)
+{
+    auto s = 0.0;
+
+    for (int j = 0; j < row.shape(0); ++j)
+        s += row(j);
+
+    return s;
+}
+
+static void bench_kernel_views()
+{
+    std::printf("\n-- per-row kernel over 2^20 rows of 8 doubles --\n");
+
+    auto N = 1 << 20;
+    auto A = nd::ndarray<double, 2>(N, 8);
+    const auto& C = A;
+    auto bytes = double(A.size()) * sizeof(double);
+
+    report("kernel taking const ndarray rows", best_time([&] {
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            s += row_sum(C[i]);
+        sink = s;
+    }), bytes);
+    report("kernel taking ndarray_view rows", best_time([&] {
+        auto V = C.view();
+        auto s = 0.0;
+        for (int i = 0; i < N; ++i)
+            s += row_sum(V[i]);
+        sink = s;
+    }), bytes);
+}
+
+
+
+
+// ============================================================================
+template<typename Allocator>
+static void bench_strided(const char* name, Allocator allocator)
+{
+    auto N = 256;
+    auto A = nd::ndarray<double, 3>({N, N, 2 * N}, allocator);
+    auto V = static_cast<const nd::ndarray<double, 3>&>(A).view();
+    auto bytes = double(A.size()) * sizeof(double);
+
+    report(name, best_time([&] {
+        auto s = 0.0;
+        for (int k = 0; k < 2 * N; ++k)
+            for (int j = 0; j < N; ++j)
+                for (int i = 0; i < N; ++i)
+                    s += V(i, j, k);
+        sink = s;
+    }), bytes);
+}
+
+static void bench_huge_pages()
+{
+    std::printf("\n-- axis-0 innermost iteration over a 256^2 x 512 array of double --\n");
+
+    bench_strided("default allocator", nd::default_allocator<double>());
+    bench_strided("huge_page_allocator", nd::huge_page_allocator<double>());
+}
+
+
+
+
+// ============================================================================
+template<typename Fields>
+static double cell_sweep(Fields& fields)
+{
+    auto V = std::array<nd::ndarray_view<const double, 3>, 5>();
+
+    for (int f = 0; f < 5; ++f)
+        V[f] = static_cast<const nd::ndarray<double, 3>&>(fields[f]).view();
+
+    auto N = V[0].shape(0);
+    auto s = 0.0;
+
+    for (int i = 1; i < N - 1; ++i)
+        for (int j = 1; j < N - 1; ++j)
+            for (int k = 1; k < N - 1; ++k)
+                for (int f = 0; f < 5; ++f)
+                    s += V[f](i + 1, j, k) + V[f](i, j + 1, k) + V[f](i, j, k + 1) - 3 * V[f](i, j, k);
+    return s;
+}
+
+static void bench_groups()
+{
+    std::printf("\n-- 5-field stencil sweep over 128^3 cells --\n");
+
+    auto N = 128;
+    auto bytes = 5.0 * N * N * N * sizeof(double);
+    auto separate = std::vector<nd::ndarray<double, 3>>();
+    auto blocked = nd::array_group<double, 3>(5, {N, N, N}, nd::group_layout::blocked);
+    auto interleaved = nd::array_group<double, 3>(5, {N, N, N}, nd::group_layout::interleaved);
+
+    for (int f = 0; f < 5; ++f)
+        separate.emplace_back(N, N, N);
+
+    report("separate arrays", best_time([&] { sink = cell_sweep(separate); }), bytes);
+    report("array_group, blocked", best_time([&] { sink = cell_sweep(blocked); }), bytes);
+    report("array_group, interleaved", best_time([&] { sink = cell_sweep(interleaved); }), bytes);
+}
+
+
+
+
+// ============================================================================
+template<int R>
+static void bench_contiguous_rank(std::array<int, R> shape)
+{
+    auto A = nd::ndarray<double, R>(shape);
+    auto B = nd::ndarray<double, R>(shape);
+    const auto& C = A;
+    auto bytes = double(A.size()) * sizeof(double);
+    char name[64];
+
+    std::snprintf(name, sizeof(name), "rank %d, assignment A = B", R);
+    report(name, best_time([&] { A = B; }), 2 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, A + B", R);
+    report(name, best_time([&] { sink = (A + B).size(); }), 3 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, A *= 2.0", R);
+    report(name, best_time([&] { A *= 2.0; }), 2 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, range-for sum", R);
+    report(name, best_time([&] { auto s = 0.0; for (auto x : C) s += x; sink = s; }), bytes);
+}
+
+static void bench_contiguous()
+{
+    std::printf("\n-- contiguous arrays of 2^24 doubles, rank 1 to 4 --\n");
+
+    bench_contiguous_rank<1>({1 << 24});
+    bench_contiguous_rank<2>({1 << 12, 1 << 12});
+    bench_contiguous_rank<3>({1 << 8, 1 << 8, 1 << 8});
+    bench_contiguous_rank<4>({1 << 6, 1 << 6, 1 << 6, 1 << 6});
+}
+
+
+
+
+// ============================================================================
+template<typename Array>
+static void bench_strided_traversal(const char* label, Array B)
+{
+    const auto& C = B;
+    auto elements = double(B.size());
+    char name[64];
+
+    std::snprintf(name, sizeof(name), "%s, const_iterator sum", label);
+    report(name, best_time([&] { auto s = 0.0; for (auto x : C) s += x; sink = s; }), elements, "Gelem/s");
+    std::snprintf(name, sizeof(name), "%s, iterator fill", label);
+    report(name, best_time([&] { for (auto& x : B) x = 1.0; }), elements, "Gelem/s");
+    std::snprintf(name, sizeof(name), "%s, std::accumulate", label);
+    report(name, best_time([&] { sink = std::accumulate(C.begin(), C.end(), 0.0); }), elements, "Gelem/s");
+}
+
+static void bench_strided_traversal()
+{
+    std::printf("\n-- traversal of strided selections, e.g. A.select(_|0|N|2, _|1|M|3) --\n");
+
+    auto _ = nd::axis::all();
+    auto N = 512;
+    auto M = 512;
+    auto A = nd::ndarray<double, 2>(N, M);
+    auto D = nd::ndarray<double, 4>(16, 16, 16, 96);
+
+    bench_strided_traversal("rank 2", A.select(_|0|N|2, _|1|M|3));
+    bench_strided_traversal("rank 4", D.select(_|0|16|2, _|0|16|2, _|1|16|2, _|1|96|3));
+}
+
+
+
+
+// ============================================================================
+static void bench_runs()
+{
+    std::printf("\n-- interior sub-blocks A.take<1>(_|1|N-1) of a 256^3 array of double --\n");
+
+    auto _ = nd::axis::all();
+    auto N = 256;
+    auto A = nd::ndarray<double, 3>(N, N, N);
+    auto B = nd::ndarray<double, 3>(N, N, N);
+    auto U = A.take<1>(_|1|(N - 1));
+    auto L = B.take<1>(_|0|(N - 2));
+    auto R = B.take<1>(_|2|N);
+    auto bytes = double(U.size()) * sizeof(double);
+
+    report("assignment U = L", best_time([&] { U = L; }), 2 * bytes);
+    report("L + R", best_time([&] { sink = (L + R).size(); }), 3 * bytes);
+    report("U += L", best_time([&] { U += L; }), 3 * bytes);
+    report("U *= 2.0", best_time([&] { U *= 2.0; }), 2 * bytes);
+    report("for_each_run sum", best_time([&] {
+        auto s = 0.0;
+        R.for_each_run([&s] (const double* p, std::size_t n, std::ptrdiff_t) { for (std::size_t i = 0; i < n; ++i) s += p[i]; });
+        sink = s;
+    }), bytes);
+}
+
+
+
+
+// ============================================================================
+template<int R>
+static void bench_coalesce_rank(std::array<int, R> shape)
+{
+    auto _ = nd::axis::all();
+    auto N = shape[1];
+    auto A = nd::ndarray<double, R>(shape);
+    auto B = nd::ndarray<double, R>(shape);
+    auto U = A.template take<1>(_|1|(N - 1));
+    auto V = B.template take<1>(_|1|(N - 1));
+    const auto& C = V;
+    auto bytes = double(U.size()) * sizeof(double);
+    char name[64];
+
+    std::snprintf(name, sizeof(name), "rank %d, U = V", R);
+    report(name, best_time([&] { U = V; }), 2 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, U + V", R);
+    report(name, best_time([&] { sink = (U + V).size(); }), 3 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, U *= 2.0", R);
+    report(name, best_time([&] { U *= 2.0; }), 2 * bytes);
+    std::snprintf(name, sizeof(name), "rank %d, range-for sum", R);
+    report(name, best_time([&] { auto s = 0.0; for (auto x : C) s += x; sink = s; }), bytes);
+}
+
+static void bench_coalesce()
+{
+    std::printf("\n-- sub-blocks A.take<1>(_|1|N-1) of 2^20-element arrays with short inner axes --\n");
+
+    bench_coalesce_rank<4>({64, 64, 64, 4});
+    bench_coalesce_rank<5>({64, 16, 16, 16, 4});
+}
+
+
+
+
+// ============================================================================
+int main()
+{
+    bench_copy();
+    bench_iterate();
+    bench_scalar();
+    bench_cache();
+    bench_views();
+    bench_kernel_views();
+    bench_huge_pages();
+    bench_groups();
+    bench_contiguous();
+    bench_strided_traversal();
+    bench_runs();
+    bench_coalesce();
+    return 0;
+}
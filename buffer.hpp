@@ -1,4 +1,16 @@
 #pragma once
+#include <memory>
+#include <cstring>
+#include <iterator>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <type_traits>
+#include <limits>
+#include <algorithm>
+#include "allocator.hpp"
+#include "telemetry.hpp"
+#include "scratch.hpp"
 
 
 
@@ -7,105 +19,278 @@
 namespace nd // ND_API_START
 {
     template<typename T> class buffer;
+    template<typename T> class local_shared_ptr;
+
+/**
+ * Arrays refer to their buffers through nd::buffer_ptr, which is a
+ * std::shared_ptr unless the following macro is defined. Programs that never
+ * share arrays (or views of them) between threads may define it to use a
+ * reference count which is not atomic, making views cheaper to create and
+ * destroy. It must be defined the same way in every translation unit.
+ */
+#ifdef ND_SINGLE_THREADED
+    template<typename T> using buffer_ptr = local_shared_ptr<buffer<T>>;
+#else
+    template<typename T> using buffer_ptr = std::shared_ptr<buffer<T>>;
+#endif
+
+    template<typename T, typename... Args> static inline buffer_ptr<T> make_buffer(Args&&... args);
+
+    /**
+     * Tag requesting that a buffer or array be allocated without writing its
+     * elements. Trivially constructible types are left indeterminate; other
+     * types are default-constructed.
+     */
+    struct uninitialized_t {};
+    static constexpr uninitialized_t uninitialized {};
+
+    /**
+     * Tag requesting that a buffer wrap externally owned memory without ever
+     * releasing it. The caller guarantees the memory outlives the buffer.
+     */
+    struct borrowed_t {};
+    static constexpr borrowed_t borrowed {};
 } // ND_API_END
 
 
 
 
 // ============================================================================
-template<typename T> // ND_IMPL_START
-class nd::buffer
+template<typename T, typename... Args> // ND_IMPL_START
+nd::buffer_ptr<T> nd::make_buffer(Args&&... args)
+{
+#ifdef ND_SINGLE_THREADED
+    return local_shared_ptr<buffer<T>>::make(std::forward<Args>(args)...);
+#else
+    if (auto region = scratch_scope::active())
+    {
+        return std::allocate_shared<buffer<T>>(detail::scratch_allocator<buffer<T>>(region), std::forward<Args>(args)...);
+    }
+    return std::allocate_shared<buffer<T>>(detail::object_allocator<buffer<T>>(), std::forward<Args>(args)...);
+#endif
+}
+
+
+
+
+// ============================================================================
+template<typename T>
+class nd::local_shared_ptr
 {
 public:
 
-    buffer() {}
+    /**
+     * A minimal reference-counted pointer, like std::shared_ptr but with a
+     * plain integer count, stored in the same allocation as the object.
+     */
+    local_shared_ptr() {}
+
+    local_shared_ptr(std::nullptr_t) {}
+
+    local_shared_ptr(const local_shared_ptr<T>& other) : block(other.block)
+    {
+        if (block)
+        {
+            ++block->count;
+        }
+    }
+
+    local_shared_ptr(local_shared_ptr<T>&& other) : block(other.block)
+    {
+        other.block = nullptr;
+    }
+
+    ~local_shared_ptr()
+    {
+        release();
+    }
+
+    local_shared_ptr<T>& operator=(local_shared_ptr<T> other)
+    {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    template<typename... Args>
+    static local_shared_ptr<T> make(Args&&... args)
+    {
+        auto ptr = local_shared_ptr<T>();
+        telemetry::allocated_object(sizeof(control_block), "nd::local_shared_ptr block");
+        ptr.block = new control_block(std::forward<Args>(args)...);
+        return ptr;
+    }
 
-    buffer(const buffer<T>& other)
+    void reset()
     {
-        count = other.count;
-        memory = new T[count];
+        release();
+        block = nullptr;
+    }
+
+    T* get() const { return block ? &block->value : nullptr; }
+    T* operator->() const { return &block->value; }
+    T& operator*() const { return block->value; }
+    std::size_t use_count() const { return block ? block->count : 0; }
+    explicit operator bool() const { return block != nullptr; }
+    bool operator==(const local_shared_ptr<T>& other) const { return block == other.block; }
+    bool operator!=(const local_shared_ptr<T>& other) const { return block != other.block; }
+
+private:
+    struct control_block
+    {
+        template<typename... Args>
+        control_block(Args&&... args) : value(std::forward<Args>(args)...) {}
+        std::size_t count = 1;
+        T value;
+    };
 
-        for (int n = 0; n < count; ++n)
+    void release()
+    {
+        if (block && --block->count == 0)
         {
-            memory[n] = other.memory[n];
+            delete block;
         }
     }
 
+    control_block* block = nullptr;
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+class nd::buffer
+{
+public:
+
+    /**
+     * Buffers obtain their memory from an allocator given at construction,
+     * defaulting to nd::default_allocator (64-byte aligned). The allocator is
+     * stored type-erased alongside the memory, so buffers from different
+     * allocators have the same type and can be used interchangeably.
+     */
+    buffer() {}
+
+    buffer(const buffer<T>& other) : buffer(other.begin(), other.end())
+    {
+    }
+
     buffer(buffer<T>&& other)
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
+        swap(other);
+    }
 
-        other.memory = nullptr;
-        other.count = 0;
+    explicit buffer(std::size_t count, const T& value = T())
+    : buffer(count, value, default_allocator<T>())
+    {
     }
 
-    explicit buffer(std::size_t count, const T& value = T()) : count(count)
+    template<typename Allocator>
+    buffer(std::size_t count, const T& value, Allocator allocator)
     {
-        memory = new T[count];
+        acquire(count, allocator);
 
-        for (std::size_t n = 0; n < count; ++n)
+        try {
+            std::uninitialized_fill_n(memory, count, value);
+        }
+        catch (...)
         {
-            memory[n] = value;
+            discard();
+            throw;
         }
     }
 
-    template< class InputIt >
-    buffer(InputIt first, InputIt last)
+    template<typename Allocator = default_allocator<T>>
+    buffer(std::size_t count, uninitialized_t, Allocator allocator = Allocator())
     {
-        {
-            auto it = first;
-            count = 0;
+        acquire(count, allocator);
 
-            while (it != last)
+        if (! std::is_trivially_default_constructible<T>::value)
+        {
+            try {
+                std::uninitialized_fill_n(memory, count, T());
+            }
+            catch (...)
             {
-                ++it;
-                ++count;
+                discard();
+                throw;
             }
-            memory = new T[count];
         }
+    }
 
-        {
-            auto it = first;
-            auto n = 0;
+    template<class InputIt, typename = typename std::enable_if<! std::is_integral<InputIt>::value>::type>
+    buffer(InputIt first, InputIt last) : buffer(first, last, default_allocator<T>())
+    {
+    }
 
-            while (it != last)
-            {
-                memory[n] = *it;
-                ++it;
-                ++n;
-            }
+    template<class InputIt, typename Allocator, typename = typename std::enable_if<! std::is_integral<InputIt>::value>::type>
+    buffer(InputIt first, InputIt last, Allocator allocator)
+    {
+        acquire(distance(first, last, typename std::iterator_traits<InputIt>::iterator_category()), allocator);
+
+        try {
+            copy_construct(first, last);
+        }
+        catch (...)
+        {
+            discard();
+            throw;
         }
     }
 
-    ~buffer()
+    /**
+     * Adopts count elements of existing memory, which are released by calling
+     * deleter(data) when the buffer is destroyed. The elements are neither
+     * constructed nor destroyed by the buffer.
+     */
+    template<typename Deleter>
+    buffer(T* data, std::size_t count, Deleter deleter)
+    : memory(data)
+    , count(count)
+    , deleter([deleter] (T* ptr, std::size_t) mutable { deleter(ptr); })
+    , owns_elements(false)
     {
-        delete [] memory;
     }
 
-    buffer<T>& operator=(const buffer<T>& other)
+    buffer(T* data, std::size_t count, borrowed_t)
+    : memory(data)
+    , count(count)
+    , deleter([] (T*, std::size_t) {})
+    , owns_elements(false)
     {
-        delete [] memory;
+    }
 
-        count = other.count;
-        memory = new T[count];
+    ~buffer()
+    {
+        if (source)
+        {
+            unregister();
+        }
+        destroy();
+    }
 
-        for (int n = 0; n < count; ++n)
+    buffer<T>& operator=(const buffer<T>& other)
+    {
+        if (this != &other
+            && count == other.count
+            && owns_elements
+            && ! source
+            && snapshots.empty()
+            && std::is_trivially_copyable<T>::value)
         {
-            memory[n] = other.memory[n];
+            copy_construct(other.begin(), other.end());
+            return *this;
         }
+        auto copy = other;
+        swap(copy);
         return *this;
     }
 
     buffer<T>& operator=(buffer<T>&& other)
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
-
-        other.memory = nullptr;
-        other.count = 0;
+        separate();
+        destroy();
+        swap(other);
         return *this;
     }
 
@@ -115,20 +300,72 @@ public:
         {
             return false;
         }
+        return equal_elements(other, std::integral_constant<bool, std::is_integral<T>::value>());
+    }
+
+    bool operator!=(const buffer<T>& other) const
+    {
+        return ! operator==(other);
+    }
+
+    /**
+     * Buffers sharing memory copy-on-write are separated before their
+     * storage is exchanged.
+     */
+    void swap(buffer<T>& other)
+    {
+        separate();
+        other.separate();
+        std::swap(memory, other.memory);
+        std::swap(count, other.count);
+        std::swap(deleter, other.deleter);
+        std::swap(owns_elements, other.owns_elements);
+    }
+
+    /**
+     * Returns a buffer that shares this buffer's memory copy-on-write. The
+     * memory stays shared until either side calls prepare_write: a snapshot
+     * being written takes its own copy, and the original being written makes
+     * one copy of the data as it was, which all of its snapshots then share.
+     * Snapshots of snapshots share memory with the original. Snapshots of a
+     * buffer may be taken, written and released on any thread (the registry
+     * is guarded by a mutex unless ND_SINGLE_THREADED is defined), but the
+     * original should not be written while its snapshots are in use on other
+     * threads.
+     */
+    static buffer_ptr<T> snapshot(const buffer_ptr<T>& buf)
+    {
+        auto snap = make_buffer<T>();
+        auto lock = lock_registry();
+        auto root = buf->source ? buf->source : buf;
+
+        snap->memory = root->memory;
+        snap->count = root->count;
+        snap->deleter = [] (T*, std::size_t) {};
+        snap->source = root;
+        register_snapshot(*root, snap.get());
+        return snap;
+    }
 
-        for (std::size_t n = 0; n < size(); ++n)
+    /**
+     * Must be called before writing to the buffer's memory. It is cheap when
+     * the buffer has no copy-on-write relationships.
+     */
+    void prepare_write()
+    {
+        if (source || ! snapshots.empty())
         {
-            if (memory[n] != other.memory[n])            
-            {
-                return false;
-            }
+            separate();
         }
-        return true;
     }
 
-    bool operator!=(const buffer<T>& other) const
+    /**
+     * Returns the buffer which owns this buffer's memory: the buffer itself,
+     * or the one it is a copy-on-write snapshot of.
+     */
+    const buffer<T>* root() const
     {
-        return ! operator==(other);
+        return source ? source.get() : this;
     }
 
     std::size_t size() const
@@ -163,8 +400,236 @@ public:
     const T* end() const { return memory + count; }
 
 private:
+    void separate()
+    {
+        if (source)
+        {
+            detach();
+        }
+        if (! snapshots.empty())
+        {
+            release_snapshots();
+        }
+    }
+
+    /**
+     * Moves every snapshot of this buffer onto a single copy of its data,
+     * which then becomes their shared source.
+     */
+    void release_snapshots()
+    {
+        ND_OPERATION("copy-on-write separation");
+
+        auto copy = make_buffer<T>(begin(), end());
+        auto lock = lock_registry();
+
+        for (auto snap : snapshots)
+        {
+            snap->memory = copy->memory;
+            snap->source = copy;
+        }
+        std::swap(copy->snapshots, snapshots);
+    }
+
+    void detach()
+    {
+        ND_OPERATION("copy-on-write separation");
+
+        auto copy = buffer<T>(begin(), end());
+        unregister();
+        source.reset();
+        std::swap(memory, copy.memory);
+        std::swap(count, copy.count);
+        std::swap(deleter, copy.deleter);
+        std::swap(owns_elements, copy.owns_elements);
+    }
+
+    /**
+     * Iterator ranges are measured in one step when the iterator allows it,
+     * and trivially copyable elements are copied with a single memcpy. Only
+     * integral types are compared with memcmp, since floating point values
+     * such as -0.0 and NaN compare differently from their bytes.
+     */
+    template<class InputIt>
+    static std::size_t distance(InputIt first, InputIt last, std::random_access_iterator_tag)
+    {
+        return last - first;
+    }
+
+    template<class InputIt>
+    static std::size_t distance(InputIt first, InputIt last, std::input_iterator_tag)
+    {
+        std::size_t size = 0;
+
+        while (first != last)
+        {
+            ++first;
+            ++size;
+        }
+        return size;
+    }
+
+    template<class InputIt>
+    void copy_construct(InputIt first, InputIt last)
+    {
+        std::uninitialized_copy(first, last, memory);
+    }
+
+    void copy_construct(T* first, T* last)
+    {
+        copy_construct(static_cast<const T*>(first), static_cast<const T*>(last));
+    }
+
+    void copy_construct(const T* first, const T* last)
+    {
+        copy_elements(first, last, std::integral_constant<bool, std::is_trivially_copyable<T>::value>());
+    }
+
+    void copy_elements(const T* first, const T* last, std::true_type)
+    {
+        if (first != last)
+        {
+            std::memcpy(memory, first, (last - first) * sizeof(T));
+        }
+    }
+
+    void copy_elements(const T* first, const T* last, std::false_type)
+    {
+        std::uninitialized_copy(first, last, memory);
+    }
+
+    bool equal_elements(const buffer<T>& other, std::true_type) const
+    {
+        return count == 0 || std::memcmp(memory, other.memory, count * sizeof(T)) == 0;
+    }
+
+    bool equal_elements(const buffer<T>& other, std::false_type) const
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            if (memory[n] != other.memory[n])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void register_snapshot(buffer<T>& root, buffer<T>* snap)
+    {
+        auto capacity = root.snapshots.capacity();
+        root.snapshots.push_back(snap);
+
+        if (root.snapshots.capacity() != capacity)
+        {
+            telemetry::allocated_object(root.snapshots.capacity() * sizeof(snap), "nd::buffer snapshot registry");
+        }
+    }
+
+    void unregister()
+    {
+        auto lock = lock_registry();
+        auto& list = source->snapshots;
+        list.erase(std::remove(list.begin(), list.end(), this), list.end());
+    }
+
+    static std::unique_lock<std::mutex> lock_registry()
+    {
+#ifdef ND_SINGLE_THREADED
+        return std::unique_lock<std::mutex>();
+#else
+        static std::mutex mutex;
+        return std::unique_lock<std::mutex>(mutex);
+#endif
+    }
+
+    template<typename Allocator>
+    void acquire(std::size_t size, Allocator allocator)
+    {
+        using rebound = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        auto alloc = rebound(allocator);
+
+        if (std::is_same<rebound, default_allocator<T>>::value && acquire_scratch(size))
+        {
+            return;
+        }
+        memory = alloc.allocate(size);
+        count = size;
+        owns_elements = true;
+
+        if (! memory)
+        {
+            deleter = [alloc] (T* ptr, std::size_t size) mutable { alloc.deallocate(ptr, size); };
+            return;
+        }
+        auto recorded = telemetry::allocated<T>(size * sizeof(T));
+
+        deleter = [alloc, recorded] (T* ptr, std::size_t size) mutable
+        {
+            telemetry::deallocated<T>(size * sizeof(T), recorded);
+            alloc.deallocate(ptr, size);
+        };
+    }
+
+    /**
+     * Takes the memory from the active scratch_scope, if there is one and it
+     * has room. The deleter holds a reference to the scratch region.
+     */
+    bool acquire_scratch(std::size_t size)
+    {
+        auto region = scratch_scope::active();
+
+        if (! region || size == 0 || size > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            return false;
+        }
+        memory = static_cast<T*>(region->allocate(size * sizeof(T), std::max<std::size_t>(ND_DEFAULT_ALIGNMENT, alignof(T))));
+
+        if (! memory)
+        {
+            return false;
+        }
+        count = size;
+        owns_elements = true;
+
+        auto recorded = telemetry::allocated<T>(size * sizeof(T));
+
+        deleter = [region, recorded] (T* ptr, std::size_t size)
+        {
+            telemetry::deallocated<T>(size * sizeof(T), recorded);
+            region->release(ptr, size * sizeof(T));
+        };
+        return true;
+    }
+
+    void destroy()
+    {
+        if (owns_elements && ! std::is_trivially_destructible<T>::value)
+        {
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                memory[n].~T();
+            }
+        }
+        discard();
+    }
+
+    void discard()
+    {
+        if (memory)
+        {
+            deleter(memory, count);
+        }
+        memory = nullptr;
+        count = 0;
+    }
+
     T* memory = nullptr;
     std::size_t count = 0;
+    std::function<void(T*, std::size_t)> deleter;
+    bool owns_elements = false;
+    buffer_ptr<T> source;
+    std::vector<buffer<T>*> snapshots;
 }; // ND_IMPL_END
 
 
@@ -172,6 +637,7 @@ private:
 
 // ============================================================================
 #ifdef TEST_BUFFER
+#include <list>
 #include "catch.hpp"
 
 
@@ -193,6 +659,30 @@ TEST_CASE("buffer can be constructed from", "[buffer]")
         REQUIRE(B[99] == 1.5);
     }
 
+    SECTION("Can instantiate a buffer with a custom allocator")
+    {
+        nd::buffer<double> B(100, 1.5, std::allocator<double>());
+        REQUIRE(B.size() == 100);
+        REQUIRE(B[0] == 1.5);
+        REQUIRE(B[99] == 1.5);
+    }
+
+    SECTION("Default-allocated buffers are aligned")
+    {
+        nd::buffer<double> B(100);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(B.data()) % ND_DEFAULT_ALIGNMENT == 0);
+    }
+
+    SECTION("Can instantiate an uninitialized buffer")
+    {
+        nd::buffer<double> B(100, nd::uninitialized);
+        nd::buffer<std::string> C(10, nd::uninitialized);
+        REQUIRE(B.size() == 100);
+        REQUIRE(B.data() != nullptr);
+        REQUIRE(C.size() == 10);
+        REQUIRE(C[9].empty());
+    }
+
     SECTION("Can instantiate a buffer from input iterator")
     {
         std::vector<int> A{0, 1, 2, 3};
@@ -204,6 +694,48 @@ TEST_CASE("buffer can be constructed from", "[buffer]")
         REQUIRE(B[3] == 3);
     }
 
+    SECTION("Can adopt or borrow external memory")
+    {
+        auto released = 0;
+        auto data = new double[4] {0, 1, 2, 3};
+        auto vec = std::vector<double>{0, 1, 2};
+        {
+            nd::buffer<double> B(data, 4, [&released] (double* p) { delete [] p; ++released; });
+            nd::buffer<double> C(vec.data(), vec.size(), nd::borrowed);
+            REQUIRE(B.data() == data);
+            REQUIRE(B[3] == 3);
+            REQUIRE(C.data() == vec.data());
+            C[2] = 5;
+        }
+        REQUIRE(released == 1);
+        REQUIRE(vec[2] == 5);
+    }
+
+    SECTION("Snapshots share memory until either side is written")
+    {
+        auto A = nd::make_buffer<double>(100, 1.5);
+        auto B = nd::buffer<double>::snapshot(A);
+        auto C = nd::buffer<double>::snapshot(A);
+        auto D = nd::buffer<double>::snapshot(B);
+
+        REQUIRE(B->data() == A->data());
+        REQUIRE(D->root() == A.get());
+
+        B->prepare_write();
+        (*B)[0] = 2.0;
+        REQUIRE(B->data() != A->data());
+        REQUIRE(B->root() == B.get());
+        REQUIRE((*A)[0] == 1.5);
+
+        A->prepare_write();
+        (*A)[1] = 3.0;
+        REQUIRE(C->data() != A->data());
+        REQUIRE(D->data() == C->data());
+        REQUIRE(D->root() == C->root());
+        REQUIRE((*C)[1] == 1.5);
+        REQUIRE((*D)[1] == 1.5);
+    }
+
     SECTION("Can move-construct and move-assign a buffer")
     {
         nd::buffer<double> A(100, 1.5);
@@ -227,6 +759,25 @@ TEST_CASE("buffer can be constructed from", "[buffer]")
         REQUIRE(C[99] == 1.5);
     }
 
+    SECTION("Can copy-construct and copy-assign a buffer")
+    {
+        nd::buffer<int> A(100, 3);
+        nd::buffer<int> B(A);
+        nd::buffer<int> C(100, 4);
+        nd::buffer<std::string> D(10, "ten");
+        nd::buffer<std::string> E(D);
+        auto list = std::list<double>{0, 1, 2};
+        nd::buffer<double> F(list.begin(), list.end());
+
+        C = A;
+        REQUIRE(B == A);
+        REQUIRE(C == A);
+        REQUIRE(B.data() != A.data());
+        REQUIRE(E == D);
+        REQUIRE(F.size() == 3);
+        REQUIRE(F[2] == 2);
+    }
+
     SECTION("Equality operators between buffers work correctly")
     {
         nd::buffer<double> A(100, 1.5);   
@@ -257,4 +808,28 @@ TEST_CASE("buffer can be constructed from", "[buffer]")
 }
 
 
+TEST_CASE("buffer reports its allocations to telemetry", "[buffer] [telemetry]")
+{
+    nd::telemetry::enable();
+    nd::telemetry::reset();
+    nd::telemetry_scope scope;
+    {
+        auto A = nd::buffer<char>(1000);
+        auto B = nd::buffer<char>(A);
+        auto C = nd::buffer<char>(A.data(), A.size(), nd::borrowed);
+
+        REQUIRE(nd::telemetry::of<char>().live_bytes == 2000);
+        REQUIRE(nd::telemetry::of<char>().allocations == 2);
+    }
+    nd::telemetry::disable();
+
+    auto D = nd::buffer<char>(10);
+
+    REQUIRE(nd::telemetry::of<char>().live_bytes == 0);
+    REQUIRE(nd::telemetry::of<char>().deallocations == 2);
+    REQUIRE(scope.allocations() == 3);
+    REQUIRE(scope.net_bytes() == 10);
+}
+
+
 #endif // TEST_BUFFER
\ No newline at end of file
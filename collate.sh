@@ -3,11 +3,41 @@
 cat << EOF
 #pragma once
 #include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <typeinfo>
+#include <typeindex>
 #include <numeric>
 #include <string>
 #include <memory>
 #include <cstring>
 #include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <initializer_list>
+#include <cstdlib>
+#include <tuple>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 EOF
 
 
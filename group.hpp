@@ -0,0 +1,167 @@
+#pragma once
+#include <array>
+#include <stdexcept>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    /**
+     * How the fields of an array_group are laid out in memory: one after
+     * another (each field contiguous), or interleaved so that the values of
+     * all fields at a given cell are adjacent.
+     */
+    enum class group_layout { blocked, interleaved };
+
+    template<typename T, int R> class array_group;
+} // ND_API_END
+
+
+
+
+// ============================================================================
+template<typename T, int R> // ND_IMPL_START
+class nd::array_group
+{
+public:
+
+    /**
+     * A number of same-shape arrays (fields) packed into a single buffer.
+     * Fields are ordinary ndarray's sharing that buffer, so kernels written
+     * for separate arrays work unchanged, and the layout can be chosen for
+     * the access pattern: blocked fields stream as separate contiguous
+     * ranges, while interleaved fields keep everything a stencil needs at a
+     * cell within the same cache lines and pages.
+     */
+
+    static_assert(R > 0, "array_group: rank must be at least 1");
+
+    using dtype = T;
+    enum { rank = R };
+
+    template<typename Allocator = default_allocator<T>>
+    array_group(int num_fields, std::array<int, R> shape, group_layout layout = group_layout::blocked, Allocator allocator = Allocator())
+    : num_fields(num_fields)
+    , dims(shape)
+    , arrangement(layout)
+    , storage(storage_shape(num_fields, shape, layout), allocator)
+    {
+    }
+
+
+
+
+    // ========================================================================
+    int size() const { return num_fields; }
+    std::array<int, R> shape() const { return dims; }
+    group_layout layout() const { return arrangement; }
+
+    /**
+     * Returns the given field, sharing the group's memory. Fields of a
+     * blocked group are contiguous; fields of an interleaved group have a
+     * stride of size() elements along the last axis.
+     */
+    ndarray<T, R> operator[](int field)
+    {
+        check_field(field);
+
+        if (arrangement == group_layout::blocked)
+        {
+            return storage.template take<0>(axis::range(field * dims[0], (field + 1) * dims[0]));
+        }
+        return storage.template take<R - 1>(axis::selection(field, dims[R - 1] * num_fields, num_fields));
+    }
+
+    typename ndarray<T, R>::const_ref operator[](int field) const
+    {
+        check_field(field);
+
+        if (arrangement == group_layout::blocked)
+        {
+            return storage.template take<0>(axis::range(field * dims[0], (field + 1) * dims[0]));
+        }
+        return storage.template take<R - 1>(axis::selection(field, dims[R - 1] * num_fields, num_fields));
+    }
+
+private:
+    static std::array<int, R> storage_shape(int num_fields, std::array<int, R> shape, group_layout layout)
+    {
+        if (num_fields < 0)
+        {
+            throw std::invalid_argument("array_group: number of fields must be non-negative");
+        }
+        if (layout == group_layout::blocked)
+        {
+            shape[0] *= num_fields;
+        }
+        else
+        {
+            shape[R - 1] *= num_fields;
+        }
+        return shape;
+    }
+
+    void check_field(int field) const
+    {
+        if (field < 0 || field >= num_fields)
+        {
+            throw std::out_of_range("array_group: field index out of range");
+        }
+    }
+
+    int num_fields;
+    std::array<int, R> dims;
+    group_layout arrangement;
+    ndarray<T, R> storage;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_GROUP
+#include "catch.hpp"
+
+
+TEST_CASE("array_group packs same-shape fields into one buffer", "[group]")
+{
+    for (auto layout : {nd::group_layout::blocked, nd::group_layout::interleaved})
+    {
+        auto G = nd::array_group<double, 2>(3, {4, 5}, layout);
+        auto rho = G[0];
+        auto vx = G[1];
+        auto vy = G[2];
+
+        rho = 1.0;
+        vx = 2.0;
+        vy(3, 4) = 3.0;
+
+        REQUIRE(G.size() == 3);
+        REQUIRE(rho.shape() == std::array<int, 2>{4, 5});
+        REQUIRE(rho.shares(vx));
+        REQUIRE((G[0] == 1.0).all());
+        REQUIRE((G[1] == 2.0).all());
+        REQUIRE(G[2](3, 4) == 3.0);
+        REQUIRE(G[2](3, 3) == 0.0);
+        REQUIRE(rho.view().contiguous() == (layout == nd::group_layout::blocked));
+        REQUIRE_THROWS_AS(G[3], std::out_of_range);
+    }
+}
+
+
+TEST_CASE("array_group layouts place fields as requested", "[group]")
+{
+    auto B = nd::array_group<int, 1>(2, {3}, nd::group_layout::blocked);
+    auto I = nd::array_group<int, 1>(2, {3}, nd::group_layout::interleaved);
+    const auto& Bc = B;
+    const auto& Ic = I;
+
+    REQUIRE(Bc[1].view().data() - Bc[0].view().data() == 3);
+    REQUIRE(Ic[1].view().data() - Ic[0].view().data() == 1);
+    REQUIRE(Ic[1].view().strides()[0] == 2);
+}
+
+#endif // TEST_GROUP
@@ -0,0 +1,257 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+#include "ndarray.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int R, typename Allocator = default_allocator<T>> class growable_array;
+} // ND_API_END
+
+
+
+
+// ============================================================================
+template<typename T, int R, typename Allocator> // ND_IMPL_START
+class nd::growable_array
+{
+public:
+
+    /**
+     * An array that grows along its leading axis, for data arriving a row (or
+     * a block of rows) at a time. Its buffer reserves capacity for more rows
+     * than are filled, and the capacity doubles whenever it runs out, so
+     * appending is amortized O(1) per row.
+     *
+     * array() returns an ndarray sharing the filled rows. Such arrays stay
+     * valid when the growable array reallocates, since they keep the old
+     * buffer alive, but they are then detached from it: they do not see rows
+     * appended afterwards, and writes through them are not seen by the
+     * growable array. Reallocation increments generation(), and is_current
+     * says whether an array still shares the current buffer. Appending
+     * within the capacity never invalidates arrays already handed out.
+     */
+
+    static_assert(R >= 1, "growable_array: rank must be at least 1");
+
+    using dtype = T;
+    enum { rank = R };
+
+    growable_array(std::array<int, R - 1> row_shape = {}, std::size_t capacity = 0, Allocator allocator = Allocator())
+    : row_shape(row_shape)
+    , row_size(1)
+    , allocator(allocator)
+    {
+        for (auto n : row_shape)
+        {
+            row_size *= n;
+        }
+
+        reallocate(capacity);
+    }
+
+
+
+
+    // ========================================================================
+    std::size_t rows() const { return num_rows; }
+    std::size_t capacity() const { return capacity_rows; }
+    std::size_t size() const { return num_rows * row_size; }
+    std::size_t generation() const { return num_reallocations; }
+
+    std::array<int, R> shape() const
+    {
+        auto s = std::array<int, R>();
+        s[0] = int(num_rows);
+        std::copy(row_shape.begin(), row_shape.end(), s.begin() + 1);
+        return s;
+    }
+
+    /**
+     * Ensures there is room for at least the given number of rows.
+     */
+    void reserve(std::size_t rows)
+    {
+        if (rows > capacity_rows)
+        {
+            reallocate(rows);
+        }
+    }
+
+    /**
+     * Returns an ndarray of the filled rows, sharing this array's memory.
+     */
+    ndarray<T, R> array()
+    {
+        auto dims = shape();
+        dims[0] = int(capacity_rows);
+        return ndarray<T, R>(dims, buf).template take<0>(axis::range(0, int(num_rows)));
+    }
+
+    const ndarray<T, R> array() const
+    {
+        auto dims = shape();
+        dims[0] = int(capacity_rows);
+        auto shared = buffer_ptr<T>(buf);
+        return ndarray<T, R>(dims, shared).template take<0>(axis::range(0, int(num_rows)));
+    }
+
+    template<int Rank>
+    bool is_current(const ndarray<T, Rank>& view) const
+    {
+        return array().shares(view);
+    }
+
+
+
+
+    // ========================================================================
+    template<int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    void append(const T& value)
+    {
+        grow(1);
+        buf->data()[num_rows] = value;
+        num_rows += 1;
+    }
+
+    template<int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    void append(const ndarray<T, R - 1>& row)
+    {
+        if (row.shape() != row_shape)
+        {
+            throw std::invalid_argument("growable_array::append: row shape does not match");
+        }
+        grow(1);
+        std::copy(row.begin(), row.end(), buf->data() + num_rows * row_size);
+        num_rows += 1;
+    }
+
+    void extend(const ndarray<T, R>& block)
+    {
+        for (int n = 1; n < R; ++n)
+        {
+            if (block.shape(n) != row_shape[n - 1])
+            {
+                throw std::invalid_argument("growable_array::extend: block shape does not match");
+            }
+        }
+        grow(block.shape(0));
+        std::copy(block.begin(), block.end(), buf->data() + num_rows * row_size);
+        num_rows += block.shape(0);
+    }
+
+private:
+    /**
+     * Makes room for count more rows, and separates the buffer from any
+     * copy-on-write snapshots taken of arrays sharing it.
+     */
+    void grow(std::size_t count)
+    {
+        if (num_rows + count > capacity_rows)
+        {
+            reallocate(std::max(num_rows + count, 2 * capacity_rows));
+        }
+        buf->prepare_write();
+    }
+
+    void reallocate(std::size_t capacity)
+    {
+        auto next = make_buffer<T>(capacity * row_size, uninitialized, allocator);
+
+        if (buf)
+        {
+            std::copy(buf->begin(), buf->begin() + num_rows * row_size, next->begin());
+            num_reallocations += 1;
+        }
+        buf = next;
+        capacity_rows = capacity;
+    }
+
+    std::array<int, R - 1> row_shape;
+    std::size_t row_size;
+    std::size_t num_rows = 0;
+    std::size_t capacity_rows = 0;
+    std::size_t num_reallocations = 0;
+    Allocator allocator;
+    buffer_ptr<T> buf;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_GROWABLE
+#include "catch.hpp"
+
+
+TEST_CASE("growable_array appends rows in amortized constant time", "[growable]")
+{
+    SECTION("Rank-1 arrays grow by single values")
+    {
+        auto A = nd::growable_array<double, 1>();
+
+        for (int n = 0; n < 100; ++n)
+        {
+            A.append(n);
+        }
+
+        REQUIRE(A.rows() == 100);
+        REQUIRE(A.capacity() == 128);
+        REQUIRE(A.generation() == 8);
+        REQUIRE((A.array() == nd::arange<double>(100)).all());
+    }
+
+    SECTION("Rows and blocks of rows can be appended")
+    {
+        auto A = nd::growable_array<int, 2>({3}, 4);
+        A.append(nd::ndarray<int, 1>{1, 2, 3});
+        A.extend(nd::ndarray<int, 2>(2, 3) + 7);
+
+        REQUIRE(A.shape() == std::array<int, 2>{3, 3});
+        REQUIRE(A.generation() == 0);
+        REQUIRE(A.array()(0, 2) == 3);
+        REQUIRE(A.array()(2, 1) == 7);
+        REQUIRE_THROWS_AS(A.append(nd::ndarray<int, 1>(4)), std::invalid_argument);
+        REQUIRE_THROWS_AS(A.extend(nd::ndarray<int, 2>(1, 2)), std::invalid_argument);
+    }
+
+    SECTION("Arrays of the filled rows stay valid as the buffer grows")
+    {
+        auto A = nd::growable_array<int, 2>({2}, 2);
+        A.append(nd::ndarray<int, 1>{1, 2});
+        auto B = A.array();
+
+        A.append(nd::ndarray<int, 1>{3, 4});
+        REQUIRE(A.is_current(B));
+        REQUIRE(B.shape(0) == 1);
+
+        A.append(nd::ndarray<int, 1>{5, 6});
+        REQUIRE_FALSE(A.is_current(B));
+        REQUIRE(A.is_current(A.array()[2]));
+        REQUIRE(static_cast<const nd::growable_array<int, 2>&>(A).is_current(A.array()));
+        REQUIRE(static_cast<const nd::growable_array<int, 2>&>(A).array()(2, 0) == 5);
+        REQUIRE(B(0, 1) == 2);
+        REQUIRE(A.array()(2, 1) == 6);
+    }
+
+    SECTION("Copy-on-write copies of the filled rows are not disturbed by appends")
+    {
+        auto A = nd::growable_array<int, 1>({}, 8);
+        A.append(1);
+        const auto B = A.array();
+        auto C = B;
+        A.append(2);
+
+        REQUIRE(C.size() == 1);
+        REQUIRE(C(0) == 1);
+        REQUIRE(A.array()(1) == 2);
+    }
+}
+
+#endif // TEST_GROWABLE
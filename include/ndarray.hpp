@@ -1,10 +1,40 @@
 #pragma once
 #include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <typeinfo>
+#include <typeindex>
 #include <numeric>
 #include <string>
 #include <memory>
 #include <cstring>
 #include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <initializer_list>
+#include <cstdlib>
+#include <tuple>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 
 
@@ -46,10 +76,29 @@ namespace nd
         }
         while (it != end)
         {
-            sel.count[n++] = int(*it++);
+            sel.count[n++] = std::ptrdiff_t(*it++);
         }
         return sel;
     }
+
+    namespace detail
+    {
+        /**
+         * Merges adjacent axes that can be traversed as one, in place: axes n
+         * and n + 1 merge when every set of strides has strides[n] equal to
+         * shape[n + 1] * strides[n + 1], so that stepping off the end of axis
+         * n + 1 lands on the next element of axis n. Merged axes are packed
+         * to the end, and the leading axes left over get length 1, so row-
+         * major traversal visits the same elements in the same order with a
+         * shorter loop nest and longer inner runs. Returns the number of
+         * axes remaining (at least 1). Shapes containing zero are left alone,
+         * as are merges whose length would not fit in an int. If outer is
+         * given, each remaining axis k records in (*outer)[k] the outermost
+         * original axis merged into it.
+         */
+        template<int R, std::size_t N>
+        static inline int coalesce_axes(std::array<int, R>& shape, std::array<std::array<std::ptrdiff_t, R>, N>& strides, std::array<int, R>* outer = nullptr);
+    }
 } 
 
 
@@ -126,10 +175,165 @@ namespace nd
 
 
 
+// ============================================================================
+namespace nd 
+{
+/**
+ * Default alignment (in bytes) of memory handed out by nd::aligned_allocator.
+ * 64 bytes is one cache line on most hardware and satisfies AVX-512 loads.
+ */
+#ifndef ND_DEFAULT_ALIGNMENT
+#define ND_DEFAULT_ALIGNMENT 64
+#endif
+
+    template<typename T, std::size_t Alignment = ND_DEFAULT_ALIGNMENT> struct aligned_allocator;
+    struct buffer_cache_stats;
+    class buffer_cache;
+
+    namespace detail
+    {
+        /**
+         * Allocates memory aligned to the given boundary. The block is
+         * over-allocated, and a block_header just before the aligned pointer
+         * records the address returned by operator new, along with the usable
+         * size and alignment of the block, so that aligned_free (and the
+         * buffer cache) can recover them.
+         */
+        static inline void* aligned_malloc(std::size_t bytes, std::size_t alignment);
+        static inline void aligned_free(void* ptr);
+
+        struct block_header
+        {
+            void* raw;
+            std::size_t bytes;
+            std::size_t alignment;
+        };
+    }
+
+/**
+ * The allocator used by nd::buffer, and hence by ndarray constructors and
+ * factories, when none is given explicitly.
+ */
+    template<typename T> using default_allocator = aligned_allocator<T, ND_DEFAULT_ALIGNMENT>;
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    struct allocation_stats;
+    class telemetry;
+    class telemetry_scope;
+    class allocation_guard;
+    template<typename T> struct dtype_str;
+
+    namespace detail
+    {
+        template<typename T, typename = void> struct dtype_label;
+        struct telemetry_record;
+        class operation_label;
+        template<typename T> struct object_allocator;
+    }
+
+/**
+ * Operations which may allocate (copies, expression temporaries, reshapes of
+ * non-contiguous views, copy-on-write separation, and so on) label
+ * themselves, so that an allocation_guard can say which one allocated. The
+ * labels cost a thread-local store per operation, and are compiled in
+ * unless NDEBUG is defined; define ND_TRACE_ALLOCATIONS to keep them in
+ * release builds.
+ */
+#if ! defined(NDEBUG) || defined(ND_TRACE_ALLOCATIONS)
+#define ND_OPERATION(name) nd::detail::operation_label nd_operation_label(name)
+#else
+#define ND_OPERATION(name)
+#endif
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    class scratch_scope;
+
+    namespace detail
+    {
+        class scratch_region;
+        template<typename T> struct scratch_allocator;
+    }
+} 
+
+
+
+
 // ============================================================================
 namespace nd 
 {
     template<typename T> class buffer;
+    template<typename T> class local_shared_ptr;
+
+/**
+ * Arrays refer to their buffers through nd::buffer_ptr, which is a
+ * std::shared_ptr unless the following macro is defined. Programs that never
+ * share arrays (or views of them) between threads may define it to use a
+ * reference count which is not atomic, making views cheaper to create and
+ * destroy. It must be defined the same way in every translation unit.
+ */
+#ifdef ND_SINGLE_THREADED
+    template<typename T> using buffer_ptr = local_shared_ptr<buffer<T>>;
+#else
+    template<typename T> using buffer_ptr = std::shared_ptr<buffer<T>>;
+#endif
+
+    template<typename T, typename... Args> static inline buffer_ptr<T> make_buffer(Args&&... args);
+
+    /**
+     * Tag requesting that a buffer or array be allocated without writing its
+     * elements. Trivially constructible types are left indeterminate; other
+     * types are default-constructed.
+     */
+    struct uninitialized_t {};
+    static constexpr uninitialized_t uninitialized {};
+
+    /**
+     * Tag requesting that a buffer wrap externally owned memory without ever
+     * releasing it. The caller guarantees the memory outlives the buffer.
+     */
+    struct borrowed_t {};
+    static constexpr borrowed_t borrowed {};
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int R> class ndarray_view;
+
+    namespace detail
+    {
+        template<typename... Index> constexpr int count_integral();
+        template<typename T> struct strided_run;
+
+        /**
+         * Visits same-shape views in lockstep, as runs along the last axis:
+         * function(length, strided_run<T>...) is called once per row, or
+         * once in all if every view is contiguous. Axes that every view can
+         * merge are coalesced first, so runs are as long as the layouts
+         * allow. The row pointers are recomputed from the outer index, which
+         * costs O(R) per run rather than per element.
+         */
+        template<int R, typename Function, typename... T>
+        static inline void for_each_run(Function function, const ndarray_view<T, R>&... views);
+
+        template<int R, typename Function, typename... T, std::size_t... I>
+        static inline void for_each_coalesced_run(Function function, std::index_sequence<I...>, const ndarray_view<T, R>&... views);
+    }
 } 
 
 
@@ -141,16 +345,35 @@ namespace nd
     template<typename T, typename U, int R, typename Op> struct binary_op;
     template<typename T, int R, typename Op> struct unary_op;
     template<typename T, int R> class ndarray;
-    template<typename T> struct dtype_str;
+    class memory_report;
+
+    namespace detail
+    {
+        template<typename T, bool Inline> struct scalar_storage;
+    }
+
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline arange(int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline linspace(T start, T end, int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline ones(int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline zeros(int size, Allocator allocator = Allocator());
 
-    template<typename T> ndarray<T, 1> static inline arange(int size);
-    template<typename T> ndarray<T, 1> static inline linspace(T start, T end, int size);
-    template<typename T> ndarray<T, 1> static inline ones(int size);
-    template<typename T> ndarray<T, 1> static inline zeros(int size);
+    template<typename T, typename... Dims> ndarray<T, sizeof...(Dims)> static inline empty(Dims... dims);
+
+    template<typename T, int R, typename Deleter> ndarray<T, R> static inline adopt(T* data, std::array<int, R> shape, Deleter deleter);
+    template<typename T, int R, typename Deleter> ndarray<T, R> static inline adopt(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides, Deleter deleter);
+    template<typename T, int R> ndarray<T, R> static inline borrow(T* data, std::array<int, R> shape);
+    template<typename T, int R> ndarray<T, R> static inline borrow(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides);
 
     template<typename T, int R>
     static inline nd::ndarray<T, R + 1> stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays);
 
+    /**
+     * Returns a memory_report for the given arrays (of any types and ranks),
+     * showing how much memory they keep alive compared with how much of it
+     * they can actually address.
+     */
+    template<typename... Arrays> static inline memory_report retained_memory(const Arrays&... arrays);
+
 /**
  * Unless you define the following macro, an alias nd::array will be created
  * for you, to make your declarations a little cleaner.
@@ -163,6 +386,160 @@ namespace nd
 
 
 
+// ============================================================================
+namespace nd 
+{
+/**
+ * Memory-mapped arrays are only available on POSIX systems. Files use the
+ * same layout as ndarray::dumps, so a file written with
+ *
+ * std::ofstream("A.bin") << A.dumps();
+ *
+ * can be mapped back with load_mapped<T, R>("A.bin"), and only the pages
+ * actually touched by selections or iteration are read from disk.
+ */
+#if defined(__unix__) || defined(__APPLE__)
+#define ND_HAVE_MMAP
+#endif
+
+/**
+ * Arrays may also live in named POSIX shared-memory segments (names look
+ * like "/my-array"), in the same layout, so that several processes can map
+ * one array without copying it. One process creates the segment with
+ * create_shared, and the others attach with load_shared (read-only) or
+ * open_shared. The segment persists until unlink_shared is called, and its
+ * memory is released once it is unlinked and no longer mapped anywhere.
+ */
+#ifdef ND_HAVE_MMAP
+    template<typename T, int R> const ndarray<T, R> static inline load_mapped(const std::string& filename);
+    template<typename T, int R> ndarray<T, R> static inline open_mapped(const std::string& filename);
+    template<typename T, int R> ndarray<T, R> static inline create_mapped(const std::string& filename, std::array<int, R> shape);
+
+    template<typename T, int R> const ndarray<T, R> static inline load_shared(const std::string& name);
+    template<typename T, int R> ndarray<T, R> static inline open_shared(const std::string& name);
+    template<typename T, int R> ndarray<T, R> static inline create_shared(const std::string& name, std::array<int, R> shape);
+    static inline void unlink_shared(const std::string& name);
+
+    namespace detail
+    {
+        template<typename T, int R>
+        static inline ndarray<T, R> map_file(const std::string& filename, int flags, const std::array<int, R>* shape);
+
+        template<typename T, int R>
+        static inline ndarray<T, R> map_shared(const std::string& name, int flags, const std::array<int, R>* shape);
+
+        template<typename T, int R>
+        static inline ndarray<T, R> map_descriptor(int fd, const std::string& name, int flags, const std::array<int, R>* shape);
+    }
+#endif
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, typename Allocator = default_allocator<T>> struct first_touch_allocator;
+
+    /**
+     * Returns the half-open range [begin, end) of the given part, when size
+     * items are divided into num_parts nearly equal contiguous blocks. This is
+     * the static partitioning used by first_touch_allocator; parallel kernels
+     * that split their work the same way (over flat elements of a contiguous
+     * array) run each block on the NUMA node that holds its memory.
+     */
+    static inline std::pair<std::size_t, std::size_t> static_partition(std::size_t size, std::size_t num_parts, std::size_t part);
+
+    /**
+     * Returns the NUMA node holding each page spanned by the given memory
+     * range, or a negative errno value for pages that are not resident (for
+     * example -ENOENT for pages that were never touched). Throws
+     * std::system_error where page placement cannot be queried (on systems
+     * other than Linux, or if the kernel refuses the request). For an array,
+     * the range runs from its first element to its last, so selections and
+     * strided views report the pages they actually address.
+     */
+    static inline std::vector<int> page_nodes(const void* data, std::size_t bytes);
+
+    template<typename T, int R>
+    static inline std::vector<int> page_nodes(const ndarray<T, R>& array);
+
+    namespace detail
+    {
+        static inline std::size_t page_size();
+    }
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+/**
+ * Size (in bytes) of a transparent huge page, and so the alignment of large
+ * blocks handed out by nd::huge_page_allocator. 2 MB on x86-64 and on most
+ * aarch64 kernels.
+ */
+#ifndef ND_HUGE_PAGE_SIZE
+#define ND_HUGE_PAGE_SIZE (std::size_t(1) << 21)
+#endif
+
+    template<typename T> struct huge_page_allocator;
+
+    /**
+     * Access patterns that may be declared for a range of memory with
+     * nd::advise. They map onto the madvise flags of the same names.
+     */
+    enum class access_hint { normal, sequential, random, willneed };
+
+    /**
+     * Tells the kernel how the memory spanned by an array, selection, or view
+     * will be accessed: sequential read-ahead, no read-ahead for random
+     * access, or to start paging in now. The hint applies to whole pages, so
+     * it also covers any memory sharing the first and last pages with the
+     * array. Hints are most useful on memory-mapped arrays; they do nothing
+     * on systems without madvise. Throws std::system_error if the kernel
+     * rejects the request.
+     */
+    static inline void advise(const void* data, std::size_t bytes, access_hint hint);
+
+    template<typename T, int R>
+    static inline void advise(ndarray_view<T, R> view, access_hint hint);
+
+    template<typename Array>
+    static inline auto advise(const Array& array, access_hint hint) -> decltype(array.view(), void());
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    template<typename T, int R, typename Allocator = default_allocator<T>> class growable_array;
+} 
+
+
+
+
+// ============================================================================
+namespace nd 
+{
+    /**
+     * How the fields of an array_group are laid out in memory: one after
+     * another (each field contiguous), or interleaved so that the values of
+     * all fields at a given cell are adjacent.
+     */
+    enum class group_layout { blocked, interleaved };
+
+    template<typename T, int R> class array_group;
+} 
+
+
+
+
 // ============================================================================
 template<int Rank, int Axis = 0> 
 struct nd::selector
@@ -191,10 +568,11 @@ struct nd::selector
             "selector: number of count arguments must match rank");
     }
 
-    selector(std::array<int, rank> count) : count(count)
+    selector(std::array<int, rank> shape)
     {
         for (int n = 0; n < rank; ++n)
         {
+            count[n] = shape[n];
             start[n] = 0;
             final[n] = count[n];
             skips[n] = 1;
@@ -202,10 +580,10 @@ struct nd::selector
     }
 
     selector(
-        std::array<int, rank> count,
-        std::array<int, rank> start,
-        std::array<int, rank> final,
-        std::array<int, rank> skips)
+        std::array<std::ptrdiff_t, rank> count,
+        std::array<std::ptrdiff_t, rank> start,
+        std::array<std::ptrdiff_t, rank> final,
+        std::array<std::ptrdiff_t, rank> skips)
     : count(count)
     , start(start)
     , final(final)
@@ -271,10 +649,10 @@ struct nd::selector
 
     selector<rank, axis + 1> skip(int skips_index) const
     {
-        return select(std::make_tuple(start[axis], final[axis], skips_index));
+        return slice(start[axis], final[axis], skips_index);
     }
 
-    selector<rank, axis + 1> slice(int lower_index, int upper_index, int skips_index) const
+    selector<rank, axis + 1> slice(std::ptrdiff_t lower_index, std::ptrdiff_t upper_index, int skips_index) const
     {
         static_assert(axis < rank, "selector: cannot select on axis greater than or equal to rank");
         auto res = selector<rank, axis + 1> { count,  start, final, skips };
@@ -348,14 +726,15 @@ struct nd::selector
         return {count, start, final, skips};
     }
 
-    std::array<int, rank> strides() const
+    std::array<std::ptrdiff_t, rank> strides() const
     {
-        std::array<int, rank> s;
-        s[rank - 1] = 1;
+        std::array<std::ptrdiff_t, rank> s;
+        std::ptrdiff_t stride = 1;
 
-        for (int n = rank - 2; n >= 0; --n)
+        for (int n = rank - 1; n >= 0; --n)
         {
-            s[n] = s[n + 1] * count[n + 1];
+            s[n] = stride;
+            stride *= count[n];
         }
         return s;
     }
@@ -373,7 +752,7 @@ struct nd::selector
 
     int shape(int axis) const
     {
-        return final[axis] / skips[axis] - start[axis] / skips[axis];
+        return int((final[axis] - start[axis] + skips[axis] - 1) / skips[axis]);
     }
 
     bool empty() const
@@ -403,7 +782,7 @@ struct nd::selector
     std::size_t size() const
     {
         auto s = shape();
-        return std::accumulate(s.begin(), s.end(), 1, std::multiplies<int>());
+        return std::accumulate(s.begin(), s.end(), std::size_t(1), std::multiplies<std::size_t>());
     }
 
     bool operator==(const selector<rank, axis>& other) const
@@ -422,7 +801,7 @@ struct nd::selector
         skips != other.skips;
     }
 
-    bool next(std::array<int, rank>& index) const
+    bool next(std::array<std::ptrdiff_t, rank>& index) const
     {
         int n = rank - 1;
 
@@ -444,6 +823,155 @@ struct nd::selector
         return true;
     }
 
+    bool prev(std::array<std::ptrdiff_t, rank>& index) const
+    {
+        if (index == final)
+        {
+            index = last();
+            return true;
+        }
+        int n = rank - 1;
+
+        while (index[n] == start[n])
+        {
+            if (n == 0)
+            {
+                return false;
+            }
+            index[n] = start[n] + (shape(n) - 1) * skips[n];
+            --n;
+        }
+        index[n] -= skips[n];
+        return true;
+    }
+
+    /**
+     * Returns the index of the last element visited on each axis.
+     */
+    std::array<std::ptrdiff_t, rank> last() const
+    {
+        auto index = start;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            index[n] += (shape(n) - 1) * skips[n];
+        }
+        return index;
+    }
+
+    /**
+     * Returns the index visited at the given position of the iteration,
+     * which is final if the position is size() or more.
+     */
+    std::array<std::ptrdiff_t, rank> index_at(std::size_t position) const
+    {
+        if (position >= size())
+        {
+            return final;
+        }
+        auto index = start;
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            auto s = std::size_t(shape(n));
+            index[n] += std::ptrdiff_t(position % s) * skips[n];
+            position /= s;
+        }
+        return index;
+    }
+
+    /**
+     * Returns a selector visiting the same memory offsets in the same order,
+     * with adjacent axes merged wherever detail::coalesce_axes would merge
+     * them for the selector's memory strides. Each merged axis counts the
+     * original axes it spans, so offsets are unchanged. Leftover leading
+     * axes have a count of 1.
+     */
+    selector<rank> coalesce() const
+    {
+        if (size() == 0)
+        {
+            return reset();
+        }
+        auto dims = shape();
+        auto rows = strides();
+        auto steps = std::array<std::array<std::ptrdiff_t, rank>, 1>();
+        auto outer = std::array<int, rank>();
+
+        for (int n = 0; n < rank; ++n)
+        {
+            steps[0][n] = skips[n] * rows[n];
+        }
+        auto first = rank - detail::coalesce_axes<rank>(dims, steps, &outer);
+        auto result = selector<rank>();
+
+        for (int k = 0; k < rank; ++k)
+        {
+            auto lower = k == first ? 0 : outer[k];
+            auto upper = k == rank - 1 ? rank - 1 : outer[k + 1] - 1;
+
+            result.count[k] = 1;
+            result.start[k] = 0;
+            result.final[k] = 1;
+            result.skips[k] = 1;
+
+            if (k < first)
+            {
+                continue;
+            }
+            for (int n = lower; n <= upper; ++n)
+            {
+                result.count[k] *= count[n];
+                result.start[k] += start[n] * rows[n] / rows[upper];
+            }
+            result.skips[k] = steps[0][k] / rows[upper];
+            result.final[k] = std::min(result.start[k] + dims[k] * result.skips[k], result.count[k]);
+        }
+        return result;
+    }
+
+    /**
+     * Visits the selected elements as runs along the last axis, calling
+     * function(std::ptrdiff_t offset, std::size_t length, std::ptrdiff_t
+     * stride) for each, where offsets are into row-major memory of the
+     * selector's count. Axes are coalesced first, so a contiguous selector,
+     * or a block of whole rows, is a single run.
+     */
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        if (size() == 0)
+        {
+            return;
+        }
+        auto sel = coalesce();
+        auto memory_strides = sel.strides();
+        auto index = sel.start;
+
+        while (true)
+        {
+            std::ptrdiff_t m = 0;
+
+            for (int n = 0; n < rank; ++n)
+            {
+                m += index[n] * memory_strides[n];
+            }
+            function(m, std::size_t(sel.shape(rank - 1)), sel.skips[rank - 1]);
+
+            int n = rank - 2;
+
+            while (n >= 0 && (index[n] += sel.skips[n]) >= sel.final[n])
+            {
+                index[n] = sel.start[n];
+                --n;
+            }
+            if (n < 0)
+            {
+                break;
+            }
+        }
+    }
+
     template<typename... Index>
     bool contains(Index... index) const
     {
@@ -456,7 +984,7 @@ struct nd::selector
             auto start_index = std::get<0>(S[n]);
             auto final_index = std::get<1>(S[n]);
 
-            if (start_index < 0 || final_index > final[n] / skips[n] - start[n] / skips[n])
+            if (start_index < 0 || final_index > shape(n))
             {
                 return false;
             }
@@ -467,7 +995,7 @@ struct nd::selector
     selector<rank, axis> shift(int dist) const
     {
         auto sel = *this;
-        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], 0);
+        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], std::ptrdiff_t(0));
         sel.final[axis] = std::min(sel.final[axis] + dist * skips[axis], sel.count[axis]);
         return sel;
     }
@@ -479,29 +1007,49 @@ struct nd::selector
     class iterator
     {
     public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::array<std::ptrdiff_t, rank>;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+        using iterator_category = std::random_access_iterator_tag;
+
         iterator() {}
-        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind) {}
-        iterator& operator++() { sel.next(ind); return *this; }
+        iterator(selector<rank> sel, std::size_t position) : sel(sel), ind(sel.index_at(position)), position(position) {}
+        iterator& operator++() { sel.next(ind); ++position; return *this; }
+        iterator& operator--() { sel.prev(ind); --position; return *this; }
         iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return ind == other.ind; }
-        bool operator!=(iterator other) const { return ind != other.ind; }
-        const std::array<int, rank>& operator*() const { return ind; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { position += n; ind = sel.index_at(position); return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return difference_type(position - other.position); }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return position == other.position; }
+        bool operator!=(const iterator& other) const { return position != other.position; }
+        bool operator< (const iterator& other) const { return position <  other.position; }
+        bool operator> (const iterator& other) const { return position >  other.position; }
+        bool operator<=(const iterator& other) const { return position <= other.position; }
+        bool operator>=(const iterator& other) const { return position >= other.position; }
+        const std::array<std::ptrdiff_t, rank>& operator*() const { return ind; }
+        std::array<std::ptrdiff_t, rank> operator[](difference_type n) const { return *(*this + n); }
     private:
         selector<rank> sel;
-        std::array<int, rank> ind;
+        std::array<std::ptrdiff_t, rank> ind;
+        std::size_t position = 0;
     };
 
-    iterator begin() const { return {reset(), start}; }
-    iterator end() const { return {reset(), final}; }
+    iterator begin() const { return {reset(), 0}; }
+    iterator end() const { return {reset(), size()}; }
 
 
 
 
     // ========================================================================
-    std::array<int, rank> count;
-    std::array<int, rank> start;
-    std::array<int, rank> final;
-    std::array<int, rank> skips;
+    std::array<std::ptrdiff_t, rank> count;
+    std::array<std::ptrdiff_t, rank> start;
+    std::array<std::ptrdiff_t, rank> final;
+    std::array<std::ptrdiff_t, rank> skips;
 
 
 
@@ -509,20 +1057,86 @@ struct nd::selector
     // ========================================================================
     template<int other_rank, int other_axis>
     friend struct selector;
-}; 
+};
 
 
 
 
 // ============================================================================
-template<unsigned long rank> 
-std::array<std::tuple<int, int>, rank> nd::shape::promote(std::array<std::tuple<int, int>, rank> shape)
+template<int R, std::size_t N>
+int nd::detail::coalesce_axes(std::array<int, R>& shape, std::array<std::array<std::ptrdiff_t, R>, N>& strides, std::array<int, R>* outer)
 {
-    return shape;
-}
+    auto merged = std::array<int, R>();
 
-std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int, int> selection)
-{
+    for (int n = 0; n < R; ++n)
+    {
+        merged[n] = n;
+    }
+    if (outer)
+    {
+        *outer = merged;
+    }
+    if (R <= 1 || std::find(shape.begin(), shape.end(), 0) != shape.end())
+    {
+        return R;
+    }
+    int m = R - 1;
+
+    for (int n = R - 2; n >= 0; --n)
+    {
+        auto mergeable = std::ptrdiff_t(shape[n]) * shape[m] <= std::numeric_limits<int>::max();
+
+        for (std::size_t k = 0; k < N && mergeable; ++k)
+        {
+            mergeable = strides[k][n] == shape[m] * strides[k][m];
+        }
+
+        if (shape[n] == 1)
+        {
+            continue;
+        }
+        else if (shape[m] == 1)
+        {
+            shape[m] = shape[n];
+            for (auto& s : strides) s[m] = s[n];
+        }
+        else if (mergeable)
+        {
+            shape[m] *= shape[n];
+        }
+        else
+        {
+            --m;
+            shape[m] = shape[n];
+            for (auto& s : strides) s[m] = s[n];
+        }
+        merged[m] = n;
+    }
+    for (int n = 0; n < m; ++n)
+    {
+        shape[n] = 1;
+        merged[n] = n;
+        for (auto& s : strides) s[n] = 0;
+    }
+    if (outer)
+    {
+        *outer = merged;
+    }
+    return R - m;
+} 
+
+
+
+
+// ============================================================================
+template<unsigned long rank> 
+std::array<std::tuple<int, int>, rank> nd::shape::promote(std::array<std::tuple<int, int>, rank> shape)
+{
+    return shape;
+}
+
+std::array<std::tuple<int, int>, 1> nd::shape::promote(std::tuple<int, int, int> selection)
+{
     return {std::make_tuple(std::get<0>(selection), std::get<1>(selection))};
 }
 
@@ -588,293 +1202,317 @@ auto nd::shape::make_shape(First first, Rest... rest)
 
 
 // ============================================================================
-template<typename T> 
-class nd::buffer
+struct nd::buffer_cache_stats 
 {
-public:
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t cached_blocks = 0;
+    std::size_t cached_bytes = 0;
+    std::size_t released_blocks = 0;
+};
 
-    buffer() {}
 
-    buffer(const buffer<T>& other)
-    {
-        count = other.count;
-        memory = new T[count];
 
-        for (int n = 0; n < count; ++n)
-        {
-            memory[n] = other.memory[n];
-        }
-    }
 
-    buffer(buffer<T>&& other)
-    {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
+// ============================================================================
+class nd::buffer_cache
+{
+public:
 
-        other.memory = nullptr;
-        other.count = 0;
+    /**
+     * A process-wide cache of memory blocks freed by aligned_allocator (and
+     * so by buffers using the default allocator). While enabled, requests
+     * are rounded up to a size class (four classes per power of two, so at
+     * most 25% is wasted), and a freed block is kept on the list for its
+     * size class and alignment, to be handed to the next request of the
+     * same class. Loops that evaluate the same expressions every step then
+     * reuse the memory of the previous step's temporaries, rather than
+     * returning it to the system and faulting it back in.
+     *
+     * The cache holds at most capacity_bytes in total, and at most
+     * blocks_per_class blocks of each size class; blocks freed beyond those
+     * limits are released. Disabling the cache releases everything it holds.
+     */
+    static void enable(std::size_t capacity_bytes = std::size_t(1) << 30, std::size_t blocks_per_class = 16)
+    {
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        instance().capacity_bytes = capacity_bytes;
+        instance().blocks_per_class = blocks_per_class;
+        instance().on = true;
     }
 
-    explicit buffer(std::size_t count, const T& value = T()) : count(count)
+    static void disable()
     {
-        memory = new T[count];
+        instance().on = false;
+        clear();
+    }
 
-        for (std::size_t n = 0; n < count; ++n)
-        {
-            memory[n] = value;
-        }
+    static bool enabled()
+    {
+        return instance().on.load(std::memory_order_relaxed);
     }
 
-    template< class InputIt >
-    buffer(InputIt first, InputIt last)
+    /**
+     * Releases all cached blocks. The cache stays enabled if it was.
+     */
+    static void clear()
     {
+        auto blocks = std::vector<void*>();
         {
-            auto it = first;
-            count = 0;
+            std::lock_guard<std::mutex> lock(instance().mutex);
 
-            while (it != last)
+            for (auto& entry : instance().free_lists)
             {
-                ++it;
-                ++count;
+                blocks.insert(blocks.end(), entry.second.begin(), entry.second.end());
             }
-            memory = new T[count];
-        }
 
+            instance().released += blocks.size();
+            instance().free_lists.clear();
+            instance().cached_bytes = 0;
+        }
+        for (auto block : blocks)
         {
-            auto it = first;
-            auto n = 0;
-
-            while (it != last)
-            {
-                memory[n] = *it;
-                ++it;
-                ++n;
-            }
+            ::operator delete(header(block)->raw);
         }
     }
 
-    ~buffer()
-    {
-        delete [] memory;
-    }
-
-    buffer<T>& operator=(const buffer<T>& other)
+    static buffer_cache_stats stats()
     {
-        delete [] memory;
-
-        count = other.count;
-        memory = new T[count];
-
-        for (int n = 0; n < count; ++n)
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto result = buffer_cache_stats();
+        result.hits = instance().hits;
+        result.misses = instance().misses;
+        result.cached_bytes = instance().cached_bytes;
+        result.released_blocks = instance().released;
+
+        for (const auto& entry : instance().free_lists)
         {
-            memory[n] = other.memory[n];
+            result.cached_blocks += entry.second.size();
         }
-        return *this;
+
+        return result;
     }
 
-    buffer<T>& operator=(buffer<T>&& other)
+    static void reset_stats()
     {
-        delete [] memory;
-        memory = other.memory;
-        count = other.count;
-
-        other.memory = nullptr;
-        other.count = 0;
-        return *this;
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        instance().hits = 0;
+        instance().misses = 0;
+        instance().released = 0;
     }
 
-    bool operator==(const buffer<T>& other) const
+    static std::size_t size_class(std::size_t bytes)
     {
-        if (count != other.count)
+        std::size_t step = 64;
+
+        while (step * 8 < bytes)
         {
-            return false;
+            step *= 2;
         }
 
-        for (std::size_t n = 0; n < size(); ++n)
+        return (bytes + step - 1) / step * step;
+    }
+
+private:
+    friend void* detail::aligned_malloc(std::size_t, std::size_t);
+    friend void detail::aligned_free(void*);
+
+    ~buffer_cache()
+    {
+        for (auto& entry : free_lists)
         {
-            if (memory[n] != other.memory[n])            
+            for (auto block : entry.second)
             {
-                return false;
+                ::operator delete(header(block)->raw);
             }
         }
-        return true;
-    }
-
-    bool operator!=(const buffer<T>& other) const
-    {
-        return ! operator==(other);
     }
 
-    std::size_t size() const
+    static buffer_cache& instance()
     {
-        return count;
+        static buffer_cache cache;
+        return cache;
     }
 
-    const T* data() const
+    static detail::block_header* header(void* block)
     {
-        return memory;
+        return static_cast<detail::block_header*>(block) - 1;
     }
 
-    T* data()
+    /**
+     * Returns a cached block of exactly the given size class and alignment,
+     * or nullptr (counting a miss) if there is none.
+     */
+    static void* take(std::size_t bytes, std::size_t alignment)
     {
-        return memory;
-    }
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto entry = instance().free_lists.find(std::make_pair(bytes, alignment));
 
-    const T& operator[](std::size_t offset) const
-    {
-        return memory[offset];
+        if (entry == instance().free_lists.end() || entry->second.empty())
+        {
+            ++instance().misses;
+            return nullptr;
+        }
+        auto block = entry->second.back();
+        entry->second.pop_back();
+        instance().cached_bytes -= bytes;
+        ++instance().hits;
+        return block;
     }
 
-    T& operator[](std::size_t offset)
+    /**
+     * Keeps a freed block if the cache is enabled, the block's size is a
+     * size class, and there is room for it. Returns false if the caller
+     * should release the block instead.
+     */
+    static bool give(void* block)
     {
-        return memory[offset];
-    }
+        if (! enabled())
+        {
+            return false;
+        }
+        auto bytes = header(block)->bytes;
+        auto alignment = header(block)->alignment;
 
-    T* begin() { return memory; }
-    T* end() { return memory + count; }
+        std::lock_guard<std::mutex> lock(instance().mutex);
+        auto key = std::make_pair(bytes, alignment);
+        auto entry = instance().free_lists.find(key);
+        auto kept = entry == instance().free_lists.end() ? 0 : entry->second.size();
 
-    const T* begin() const { return memory; }
-    const T* end() const { return memory + count; }
+        if (size_class(bytes) != bytes
+            || kept >= instance().blocks_per_class
+            || instance().cached_bytes + bytes > instance().capacity_bytes)
+        {
+            ++instance().released;
+            return false;
+        }
+        if (entry == instance().free_lists.end())
+        {
+            entry = instance().free_lists.emplace(key, std::vector<void*>()).first;
+        }
+        entry->second.push_back(block);
+        instance().cached_bytes += bytes;
+        return true;
+    }
 
-private:
-    T* memory = nullptr;
-    std::size_t count = 0;
-}; 
+    std::mutex mutex;
+    std::atomic<bool> on {false};
+    std::map<std::pair<std::size_t, std::size_t>, std::vector<void*>> free_lists;
+    std::size_t capacity_bytes = 0;
+    std::size_t blocks_per_class = 0;
+    std::size_t cached_bytes = 0;
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t released = 0;
+};
 
 
 
 
 // ============================================================================
-template<typename T> nd::ndarray<T, 1> nd::arange(int size) 
-{
-    auto A = nd::ndarray<T, 1>(size);
-    auto x = T();
-    for (auto& a : A) a = x++;
-    return A;
-}
-
-template<typename T> nd::ndarray<T, 1> nd::linspace(T start, T end, int size)
-{
-    auto A = nd::ndarray<T, 1>(size);
-    auto h = (end - start) / (size - 1);
-    auto x = start - h;
-    for (auto& a : A) a = (x += h);
-    return A;
-}
-
-template<typename T> nd::ndarray<T, 1> nd::ones(int size)
-{
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 1;
-    return A;
-}
-
-template<typename T> nd::ndarray<T, 1> nd::zeros(int size)
+void* nd::detail::aligned_malloc(std::size_t bytes, std::size_t alignment)
 {
-    auto A = nd::ndarray<T, 1>(size);
-    for (auto& a : A) a = 0;
-    return A;
-}
+    alignment = std::max(alignment, alignof(block_header));
 
-template<typename T, int R> /* UNTESTED */
-nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays)
-{
-    if (arrays.size() == 0)
+    if (buffer_cache::enabled())
     {
-        return nd::ndarray<T, R>();            
-    }
-
-    auto required_shape = arrays.begin()->shape();
+        bytes = buffer_cache::size_class(bytes);
 
-    std::array<int, R> dim_sizes;
-    dim_sizes[0] = arrays.size();
-
-    for (int n = 1; n < R; ++n)
+        if (auto block = buffer_cache::take(bytes, alignment))
+        {
+            return block;
+        }
+    }
+    if (bytes > std::numeric_limits<std::size_t>::max() - alignment - sizeof(block_header))
     {
-        dim_sizes[n] = required_shape[n - 1];
+        throw std::bad_alloc();
     }
-    auto A = nd::ndarray<T, R>(dim_sizes);
-    auto n = 0;
+    auto raw = static_cast<char*>(::operator new(bytes + alignment + sizeof(block_header)));
+    auto pos = reinterpret_cast<std::uintptr_t>(raw + sizeof(block_header));
+    auto ptr = reinterpret_cast<block_header*>((pos + alignment - 1) & ~std::uintptr_t(alignment - 1));
+    ptr[-1] = block_header{raw, bytes, alignment};
+    return ptr;
+}
 
-    for (const auto& array : arrays)
+void nd::detail::aligned_free(void* ptr)
+{
+    if (ptr && ! buffer_cache::give(ptr))
     {
-        A[n] = array;
-        ++n;
+        ::operator delete(static_cast<block_header*>(ptr)[-1].raw);
     }
-    return A;
 }
 
 
 
 
 // ============================================================================
-template<typename T, int R, typename Op>
-struct nd::unary_op
+template<typename T, std::size_t Alignment>
+struct nd::aligned_allocator
 {
-    static auto perform(const ndarray<T, R>& A)
-    {
-        auto op = Op();
-        auto B = ndarray<decltype(op(T())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
+    /**
+     * A standard-conforming allocator that returns memory aligned to the given
+     * number of bytes. Any type satisfying the Allocator requirements (for
+     * example std::allocator, or a user-provided memory pool) may be given to
+     * nd::buffer in its place.
+     */
 
-        for (; a != A.end(); ++a, ++b)
-            *b = op(*a);
+    static_assert((Alignment & (Alignment - 1)) == 0, "aligned_allocator: alignment must be a power of two");
+    static_assert(Alignment >= alignof(T), "aligned_allocator: alignment is weaker than the type requires");
 
-        return B;
-    }
-};
+    using value_type = T;
+    enum { alignment = Alignment };
 
+    template<typename U>
+    struct rebind { using other = aligned_allocator<U, Alignment>; };
 
+    aligned_allocator() {}
 
+    template<typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) {}
 
-// ============================================================================
-template<typename T, typename U, int R, typename Op>
-struct nd::binary_op
-{
-    static auto perform(const ndarray<T, R>& A, const ndarray<U, R>& B)
+    T* allocate(std::size_t count)
     {
-        if (A.shape() != B.shape())
-            throw std::invalid_argument("incompatible shapes for binary operation");
-
-        auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
-        auto c = C.begin();
-
-        for (; a != A.end(); ++a, ++b, ++c)
-            *c = op(*a, *b);
-
-        return C;
+        if (count == 0)
+        {
+            return nullptr;
+        }
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(detail::aligned_malloc(count * sizeof(T), Alignment));
     }
 
-    static auto perform(const ndarray<T, R>& A, U b)
+    void deallocate(T* ptr, std::size_t)
     {
-        auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto c = C.begin();
+        detail::aligned_free(ptr);
+    }
 
-        for (; a != A.end(); ++a, ++c)
-            *c = op(*a, b);
+    template<typename U>
+    bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
 
-        return C;
-    }
+    template<typename U>
+    bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+}; 
 
-    static void perform(ndarray<T, R>& A, const ndarray<U, R>& B)
-    {
-        if (A.shape() != B.shape())
-            throw std::invalid_argument("incompatible shapes for binary operation");
 
-        auto op = Op();
-        auto a = A.begin();
-        auto b = B.begin();
 
-        for (; a != A.end(); ++a, ++b)
-            *a = op(*a, *b);
-    }
+
+// ============================================================================
+struct nd::allocation_stats 
+{
+    /**
+     * A snapshot of the allocation counters, either for a single dtype or
+     * summed over all of them. Bin n of the histogram counts allocations of
+     * between 2^n and 2^(n+1) - 1 bytes (bin 0 also counts empty ones).
+     */
+    std::string dtype;
+    std::size_t live_bytes = 0;
+    std::size_t peak_bytes = 0;
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+    std::size_t allocated_bytes = 0;
+    std::array<std::size_t, 64> histogram = {};
 };
 
 
@@ -903,698 +1541,3839 @@ namespace nd {
 
 
 // ============================================================================
-template<typename T, int R>
-class nd::ndarray
-{
-public:
+/**
+ * The name telemetry reports for a dtype: its dtype_str where one is
+ * declared, so labels match the dumps header, or else the compiler's name
+ * for the type. The string lives in a function-local static, so looking it
+ * up never allocates.
+ */
+namespace nd {
+  namespace detail {
+    template<typename T, typename>
+    struct dtype_label
+    {
+        static const char* name() { return typeid(T).name(); }
+    };
 
+    template<typename T>
+    struct dtype_label<T, decltype(void(dtype_str<T>::value()))>
+    {
+        static const char* name()
+        {
+            static const auto str = dtype_str<T>::value();
+            return str.data();
+        }
+    };
+  }
+}
 
-    using dtype = T;
-    enum { rank = R };
 
 
 
+// ============================================================================
+struct nd::detail::telemetry_record
+{
+    telemetry_record(const std::type_info& type, const char* name) : type(type), name(name) {}
 
-    /**
-     * Wrapper class for constant arrays. Can be trivially converted back to
-     * const nd::array&.
-     */
-    // ========================================================================
-    class const_ref
+    void allocated(std::size_t bytes)
     {
-    public:
-
-        using dtype = T;
-        enum { rank = R };
-
-        const_ref(selector<R> sel, std::shared_ptr<buffer<T>> buf) : A(sel, buf) {}
-        template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
-        template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
-        template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
-        template<typename... Args> auto size(const Args&... args) const { return A.size(args...); }
-        template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
-        template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
-        template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
-
-        operator const ndarray<T, R>&() const { return A; }
-        bool is_const_ref() const { return true; }
-
-        auto begin() const { return A.begin(); }
-        auto end() const { return A.end(); }
-
-    private:
-        friend class ndarray;
-        ndarray<T, R> A;
-    };
-
+        auto live = live_bytes += bytes;
+        auto peak = peak_bytes.load(std::memory_order_relaxed);
 
+        while (live > peak && ! peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
 
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        histogram[bin(bytes)].fetch_add(1, std::memory_order_relaxed);
+    }
 
-    /**
-     * Constructors
-     * 
-     */
-    // ========================================================================
-    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(T value=T())
-    : scalar_offset(0)
-    , buf(std::make_shared<buffer<T>>(1, value))
+    void deallocated(std::size_t bytes)
     {
+        live_bytes -= bytes;
+        deallocations.fetch_add(1, std::memory_order_relaxed);
     }
 
-    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(int scalar_offset, std::shared_ptr<buffer<T>>& buf)
-    : scalar_offset(scalar_offset)
-    , buf(buf)
+    void reset()
     {
+        peak_bytes = live_bytes.load();
+        allocations = 0;
+        deallocations = 0;
+        allocated_bytes = 0;
+
+        for (auto& count : histogram)
+        {
+            count = 0;
+        }
     }
 
-    template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
-    ndarray(std::initializer_list<T> elements)
-    : sel({elements.size()})
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(elements.begin(), elements.end()))
+    void add_to(allocation_stats& stats) const
     {
+        stats.live_bytes      += live_bytes;
+        stats.peak_bytes      += peak_bytes;
+        stats.allocations     += allocations;
+        stats.deallocations   += deallocations;
+        stats.allocated_bytes += allocated_bytes;
+
+        for (std::size_t n = 0; n < histogram.size(); ++n)
+        {
+            stats.histogram[n] += histogram[n];
+        }
     }
 
-    template<typename... Dims>
-    ndarray(Dims... dims) : ndarray(std::array<int, R>({int(dims)...}))
+    static std::size_t bin(std::size_t bytes)
     {
-        static_assert(sizeof...(dims) == rank,
-          "Number of arguments to ndarray constructor must match rank");
+        std::size_t n = 0;
+        while (bytes >>= 1)
+        {
+            ++n;
+        }
+        return n;
     }
 
-    template<typename SelectorType>
-    ndarray(SelectorType sel, std::shared_ptr<buffer<T>>& buf)
-    : sel(sel)
-    , strides(sel.strides())
-    , buf(buf)
+    std::type_index type;
+    const char* name;
+    std::atomic<std::size_t> live_bytes {0};
+    std::atomic<std::size_t> peak_bytes {0};
+    std::atomic<std::size_t> allocations {0};
+    std::atomic<std::size_t> deallocations {0};
+    std::atomic<std::size_t> allocated_bytes {0};
+    std::array<std::atomic<std::size_t>, 64> histogram = {};
+};
+
+
+
+
+// ============================================================================
+class nd::telemetry_scope
+{
+public:
+
+    /**
+     * Measures the buffer allocations made by the current thread while the
+     * scope is alive, whether or not global telemetry is enabled. Scopes may
+     * be nested; each one sees the allocations of the scopes inside it. The
+     * net bytes can go negative if the region frees memory that was allocated
+     * before it began.
+     */
+    telemetry_scope() : parent(current())
     {
+        current() = this;
     }
 
-    ndarray() : ndarray(constant_array<rank>(0))
+    ~telemetry_scope()
     {
+        current() = parent;
     }
 
-    ndarray(std::array<int, R> dim_sizes)
-    : sel(dim_sizes)
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(sel.size()))
+    telemetry_scope(const telemetry_scope&) = delete;
+    telemetry_scope& operator=(const telemetry_scope&) = delete;
+
+    std::size_t allocations() const { return num_allocations; }
+    std::size_t deallocations() const { return num_deallocations; }
+    std::size_t allocated_bytes() const { return bytes_allocated; }
+    std::ptrdiff_t net_bytes() const { return bytes_net; }
+    std::ptrdiff_t peak_bytes() const { return bytes_peak; }
+
+private:
+    friend class telemetry;
+
+    static telemetry_scope*& current()
     {
+        static thread_local telemetry_scope* scope = nullptr;
+        return scope;
     }
 
-    ndarray(std::array<int, R> dim_sizes, std::shared_ptr<buffer<T>>& buf)
-    : sel(dim_sizes)
-    , strides(sel.strides())
-    , buf(buf)
+    telemetry_scope* parent = nullptr;
+    std::size_t num_allocations = 0;
+    std::size_t num_deallocations = 0;
+    std::size_t bytes_allocated = 0;
+    std::ptrdiff_t bytes_net = 0;
+    std::ptrdiff_t bytes_peak = 0;
+};
+
+
+
+
+// ============================================================================
+class nd::detail::operation_label
+{
+public:
+
+    /**
+     * Names the library operation in progress on this thread, for the
+     * duration of the label's scope. The innermost label wins.
+     */
+    operation_label(const char* name) : parent(current())
     {
-        assert_valid_argument(buf->size() == sel.size(),
-            "Size of data buffer is not the product of dim sizes");
+        current() = name;
     }
 
-    ndarray(const ndarray<T, R>& other)
-    : sel(other.sel.shape())
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(size()))
+    ~operation_label()
     {
-        copy_internal(*this, other);
+        current() = parent;
     }
 
-    ndarray(ndarray<T, R>& other)
+    operation_label(const operation_label&) = delete;
+    operation_label& operator=(const operation_label&) = delete;
+
+    static const char*& current()
     {
-        strides = other.strides;
-        sel = other.sel;
-        buf = other.buf;
+        static thread_local const char* name = nullptr;
+        return name;
     }
 
+private:
+    const char* parent;
+};
+
 
 
 
+// ============================================================================
+class nd::allocation_guard
+{
+public:
+
     /**
-     * Assignment operators
-     * 
+     * Marks a region of code which must not allocate buffers: a real-time
+     * path or a solver's inner iteration. Every heap allocation the library
+     * makes on the current thread while the guard is alive is counted, along
+     * with the name of the operation that made it (see ND_OPERATION). That
+     * includes the buffer objects and reference counts behind new arrays and
+     * copy-on-write copies, as well as their elements. With the abort
+     * policy, the first such allocation instead prints a report to stderr
+     * and calls std::abort, so that violations fail loudly in tests.
+     * Allocations served by a scratch_scope are counted too. Guards may be
+     * nested; each one sees the allocations made inside it.
      */
-    // ========================================================================
-    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
-    ndarray<T, R>& operator=(T value)
-    {
-        buf->operator[](scalar_offset) = value;
-        return *this;
-    }
+    enum class policy { count, abort };
 
-    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
-    ndarray<T, R>& operator=(T value)
+    explicit allocation_guard(policy action = policy::count)
+    : action(action)
+    , parent(current())
     {
-        for (auto& a : *this)
-            a = value;
-
-        return *this;
+        names.reserve(max_operations);
+        current() = this;
     }
 
-    ndarray<T, R>& operator=(const ndarray<T, R>& other)
+    ~allocation_guard()
     {
-        copy_internal(*this, other);
-        return *this;
+        current() = parent;
     }
 
-    void become(ndarray<T, R> other)
-    {
-        strides = other.strides;
-        sel = other.sel;
-        buf = other.buf;
-    }
+    allocation_guard(const allocation_guard&) = delete;
+    allocation_guard& operator=(const allocation_guard&) = delete;
 
-    template<typename... Sizes>
-    auto reshape(Sizes... sizes)
+    std::size_t allocations() const { return num_allocations; }
+    std::size_t allocated_bytes() const { return bytes_allocated; }
+
+    /**
+     * The operation responsible for each allocation, in order. Allocations
+     * made outside a labelled operation (or with labels compiled out) are
+     * attributed to "nd::buffer". Room for max_operations names is reserved
+     * when the guard is created, so that the guard itself never allocates;
+     * allocations beyond that are counted but not named.
+     */
+    const std::vector<const char*>& operations() const { return names; }
+
+    static constexpr std::size_t max_operations = 64;
+
+private:
+    friend class telemetry;
+
+    static allocation_guard*& current()
     {
-        if (! contiguous())
-        {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
-        }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, buf);
+        static thread_local allocation_guard* guard = nullptr;
+        return guard;
     }
 
-    template<typename... Sizes>
-    const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
+    static void allocated(std::size_t bytes, const char* dtype)
     {
-        if (! contiguous())
+        auto name = detail::operation_label::current() ? detail::operation_label::current() : "nd::buffer";
+
+        for (auto guard = current(); guard; guard = guard->parent)
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
-            copy_internal(A, *this);
-            return A;
+            if (guard->action == policy::abort)
+            {
+                std::fprintf(stderr, "nd::allocation_guard: %zu bytes (%s) allocated by %s\n", bytes, dtype, name);
+                std::abort();
+            }
+            guard->num_allocations += 1;
+            guard->bytes_allocated += bytes;
+
+            if (guard->names.size() < guard->names.capacity())
+            {
+                guard->names.push_back(name);
+            }
         }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<std::shared_ptr<buffer<T>>&>(buf));
     }
 
+    policy action;
+    allocation_guard* parent = nullptr;
+    std::size_t num_allocations = 0;
+    std::size_t bytes_allocated = 0;
+    std::vector<const char*> names;
+};
 
 
 
-    /**
-     * Shape and size query methods
-     * 
-     */
-    // ========================================================================
-    auto size() const { return sel.size(); }
-    bool empty() const { return sel.empty(); }
-    auto shape() const { return sel.shape(); }
-    auto shape(int axis) const { return sel.shape(axis); }
-    bool contiguous() const { return sel.contiguous(); }
-
-
 
+// ============================================================================
+class nd::telemetry
+{
+public:
 
     /**
-     * Data accessors and selection methods
-     * 
+     * Process-wide counters of the memory allocated by nd::buffer, broken
+     * down by element type. Telemetry is off by default, and costs a single
+     * relaxed atomic load per allocation while it stays off. Memory that
+     * buffers merely wrap (adopted, borrowed, or memory-mapped) is not
+     * counted. Allocations made while telemetry is disabled are not counted
+     * when they are released either, so the live bytes never underflow.
      */
-    // ========================================================================
-    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
-    ndarray<T, R - 1> operator[](int index)
+    static void enable(bool on = true)
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
-
-        return {offset_relative({index}), buf};
+        flag() = on;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
-    const ndarray<T, R - 1> operator[](int index) const
+    static void disable()
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
-
-        return {offset_relative({index}), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        flag() = false;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
-    ndarray<T, R - 1> operator[](int index)
+    static bool enabled()
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
-
-        return {sel.select(index), buf};
+        return flag().load(std::memory_order_relaxed);
     }
 
-    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
-    const ndarray<T, R - 1> operator[](int index) const
+    static allocation_stats total()
     {
-        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
-            throw std::out_of_range("ndarray: index out of range");
+        auto stats = allocation_stats();
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        stats.dtype = "*";
+
+        for (const auto& record : registry())
+        {
+            record.add_to(stats);
+        }
 
-        return {sel.select(index), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        return stats;
     }
 
-    template<typename... Index>
-    T& operator()(Index... index)
+    template<typename T>
+    static allocation_stats of()
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: index out of range");
-
-        return buf->operator[](offset_relative({int(index)...}));
+        auto stats = allocation_stats();
+        stats.dtype = detail::dtype_label<T>::name();
+        record<T>().add_to(stats);
+        return stats;
     }
 
-    template<typename... Index>
-    const T& operator()(Index... index) const
+    static std::vector<allocation_stats> by_dtype()
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
+        auto result = std::vector<allocation_stats>();
+        std::lock_guard<std::mutex> lock(registry_mutex());
 
-        return buf->operator[](offset_relative({int(index)...}));
+        for (const auto& record : registry())
+        {
+            result.emplace_back();
+            result.back().dtype = record.name;
+            record.add_to(result.back());
+        }
+        return result;
     }
 
-    template<typename... Index>
-    auto select(Index... index)
+    /**
+     * Zeroes the counters and sets each peak to the current live bytes.
+     */
+    static void reset()
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
+        std::lock_guard<std::mutex> lock(registry_mutex());
 
-        auto S = sel.select(index...);
-        return ndarray<T, S.rank>(S.reset(), buf);
+        for (auto& record : registry())
+        {
+            record.reset();
+        }
     }
 
-    template<typename... Index>
-    auto select(Index... index) const
+    /**
+     * Called by nd::buffer when it obtains or releases memory. The return
+     * value of allocated says whether the global counters recorded the
+     * allocation, and must be passed back to deallocated.
+     */
+    template<typename T>
+    static bool allocated(std::size_t bytes)
     {
-        if (! sel.contains(index...))
-            throw std::out_of_range("ndarray: selection out of range");
-
-        auto S = sel.select(index...);
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        for (auto scope = telemetry_scope::current(); scope; scope = scope->parent)
+        {
+            scope->num_allocations += 1;
+            scope->bytes_allocated += bytes;
+            scope->bytes_net += std::ptrdiff_t(bytes);
+            scope->bytes_peak = std::max(scope->bytes_peak, scope->bytes_net);
+        }
+        if (allocation_guard::current())
+        {
+            allocation_guard::allocated(bytes, detail::dtype_label<T>::name());
+        }
+        if (enabled())
+        {
+            record<T>().allocated(bytes);
+            return true;
+        }
+        return false;
     }
 
-    template<int Axis, typename Slice>
-    auto take(Slice slice)
+    /**
+     * Called when the library allocates bookkeeping rather than elements: a
+     * buffer object with its reference count, or a snapshot registry
+     * growing. Only allocation guards see these, since they are not memory
+     * of any dtype.
+     */
+    static void allocated_object(std::size_t bytes, const char* what)
     {
-        auto taken_sel = sel.template on<Axis>().select(slice).reset();
-        return ndarray<T, R>(taken_sel, buf);
+        if (allocation_guard::current())
+        {
+            allocation_guard::allocated(bytes, what);
+        }
     }
 
-    template<int Axis, typename Slice>
-    auto take(Slice slice) const
+    template<typename T>
+    static void deallocated(std::size_t bytes, bool recorded)
     {
-        auto S = sel.template on<Axis>().select(slice).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        for (auto scope = telemetry_scope::current(); scope; scope = scope->parent)
+        {
+            scope->num_deallocations += 1;
+            scope->bytes_net -= std::ptrdiff_t(bytes);
+        }
+        if (recorded)
+        {
+            record<T>().deallocated(bytes);
+        }
     }
 
-    template<int Axis>
-    auto shift(int distance)
+private:
+    static std::atomic<bool>& flag()
     {
-        auto shifted_sel = sel.template on<Axis>().shift(distance).reset();
-        return ndarray<T, R>(shifted_sel, buf);
+        static std::atomic<bool> on {false};
+        return on;
     }
 
-    template<int Axis>
-    auto shift(int distance) const
+    static std::mutex& registry_mutex()
     {
-        auto S = sel.template on<Axis>().shift(distance).reset();
-        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+        static std::mutex mutex;
+        return mutex;
     }
 
-    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
-    operator T() const
+    static std::deque<detail::telemetry_record>& registry()
     {
-        // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
-        return buf->operator[](scalar_offset);
+        static std::deque<detail::telemetry_record> records;
+        return records;
     }
 
-    ndarray<T, R> copy() const
+    template<typename T>
+    static detail::telemetry_record& record()
     {
-        auto d = std::make_shared<buffer<T>>(begin(), end());
-        return {shape(), d};
+        static detail::telemetry_record& r = find_or_add(typeid(T), detail::dtype_label<T>::name());
+        return r;
     }
 
-    template<typename new_type>
-    ndarray<new_type, R> astype() const
+    static detail::telemetry_record& find_or_add(const std::type_info& type, const char* name)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+
+        for (auto& record : registry())
+        {
+            if (record.type == type)
+                return record;
+        }
+
+        registry().emplace_back(type, name);
+        return registry().back();
+    }
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::object_allocator
+{
+    /**
+     * Allocates buffer objects together with their reference counts, from
+     * operator new as std::make_shared would, reporting each allocation to
+     * the active allocation guards.
+     */
+
+    using value_type = T;
+
+    object_allocator() {}
+
+    template<typename U>
+    object_allocator(const object_allocator<U>&) {}
+
+    T* allocate(std::size_t count)
+    {
+        telemetry::allocated_object(count * sizeof(T), "nd::buffer object");
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+        ::operator delete(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const object_allocator<U>&) const { return true; }
+
+    template<typename U>
+    bool operator!=(const object_allocator<U>&) const { return false; }
+}; 
+
+
+
+
+// ============================================================================
+class nd::detail::scratch_region 
+{
+public:
+
+    /**
+     * A block of memory handed out by bumping an offset, which is kept at a
+     * multiple of ND_DEFAULT_ALIGNMENT so that every block starts where the
+     * previous one ends. The region counts the blocks it has handed out
+     * which are still alive, plus one for the scratch_scope that created it,
+     * and deletes itself when the count reaches zero. Blocks are only handed
+     * out on the thread that owns the scope, but may be released from any
+     * thread.
+     */
+    scratch_region(std::size_t capacity)
+    : memory(static_cast<char*>(aligned_malloc(capacity, ND_DEFAULT_ALIGNMENT)))
+    , capacity(capacity)
+    , owner(std::this_thread::get_id())
+    {
+    }
+
+    ~scratch_region()
+    {
+        aligned_free(memory);
+    }
+
+    scratch_region(const scratch_region&) = delete;
+    scratch_region& operator=(const scratch_region&) = delete;
+
+    /**
+     * Returns the next block of the given size and alignment, or nullptr if
+     * the region cannot hold it. The offset returns to the start of the
+     * region whenever no blocks are alive, and to the start of the topmost
+     * block when it is released on the owning thread.
+     */
+    void* allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (live.load(std::memory_order_acquire) == 1)
+        {
+            offset = 0;
+        }
+        auto start = offset;
+
+        if (alignment > ND_DEFAULT_ALIGNMENT || bytes > capacity - start)
+        {
+            ++num_overflows;
+            return nullptr;
+        }
+        offset = std::min(rounded(start + bytes), capacity);
+        peak = std::max(peak, offset);
+        retain();
+        return memory + start;
+    }
+
+    bool contains(const void* ptr) const
+    {
+        auto p = static_cast<const char*>(ptr);
+        return p >= memory && p < memory + capacity;
+    }
+
+    void retain()
+    {
+        live.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release()
+    {
+        if (live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    /**
+     * Releases a block of the given size. If it is the most recent block
+     * still alive, and the caller is the owning thread (the only one which
+     * moves the offset), its memory is reclaimed at once. Temporaries are
+     * destroyed in the reverse order of their creation, so a long-lived
+     * block lower in the region does not stop them from being recycled.
+     */
+    void release(const void* block, std::size_t bytes)
+    {
+        auto start = static_cast<const char*>(block) - memory;
+
+        if (std::this_thread::get_id() == owner && std::min(rounded(start + bytes), capacity) == offset)
+        {
+            offset = start;
+        }
+        release();
+    }
+
+private:
+    friend class nd::scratch_scope;
+
+    static std::size_t rounded(std::size_t bytes)
+    {
+        return (bytes + ND_DEFAULT_ALIGNMENT - 1) / ND_DEFAULT_ALIGNMENT * ND_DEFAULT_ALIGNMENT;
+    }
+
+    char* memory;
+    std::size_t capacity;
+    std::size_t offset = 0;
+    std::size_t peak = 0;
+    std::size_t num_overflows = 0;
+    std::thread::id owner;
+    std::atomic<std::size_t> live {1};
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::scratch_allocator
+{
+    /**
+     * Allocates from a scratch region, falling back to the heap when the
+     * region is full. Every block holds a reference to the region, so that
+     * deallocate can tell the two kinds of block apart. Used to place the
+     * control blocks of buffers created inside a scratch_scope.
+     */
+
+    using value_type = T;
+
+    scratch_allocator(scratch_region* region) : region(region) {}
+
+    template<typename U>
+    scratch_allocator(const scratch_allocator<U>& other) : region(other.region) {}
+
+    T* allocate(std::size_t count)
+    {
+        telemetry::allocated_object(count * sizeof(T), "nd::buffer object");
+
+        if (auto ptr = region->allocate(count * sizeof(T), alignof(T)))
+        {
+            return static_cast<T*>(ptr);
+        }
+        auto ptr = static_cast<T*>(::operator new(count * sizeof(T)));
+        region->retain();
+        return ptr;
+    }
+
+    void deallocate(T* ptr, std::size_t count)
+    {
+        if (region->contains(ptr))
+        {
+            region->release(ptr, count * sizeof(T));
+            return;
+        }
+        ::operator delete(ptr);
+        region->release();
+    }
+
+    template<typename U>
+    bool operator==(const scratch_allocator<U>& other) const { return region == other.region; }
+
+    template<typename U>
+    bool operator!=(const scratch_allocator<U>& other) const { return region != other.region; }
+
+    scratch_region* region;
+};
+
+
+
+
+// ============================================================================
+class nd::scratch_scope
+{
+public:
+
+    /**
+     * While a scratch_scope is alive, buffers created on its thread with the
+     * default allocator (the temporaries of array expressions, copies, and
+     * new arrays) are bump-allocated from a region of capacity_bytes reserved
+     * up front, and so are their reference counts (unless ND_SINGLE_THREADED
+     * is defined). Memory is reclaimed in stack order: the most recent
+     * block is reused as soon as it is freed, and the whole region once every
+     * block in it has been freed. Temporaries are freed in the reverse order
+     * of their creation, so each complete expression in a loop like
+     *
+     * nd::scratch_scope scratch(1 << 26);
+     * for (...) { u += (A + B) * dt; }
+     *
+     * reuses the memory of the previous one, even when arrays created before
+     * the loop are still alive. Only memory below a live block stays pinned.
+     * Blocks freed on other threads are reclaimed once the region empties.
+     *
+     * Requests the region cannot hold are served by the default allocator,
+     * and counted as overflows. Arrays created inside the scope may safely
+     * outlive it: the region stays allocated until its last block is
+     * released. live_blocks() reports how many blocks are still alive, and
+     * contains() tells whether an array's memory is in the region; copy()
+     * the array outside the scope to move it onto the heap. Scopes may be
+     * nested, the innermost one being in effect.
+     */
+    explicit scratch_scope(std::size_t capacity_bytes)
+    : region(new detail::scratch_region(capacity_bytes))
+    , parent(current())
+    {
+        current() = region;
+    }
+
+    ~scratch_scope()
+    {
+        current() = parent;
+        region->release();
+    }
+
+    scratch_scope(const scratch_scope&) = delete;
+    scratch_scope& operator=(const scratch_scope&) = delete;
+
+    std::size_t capacity() const { return region->capacity; }
+    std::size_t peak_bytes() const { return region->peak; }
+    std::size_t overflows() const { return region->num_overflows; }
+    std::size_t live_blocks() const { return region->live.load() - 1; }
+    bool contains(const void* ptr) const { return region->contains(ptr); }
+
+    /**
+     * Returns the region of the innermost scratch_scope on this thread, or
+     * nullptr if there is none.
+     */
+    static detail::scratch_region* active()
+    {
+        return current();
+    }
+
+private:
+    static detail::scratch_region*& current()
+    {
+        static thread_local detail::scratch_region* region = nullptr;
+        return region;
+    }
+
+    detail::scratch_region* region;
+    detail::scratch_region* parent;
+}; 
+
+
+
+
+// ============================================================================
+template<typename T, typename... Args> 
+nd::buffer_ptr<T> nd::make_buffer(Args&&... args)
+{
+#ifdef ND_SINGLE_THREADED
+    return local_shared_ptr<buffer<T>>::make(std::forward<Args>(args)...);
+#else
+    if (auto region = scratch_scope::active())
+    {
+        return std::allocate_shared<buffer<T>>(detail::scratch_allocator<buffer<T>>(region), std::forward<Args>(args)...);
+    }
+    return std::allocate_shared<buffer<T>>(detail::object_allocator<buffer<T>>(), std::forward<Args>(args)...);
+#endif
+}
+
+
+
+
+// ============================================================================
+template<typename T>
+class nd::local_shared_ptr
+{
+public:
+
+    /**
+     * A minimal reference-counted pointer, like std::shared_ptr but with a
+     * plain integer count, stored in the same allocation as the object.
+     */
+    local_shared_ptr() {}
+
+    local_shared_ptr(std::nullptr_t) {}
+
+    local_shared_ptr(const local_shared_ptr<T>& other) : block(other.block)
+    {
+        if (block)
+        {
+            ++block->count;
+        }
+    }
+
+    local_shared_ptr(local_shared_ptr<T>&& other) : block(other.block)
+    {
+        other.block = nullptr;
+    }
+
+    ~local_shared_ptr()
+    {
+        release();
+    }
+
+    local_shared_ptr<T>& operator=(local_shared_ptr<T> other)
+    {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    template<typename... Args>
+    static local_shared_ptr<T> make(Args&&... args)
+    {
+        auto ptr = local_shared_ptr<T>();
+        telemetry::allocated_object(sizeof(control_block), "nd::local_shared_ptr block");
+        ptr.block = new control_block(std::forward<Args>(args)...);
+        return ptr;
+    }
+
+    void reset()
+    {
+        release();
+        block = nullptr;
+    }
+
+    T* get() const { return block ? &block->value : nullptr; }
+    T* operator->() const { return &block->value; }
+    T& operator*() const { return block->value; }
+    std::size_t use_count() const { return block ? block->count : 0; }
+    explicit operator bool() const { return block != nullptr; }
+    bool operator==(const local_shared_ptr<T>& other) const { return block == other.block; }
+    bool operator!=(const local_shared_ptr<T>& other) const { return block != other.block; }
+
+private:
+    struct control_block
+    {
+        template<typename... Args>
+        control_block(Args&&... args) : value(std::forward<Args>(args)...) {}
+        std::size_t count = 1;
+        T value;
+    };
+
+    void release()
+    {
+        if (block && --block->count == 0)
+        {
+            delete block;
+        }
+    }
+
+    control_block* block = nullptr;
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+class nd::buffer
+{
+public:
+
+    /**
+     * Buffers obtain their memory from an allocator given at construction,
+     * defaulting to nd::default_allocator (64-byte aligned). The allocator is
+     * stored type-erased alongside the memory, so buffers from different
+     * allocators have the same type and can be used interchangeably.
+     */
+    buffer() {}
+
+    buffer(const buffer<T>& other) : buffer(other.begin(), other.end())
+    {
+    }
+
+    buffer(buffer<T>&& other)
+    {
+        swap(other);
+    }
+
+    explicit buffer(std::size_t count, const T& value = T())
+    : buffer(count, value, default_allocator<T>())
+    {
+    }
+
+    template<typename Allocator>
+    buffer(std::size_t count, const T& value, Allocator allocator)
+    {
+        acquire(count, allocator);
+
+        try {
+            std::uninitialized_fill_n(memory, count, value);
+        }
+        catch (...)
+        {
+            discard();
+            throw;
+        }
+    }
+
+    template<typename Allocator = default_allocator<T>>
+    buffer(std::size_t count, uninitialized_t, Allocator allocator = Allocator())
+    {
+        acquire(count, allocator);
+
+        if (! std::is_trivially_default_constructible<T>::value)
+        {
+            try {
+                std::uninitialized_fill_n(memory, count, T());
+            }
+            catch (...)
+            {
+                discard();
+                throw;
+            }
+        }
+    }
+
+    template<class InputIt, typename = typename std::enable_if<! std::is_integral<InputIt>::value>::type>
+    buffer(InputIt first, InputIt last) : buffer(first, last, default_allocator<T>())
+    {
+    }
+
+    template<class InputIt, typename Allocator, typename = typename std::enable_if<! std::is_integral<InputIt>::value>::type>
+    buffer(InputIt first, InputIt last, Allocator allocator)
+    {
+        acquire(distance(first, last, typename std::iterator_traits<InputIt>::iterator_category()), allocator);
+
+        try {
+            copy_construct(first, last);
+        }
+        catch (...)
+        {
+            discard();
+            throw;
+        }
+    }
+
+    /**
+     * Adopts count elements of existing memory, which are released by calling
+     * deleter(data) when the buffer is destroyed. The elements are neither
+     * constructed nor destroyed by the buffer.
+     */
+    template<typename Deleter>
+    buffer(T* data, std::size_t count, Deleter deleter)
+    : memory(data)
+    , count(count)
+    , deleter([deleter] (T* ptr, std::size_t) mutable { deleter(ptr); })
+    , owns_elements(false)
+    {
+    }
+
+    buffer(T* data, std::size_t count, borrowed_t)
+    : memory(data)
+    , count(count)
+    , deleter([] (T*, std::size_t) {})
+    , owns_elements(false)
+    {
+    }
+
+    ~buffer()
+    {
+        if (source)
+        {
+            unregister();
+        }
+        destroy();
+    }
+
+    buffer<T>& operator=(const buffer<T>& other)
+    {
+        if (this != &other
+            && count == other.count
+            && owns_elements
+            && ! source
+            && snapshots.empty()
+            && std::is_trivially_copyable<T>::value)
+        {
+            copy_construct(other.begin(), other.end());
+            return *this;
+        }
+        auto copy = other;
+        swap(copy);
+        return *this;
+    }
+
+    buffer<T>& operator=(buffer<T>&& other)
+    {
+        separate();
+        destroy();
+        swap(other);
+        return *this;
+    }
+
+    bool operator==(const buffer<T>& other) const
+    {
+        if (count != other.count)
+        {
+            return false;
+        }
+        return equal_elements(other, std::integral_constant<bool, std::is_integral<T>::value>());
+    }
+
+    bool operator!=(const buffer<T>& other) const
+    {
+        return ! operator==(other);
+    }
+
+    /**
+     * Buffers sharing memory copy-on-write are separated before their
+     * storage is exchanged.
+     */
+    void swap(buffer<T>& other)
+    {
+        separate();
+        other.separate();
+        std::swap(memory, other.memory);
+        std::swap(count, other.count);
+        std::swap(deleter, other.deleter);
+        std::swap(owns_elements, other.owns_elements);
+    }
+
+    /**
+     * Returns a buffer that shares this buffer's memory copy-on-write. The
+     * memory stays shared until either side calls prepare_write: a snapshot
+     * being written takes its own copy, and the original being written makes
+     * one copy of the data as it was, which all of its snapshots then share.
+     * Snapshots of snapshots share memory with the original. Snapshots of a
+     * buffer may be taken, written and released on any thread (the registry
+     * is guarded by a mutex unless ND_SINGLE_THREADED is defined), but the
+     * original should not be written while its snapshots are in use on other
+     * threads.
+     */
+    static buffer_ptr<T> snapshot(const buffer_ptr<T>& buf)
+    {
+        auto snap = make_buffer<T>();
+        auto lock = lock_registry();
+        auto root = buf->source ? buf->source : buf;
+
+        snap->memory = root->memory;
+        snap->count = root->count;
+        snap->deleter = [] (T*, std::size_t) {};
+        snap->source = root;
+        register_snapshot(*root, snap.get());
+        return snap;
+    }
+
+    /**
+     * Must be called before writing to the buffer's memory. It is cheap when
+     * the buffer has no copy-on-write relationships.
+     */
+    void prepare_write()
+    {
+        if (source || ! snapshots.empty())
+        {
+            separate();
+        }
+    }
+
+    /**
+     * Returns the buffer which owns this buffer's memory: the buffer itself,
+     * or the one it is a copy-on-write snapshot of.
+     */
+    const buffer<T>* root() const
+    {
+        return source ? source.get() : this;
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    const T* data() const
+    {
+        return memory;
+    }
+
+    T* data()
+    {
+        return memory;
+    }
+
+    const T& operator[](std::size_t offset) const
+    {
+        return memory[offset];
+    }
+
+    T& operator[](std::size_t offset)
+    {
+        return memory[offset];
+    }
+
+    T* begin() { return memory; }
+    T* end() { return memory + count; }
+
+    const T* begin() const { return memory; }
+    const T* end() const { return memory + count; }
+
+private:
+    void separate()
+    {
+        if (source)
+        {
+            detach();
+        }
+        if (! snapshots.empty())
+        {
+            release_snapshots();
+        }
+    }
+
+    /**
+     * Moves every snapshot of this buffer onto a single copy of its data,
+     * which then becomes their shared source.
+     */
+    void release_snapshots()
+    {
+        ND_OPERATION("copy-on-write separation");
+
+        auto copy = make_buffer<T>(begin(), end());
+        auto lock = lock_registry();
+
+        for (auto snap : snapshots)
+        {
+            snap->memory = copy->memory;
+            snap->source = copy;
+        }
+        std::swap(copy->snapshots, snapshots);
+    }
+
+    void detach()
+    {
+        ND_OPERATION("copy-on-write separation");
+
+        auto copy = buffer<T>(begin(), end());
+        unregister();
+        source.reset();
+        std::swap(memory, copy.memory);
+        std::swap(count, copy.count);
+        std::swap(deleter, copy.deleter);
+        std::swap(owns_elements, copy.owns_elements);
+    }
+
+    /**
+     * Iterator ranges are measured in one step when the iterator allows it,
+     * and trivially copyable elements are copied with a single memcpy. Only
+     * integral types are compared with memcmp, since floating point values
+     * such as -0.0 and NaN compare differently from their bytes.
+     */
+    template<class InputIt>
+    static std::size_t distance(InputIt first, InputIt last, std::random_access_iterator_tag)
+    {
+        return last - first;
+    }
+
+    template<class InputIt>
+    static std::size_t distance(InputIt first, InputIt last, std::input_iterator_tag)
+    {
+        std::size_t size = 0;
+
+        while (first != last)
+        {
+            ++first;
+            ++size;
+        }
+        return size;
+    }
+
+    template<class InputIt>
+    void copy_construct(InputIt first, InputIt last)
+    {
+        std::uninitialized_copy(first, last, memory);
+    }
+
+    void copy_construct(T* first, T* last)
+    {
+        copy_construct(static_cast<const T*>(first), static_cast<const T*>(last));
+    }
+
+    void copy_construct(const T* first, const T* last)
+    {
+        copy_elements(first, last, std::integral_constant<bool, std::is_trivially_copyable<T>::value>());
+    }
+
+    void copy_elements(const T* first, const T* last, std::true_type)
+    {
+        if (first != last)
+        {
+            std::memcpy(memory, first, (last - first) * sizeof(T));
+        }
+    }
+
+    void copy_elements(const T* first, const T* last, std::false_type)
+    {
+        std::uninitialized_copy(first, last, memory);
+    }
+
+    bool equal_elements(const buffer<T>& other, std::true_type) const
+    {
+        return count == 0 || std::memcmp(memory, other.memory, count * sizeof(T)) == 0;
+    }
+
+    bool equal_elements(const buffer<T>& other, std::false_type) const
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            if (memory[n] != other.memory[n])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void register_snapshot(buffer<T>& root, buffer<T>* snap)
+    {
+        auto capacity = root.snapshots.capacity();
+        root.snapshots.push_back(snap);
+
+        if (root.snapshots.capacity() != capacity)
+        {
+            telemetry::allocated_object(root.snapshots.capacity() * sizeof(snap), "nd::buffer snapshot registry");
+        }
+    }
+
+    void unregister()
+    {
+        auto lock = lock_registry();
+        auto& list = source->snapshots;
+        list.erase(std::remove(list.begin(), list.end(), this), list.end());
+    }
+
+    static std::unique_lock<std::mutex> lock_registry()
+    {
+#ifdef ND_SINGLE_THREADED
+        return std::unique_lock<std::mutex>();
+#else
+        static std::mutex mutex;
+        return std::unique_lock<std::mutex>(mutex);
+#endif
+    }
+
+    template<typename Allocator>
+    void acquire(std::size_t size, Allocator allocator)
+    {
+        using rebound = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        auto alloc = rebound(allocator);
+
+        if (std::is_same<rebound, default_allocator<T>>::value && acquire_scratch(size))
+        {
+            return;
+        }
+        memory = alloc.allocate(size);
+        count = size;
+        owns_elements = true;
+
+        if (! memory)
+        {
+            deleter = [alloc] (T* ptr, std::size_t size) mutable { alloc.deallocate(ptr, size); };
+            return;
+        }
+        auto recorded = telemetry::allocated<T>(size * sizeof(T));
+
+        deleter = [alloc, recorded] (T* ptr, std::size_t size) mutable
+        {
+            telemetry::deallocated<T>(size * sizeof(T), recorded);
+            alloc.deallocate(ptr, size);
+        };
+    }
+
+    /**
+     * Takes the memory from the active scratch_scope, if there is one and it
+     * has room. The deleter holds a reference to the scratch region.
+     */
+    bool acquire_scratch(std::size_t size)
+    {
+        auto region = scratch_scope::active();
+
+        if (! region || size == 0 || size > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            return false;
+        }
+        memory = static_cast<T*>(region->allocate(size * sizeof(T), std::max<std::size_t>(ND_DEFAULT_ALIGNMENT, alignof(T))));
+
+        if (! memory)
+        {
+            return false;
+        }
+        count = size;
+        owns_elements = true;
+
+        auto recorded = telemetry::allocated<T>(size * sizeof(T));
+
+        deleter = [region, recorded] (T* ptr, std::size_t size)
+        {
+            telemetry::deallocated<T>(size * sizeof(T), recorded);
+            region->release(ptr, size * sizeof(T));
+        };
+        return true;
+    }
+
+    void destroy()
+    {
+        if (owns_elements && ! std::is_trivially_destructible<T>::value)
+        {
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                memory[n].~T();
+            }
+        }
+        discard();
+    }
+
+    void discard()
+    {
+        if (memory)
+        {
+            deleter(memory, count);
+        }
+        memory = nullptr;
+        count = 0;
+    }
+
+    T* memory = nullptr;
+    std::size_t count = 0;
+    std::function<void(T*, std::size_t)> deleter;
+    bool owns_elements = false;
+    buffer_ptr<T> source;
+    std::vector<buffer<T>*> snapshots;
+}; 
+
+
+
+
+// ============================================================================
+template<typename... Index> 
+constexpr int nd::detail::count_integral()
+{
+    bool flags[] = {false, (std::is_integral<Index>::value || std::is_same<Index, axis::index>::value)...};
+    int count = 0;
+
+    for (auto flag : flags)
+        count += flag;
+
+    return count;
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R>
+class nd::ndarray_view
+{
+public:
+
+    /**
+     * A non-owning, trivially copyable view of array data: a pointer to the
+     * first element, plus the shape and the element strides of each axis.
+     * Views are obtained from ndarray::view() (or built over raw memory), and
+     * are meant to be passed by value to kernels and worker threads. They do
+     * not keep the memory alive, they are not copy-on-write aware, and they
+     * perform no bounds checking. Use ndarray_view<const T, R> for read-only
+     * access; that is what const arrays give out.
+     */
+
+    using dtype = T;
+    enum { rank = R };
+
+    ndarray_view() {}
+
+    ndarray_view(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides)
+    : mem(data)
+    , dims(shape)
+    , steps(strides)
+    {
+    }
+
+    template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    ndarray_view(const ndarray_view<U, R>& other)
+    : mem(other.mem)
+    , dims(other.dims)
+    , steps(other.steps)
+    {
+    }
+
+
+
+
+    // ========================================================================
+    T* data() const { return mem; }
+    std::array<int, R> shape() const { return dims; }
+    int shape(int axis) const { return dims[axis]; }
+    std::array<std::ptrdiff_t, R> strides() const { return steps; }
+
+    std::size_t size() const
+    {
+        std::size_t s = 1;
+
+        for (int n = 0; n < R; ++n)
+            s *= dims[n];
+
+        return s;
+    }
+
+    /**
+     * Returns a view of the same elements, in the same row-major order, with
+     * adjacent axes merged wherever the memory layout allows (see
+     * detail::coalesce_axes). Its leading axes may have length 1.
+     */
+    ndarray_view<T, R> coalesced() const
+    {
+        auto result = *this;
+        auto strides = std::array<std::array<std::ptrdiff_t, R>, 1>{{steps}};
+        detail::coalesce_axes<R, 1>(result.dims, strides);
+        result.steps = strides[0];
+        return result;
+    }
+
+    bool contiguous() const
+    {
+        std::ptrdiff_t stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            if (dims[n] != 1 && steps[n] != stride)
+                return false;
+
+            stride *= dims[n];
+        }
+        return true;
+    }
+
+
+
+
+    // ========================================================================
+    template<typename... Index>
+    T& operator()(Index... index) const
+    {
+        static_assert(sizeof...(Index) == R, "ndarray_view: number of indexes must match rank");
+        const std::ptrdiff_t i[] = {0, std::ptrdiff_t(index)...};
+        std::ptrdiff_t m = 0;
+
+        for (int n = 0; n < R; ++n)
+            m += i[n + 1] * steps[n];
+
+        return mem[m];
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
+    ndarray_view<T, R - 1> operator[](int index) const
+    {
+        return select_leading(index);
+    }
+
+    template<typename... Index>
+    ndarray_view<T, R - detail::count_integral<Index...>()> select(Index... index) const
+    {
+        static_assert(sizeof...(Index) == R, "ndarray_view: number of selections must match rank");
+        auto result = ndarray_view<T, R - detail::count_integral<Index...>()>();
+        auto n = 0;
+        auto m = 0;
+
+        result.mem = mem;
+        (void) std::initializer_list<int>{(select_axis(result, n++, m, index), 0)...};
+        return result;
+    }
+
+    template<int Axis, typename Slice>
+    ndarray_view<T, R> take(Slice slice) const
+    {
+        static_assert(Axis >= 0 && Axis < R, "ndarray_view: invalid axis");
+        static_assert(! std::is_integral<Slice>::value, "ndarray_view: take requires a range or selection");
+        auto result = *this;
+        auto m = Axis;
+        select_axis(result, Axis, m, slice);
+        return result;
+    }
+
+    /**
+     * Shifts the view along one axis, dropping the elements moved past its
+     * end. A view does not know the extent of the array it was taken from,
+     * so unlike ndarray::shift, which moves a sub-array's window across its
+     * parent, the shifted view always stays inside the original view. The
+     * two agree for views of whole arrays.
+     */
+    template<int Axis>
+    ndarray_view<T, R> shift(int distance) const
+    {
+        static_assert(Axis >= 0 && Axis < R, "ndarray_view: invalid axis");
+        auto result = *this;
+
+        if (distance > 0)
+        {
+            distance = std::min(distance, dims[Axis]);
+            result.mem += distance * steps[Axis];
+        }
+        result.dims[Axis] = dims[Axis] - std::min(std::abs(distance), dims[Axis]);
+        return result;
+    }
+
+
+
+
+    // ========================================================================
+    /**
+     * Walks the view in row-major order by moving a pointer. Random access
+     * seeks in O(R); increments and decrements add a step, plus a carry
+     * when an axis wraps around.
+     */
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = typename std::remove_const<T>::type;
+        using pointer = T*;
+        using reference = T&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        iterator() {}
+        iterator(const ndarray_view<T, R>& view, std::size_t position)
+        : view(view.coalesced())
+        , step(this->view.steps[R - 1])
+        , run(this->view.dims[R - 1])
+        {
+            for (int n = 1; n < R; ++n)
+                carry[n] = this->view.steps[n - 1] - this->view.dims[n] * this->view.steps[n];
+
+            seek(position);
+        }
+
+        /**
+         * Steps the pointer along the last axis. When that axis wraps around,
+         * the pointer moves by a precomputed amount that rewinds it and
+         * advances the axis before it, so a step never recomputes an offset
+         * from the index.
+         */
+        iterator& operator++()
+        {
+            ++position;
+            ptr += step;
+
+            if (++inner == run && R > 1)
+                carry_forward();
+
+            return *this;
+        }
+
+        iterator& operator--()
+        {
+            --position;
+            ptr -= step;
+
+            if (inner-- == 0 && R > 1)
+                carry_backward();
+
+            return *this;
+        }
+
+        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { seek(position + n); return *this; }
+        iterator& operator-=(difference_type n) { seek(position - n); return *this; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return difference_type(position - other.position); }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return position == other.position; }
+        bool operator!=(const iterator& other) const { return position != other.position; }
+        bool operator< (const iterator& other) const { return position <  other.position; }
+        bool operator> (const iterator& other) const { return position >  other.position; }
+        bool operator<=(const iterator& other) const { return position <= other.position; }
+        bool operator>=(const iterator& other) const { return position >= other.position; }
+        T& operator*() const { return *ptr; }
+        T& operator[](difference_type n) const { return *(*this + n); }
+
+    private:
+        void carry_forward()
+        {
+            int n = R - 2;
+            inner = 0;
+            ptr += carry[R - 1];
+
+            while (++index[n] == view.dims[n] && n > 0)
+            {
+                index[n] = 0;
+                ptr += carry[n];
+                --n;
+            }
+        }
+
+        void carry_backward()
+        {
+            int n = R - 2;
+            inner = run - 1;
+            ptr -= carry[R - 1];
+
+            while (index[n]-- == 0 && n > 0)
+            {
+                index[n] = view.dims[n] - 1;
+                ptr -= carry[n];
+                --n;
+            }
+        }
+
+        /**
+         * Moves to the given position in O(R). The index past the last
+         * element is {dims[0], 0, ...}, which is where operator++ leaves it.
+         */
+        void seek(std::size_t p)
+        {
+            position = p;
+            ptr = view.mem;
+            index = {};
+            inner = 0;
+
+            if (view.size() == 0)
+                return;
+
+            for (int n = R - 1; n > 0; --n)
+            {
+                index[n] = int(p % view.dims[n]);
+                p /= view.dims[n];
+                ptr += index[n] * view.steps[n];
+            }
+            index[0] = int(p);
+            ptr += index[0] * view.steps[0];
+            inner = index[R - 1];
+        }
+
+        ndarray_view<T, R> view;
+        T* ptr = nullptr;
+        std::size_t position = 0;
+        std::ptrdiff_t step = 0;
+        int inner = 0;
+        int run = 0;
+        std::array<int, R> index = {};
+        std::array<std::ptrdiff_t, R> carry = {};
+    };
+
+    iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, 0}; }
+    iterator end() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, size()}; }
+
+
+
+
+    // ========================================================================
+    /**
+     * Visits the elements as a sequence of runs along the last axis, calling
+     * function(T* data, std::size_t length, std::ptrdiff_t stride) for each
+     * one, in row-major order. A contiguous view is a single run of stride
+     * 1, and views that are only contiguous along the last axis (sub-blocks
+     * taken along the leading axes) give runs of stride 1, so the function
+     * can run a tight inner loop that the compiler vectorizes:
+     *
+     * V.for_each_run([] (double* p, std::size_t n, std::ptrdiff_t s) {
+     *     if (s == 1) for (std::size_t i = 0; i < n; ++i) p[i] *= 2;
+     *     else        for (std::size_t i = 0; i < n; ++i) p[i * s] *= 2;
+     * });
+     */
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        detail::for_each_run([&function] (std::size_t length, detail::strided_run<T> run)
+        {
+            function(run.data, length, run.stride);
+        }, *this);
+    }
+
+private:
+    template<typename, int>
+    friend class ndarray_view;
+
+    ndarray_view<T, R - 1> select_leading(int index) const
+    {
+        auto result = ndarray_view<T, R - 1>();
+        result.mem = mem + index * steps[0];
+
+        for (int n = 1; n < R; ++n)
+        {
+            result.dims[n - 1] = dims[n];
+            result.steps[n - 1] = steps[n];
+        }
+        return result;
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int&, int index) const
+    {
+        result.mem += index * steps[n];
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::index index) const
+    {
+        select_axis(result, n, m, index.lower);
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::all) const
+    {
+        result.dims[m] = dims[n];
+        result.steps[m] = steps[n];
+        ++m;
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::range range) const
+    {
+        select_axis(result, n, m, axis::selection(range.lower, range.upper, 1));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, std::tuple<int, int> range) const
+    {
+        select_axis(result, n, m, axis::selection(std::get<0>(range), std::get<1>(range), 1));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, std::tuple<int, int, int> selection) const
+    {
+        select_axis(result, n, m, axis::selection(std::get<0>(selection), std::get<1>(selection), std::get<2>(selection)));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::selection selection) const
+    {
+        result.mem += selection.lower * steps[n];
+        result.dims[m] = (selection.upper - selection.lower + selection.skips - 1) / selection.skips;
+        result.steps[m] = steps[n] * selection.skips;
+        ++m;
+    }
+
+    T* mem = nullptr;
+    std::array<int, R> dims = {};
+    std::array<std::ptrdiff_t, R> steps = {};
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::strided_run
+{
+    T& operator[](std::size_t i) const { return data[std::ptrdiff_t(i) * stride]; }
+
+    T* data;
+    std::ptrdiff_t stride;
+};
+
+
+
+
+// ============================================================================
+template<int R, typename Function, typename... T>
+void nd::detail::for_each_run(Function function, const ndarray_view<T, R>&... views)
+{
+    const bool contiguous[] = {views.contiguous()...};
+    const auto size = std::get<0>(std::forward_as_tuple(views...)).size();
+
+    if (size == 0)
+    {
+        return;
+    }
+    if (std::all_of(std::begin(contiguous), std::end(contiguous), [] (bool c) { return c; }))
+    {
+        function(size, strided_run<T>{views.data(), 1}...);
+        return;
+    }
+    for_each_coalesced_run(function, std::index_sequence_for<T...>(), views...);
+}
+
+template<int R, typename Function, typename... T, std::size_t... I>
+void nd::detail::for_each_coalesced_run(Function function, std::index_sequence<I...>, const ndarray_view<T, R>&... views)
+{
+    auto shape = std::get<0>(std::forward_as_tuple(views...)).shape();
+    auto strides = std::array<std::array<std::ptrdiff_t, R>, sizeof...(T)>{{views.strides()...}};
+    auto first = R - coalesce_axes<R>(shape, strides);
+    auto index = std::array<int, R>();
+    auto offset = [&index] (const std::array<std::ptrdiff_t, R>& s)
+    {
+        std::ptrdiff_t m = 0;
+
+        for (int n = 0; n < R - 1; ++n)
+            m += index[n] * s[n];
+
+        return m;
+    };
+
+    while (true)
+    {
+        function(std::size_t(shape[R - 1]), strided_run<T>{views.data() + offset(strides[I]), strides[I][R - 1]}...);
+
+        int n = R - 2;
+
+        while (n >= first && ++index[n] == shape[n])
+        {
+            index[n] = 0;
+            --n;
+        }
+        if (n < first)
+        {
+            break;
+        }
+    }
+} 
+
+
+
+
+// ============================================================================
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::arange(int size, Allocator allocator) 
+{
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
+    auto x = T();
+    for (auto& a : A) a = x++;
+    return A;
+}
+
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::linspace(T start, T end, int size, Allocator allocator)
+{
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
+    auto h = (end - start) / (size - 1);
+    auto x = start - h;
+    for (auto& a : A) a = (x += h);
+    return A;
+}
+
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::ones(int size, Allocator allocator)
+{
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
+    for (auto& a : A) a = 1;
+    return A;
+}
+
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::zeros(int size, Allocator allocator)
+{
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
+    for (auto& a : A) a = 0;
+    return A;
+}
+
+template<typename T, typename... Dims> nd::ndarray<T, sizeof...(Dims)> nd::empty(Dims... dims)
+{
+    return nd::ndarray<T, sizeof...(Dims)>(std::array<int, sizeof...(Dims)>{int(dims)...}, uninitialized);
+}
+
+/**
+ * Wrap existing memory as an ndarray without copying it. adopt takes
+ * ownership, calling deleter(data) once the last array referring to the
+ * memory is gone; borrow never releases the memory, so the caller must keep
+ * it alive. Strides are given in elements (not bytes) and must be positive,
+ * each axis must fit inside the stride of the axis before it, and every
+ * stride other than the last two must divide the one before it.
+ */
+template<typename T, int R, typename Deleter>
+nd::ndarray<T, R> nd::adopt(T* data, std::array<int, R> shape, Deleter deleter)
+{
+    return adopt<T, R>(data, shape, selector<R>(shape).strides(), deleter);
+}
+
+template<typename T, int R, typename Deleter>
+nd::ndarray<T, R> nd::adopt(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides, Deleter deleter)
+{
+    static_assert(R > 0, "adopt: cannot wrap memory as a rank-0 array");
+
+    auto sel = selector<R>(shape);
+    auto extent = std::size_t(1);
+
+    for (int n = 0; n < R; ++n)
+    {
+        if (strides[n] <= 0)
+            throw std::invalid_argument("adopt: strides must be positive");
+
+        if (shape[n] == 0)
+            extent = 0;
+
+        if (extent)
+            extent += std::size_t(shape[n] - 1) * strides[n];
+    }
+
+    for (int n = R - 1; n > 0; --n)
+    {
+        if (std::size_t(shape[n] - 1) * strides[n] >= std::size_t(strides[n - 1]) && shape[n] > 0)
+            throw std::invalid_argument("adopt: strides describe overlapping axes");
+
+        if (n < R - 1 && strides[n - 1] % strides[n] != 0)
+            throw std::invalid_argument("adopt: strides are not representable by a selector");
+
+        sel.count[n] = n == R - 1 ? strides[n - 1] : strides[n - 1] / strides[n];
+    }
+
+    sel.count[0] = R == 1 ? std::ptrdiff_t(extent) : shape[0];
+    sel.skips[R - 1] = strides[R - 1];
+    sel.final[R - 1] = std::ptrdiff_t(shape[R - 1]) * strides[R - 1];
+
+    auto buf = make_buffer<T>(data, extent, deleter);
+    return ndarray<T, R>(sel, buf);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::borrow(T* data, std::array<int, R> shape)
+{
+    return adopt<T, R>(data, shape, [] (T*) {});
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::borrow(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides)
+{
+    return adopt<T, R>(data, shape, strides, [] (T*) {});
+}
+
+template<typename T, int R> /* UNTESTED */
+nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays)
+{
+    if (arrays.size() == 0)
+    {
+        return nd::ndarray<T, R>();            
+    }
+
+    auto required_shape = arrays.begin()->shape();
+
+    std::array<int, R> dim_sizes;
+    dim_sizes[0] = arrays.size();
+
+    for (int n = 1; n < R; ++n)
+    {
+        dim_sizes[n] = required_shape[n - 1];
+    }
+    auto A = nd::ndarray<T, R>(dim_sizes, uninitialized);
+    auto n = 0;
+
+    for (const auto& array : arrays)
+    {
+        A[n] = array;
+        ++n;
+    }
+    return A;
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R, typename Op>
+struct nd::unary_op
+{
+    static auto perform(const ndarray<T, R>& A)
+    {
+        ND_OPERATION("unary_op::perform");
+
+        auto op = Op();
+        auto B = ndarray<decltype(op(T())), R>(A.shape(), uninitialized);
+
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b)
+        {
+            if (a.stride == 1 && b.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) b.data[i] = op(a.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) b[i] = op(a[i]);
+        }, A.view(), B.view());
+
+        return B;
+    }
+};
+
+
+
+
+// ============================================================================
+template<typename T, typename U, int R, typename Op>
+struct nd::binary_op
+{
+    static auto perform(const ndarray<T, R>& A, const ndarray<U, R>& B)
+    {
+        ND_OPERATION("binary_op::perform");
+
+        if (A.shape() != B.shape())
+            throw std::invalid_argument("incompatible shapes for binary operation");
+
+        auto op = Op();
+        auto C = ndarray<decltype(op(T(), U())), R>(A.shape(), uninitialized);
+
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b, auto c)
+        {
+            if (a.stride == 1 && b.stride == 1 && c.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) c.data[i] = op(a.data[i], b.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) c[i] = op(a[i], b[i]);
+        }, A.view(), B.view(), C.view());
+
+        return C;
+    }
+
+    static auto perform(const ndarray<T, R>& A, U b)
+    {
+        ND_OPERATION("binary_op::perform");
+
+        auto op = Op();
+        auto C = ndarray<decltype(op(T(), U())), R>(A.shape(), uninitialized);
+
+        detail::for_each_run([&op, b] (std::size_t n, auto a, auto c)
+        {
+            if (a.stride == 1 && c.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) c.data[i] = op(a.data[i], b);
+            else
+                for (std::size_t i = 0; i < n; ++i) c[i] = op(a[i], b);
+        }, A.view(), C.view());
+
+        return C;
+    }
+
+    static void perform(ndarray<T, R>& A, const ndarray<U, R>& B)
+    {
+        ND_OPERATION("binary_op::perform");
+
+        if (A.shape() != B.shape())
+            throw std::invalid_argument("incompatible shapes for binary operation");
+
+        auto op = Op();
+
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b)
+        {
+            if (a.stride == 1 && b.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) a.data[i] = op(a.data[i], b.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) a[i] = op(a[i], b[i]);
+        }, A.view(), B.view());
+    }
+};
+
+
+
+
+// ============================================================================
+/**
+ * Rank-0 arrays which own their value (rather than viewing an element of
+ * another array) keep it inline, so creating, copying, and destroying them
+ * never touches the heap. Arrays of higher rank carry an empty member.
+ */
+namespace nd {
+  namespace detail {
+    template<typename T> struct scalar_storage<T, true>
+    {
+        T* data() { return &value; }
+        const T* data() const { return &value; }
+        T value = T();
+    };
+
+    template<typename T> struct scalar_storage<T, false>
+    {
+        T* data() { return nullptr; }
+        const T* data() const { return nullptr; }
+    };
+  }
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R>
+class nd::ndarray
+{
+public:
+
+
+    using dtype = T;
+    enum { rank = R };
+
+
+
+
+    /**
+     * Wrapper class for constant arrays. Can be trivially converted back to
+     * const nd::array&.
+     */
+    // ========================================================================
+    class const_ref
+    {
+    public:
+
+        using dtype = T;
+        enum { rank = R };
+
+        const_ref(selector<R> sel, buffer_ptr<T> buf) : A(sel, buf) {}
+        template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
+        template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
+        template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
+        template<typename... Args> auto size(const Args&... args) const { return A.size(args...); }
+        template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
+        template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
+        template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
+        template<typename... Args> auto compact(const Args&... args) const { return A.compact(args...); }
+        auto detach() const { return A.detach(); }
+        auto retained_bytes() const { return A.retained_bytes(); }
+        auto addressable_bytes() const { return A.addressable_bytes(); }
+
+        operator const ndarray<T, R>&() const { return A; }
+        bool is_const_ref() const { return true; }
+
+        auto begin() const { return A.begin(); }
+        auto end() const { return A.end(); }
+        auto view() const { return A.view(); }
+        template<typename Function> void for_each_run(Function function) const { A.for_each_run(function); }
+
+    private:
+        friend class ndarray;
+        ndarray<T, R> A;
+    };
+
+
+
+
+    /**
+     * Constructors
+     * 
+     */
+    // ========================================================================
+    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
+    ndarray(T value=T())
+    : scalar_offset(0)
+    {
+        scalar.value = value;
+    }
+
+    template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
+    ndarray(std::ptrdiff_t scalar_offset, buffer_ptr<T>& buf)
+    : scalar_offset(scalar_offset)
+    , buf(buf)
+    {
+    }
+
+    template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
+    ndarray(std::initializer_list<T> elements)
+    : sel(std::array<int, 1>{int(elements.size())})
+    , strides(sel.strides())
+    , buf(make_buffer<T>(elements.begin(), elements.end()))
+    {
+    }
+
+    template<typename... Dims>
+    ndarray(Dims... dims) : ndarray(std::array<int, R>({int(dims)...}))
+    {
+        static_assert(sizeof...(dims) == rank,
+          "Number of arguments to ndarray constructor must match rank");
+    }
+
+    template<typename SelectorType>
+    ndarray(SelectorType sel, buffer_ptr<T>& buf)
+    : sel(sel)
+    , strides(sel.strides())
+    , buf(buf)
+    {
+    }
+
+    ndarray() : ndarray(constant_array<rank>(0))
+    {
+    }
+
+    ndarray(std::array<int, R> dim_sizes)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(R == 0 ? nullptr : make_buffer<T>(sel.size()))
+    {
+    }
+
+    template<typename Allocator, typename = decltype(std::declval<Allocator&>().allocate(std::size_t()))>
+    ndarray(std::array<int, R> dim_sizes, Allocator allocator)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(make_buffer<T>(sel.size(), T(), allocator))
+    {
+    }
+
+    template<typename Allocator = default_allocator<T>>
+    ndarray(std::array<int, R> dim_sizes, uninitialized_t, Allocator allocator = Allocator())
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(make_buffer<T>(sel.size(), uninitialized, allocator))
+    {
+    }
+
+    ndarray(std::array<int, R> dim_sizes, buffer_ptr<T>& buf)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(buf)
+    {
+        assert_valid_argument(buf->size() == sel.size(),
+            "Size of data buffer is not the product of dim sizes");
+    }
+
+    /**
+     * Copies of const arrays share their memory copy-on-write when they cover
+     * the whole buffer: the data is only duplicated if either the copy or the
+     * original is later written to. Copies of partial views are compacted
+     * into a new buffer right away. Copies of rank-0 arrays hold their value
+     * inline.
+     */
+    ndarray(const ndarray<T, R>& other)
+    {
+        ND_OPERATION("ndarray copy constructor (const)");
+
+        copy_construct(other, std::integral_constant<bool, R == 0>());
+    }
+
+    /**
+     * Copies of non-const arrays share their memory, except for rank-0 arrays
+     * holding their value inline, which cannot be shared.
+     */
+    ndarray(ndarray<T, R>& other)
+    {
+        scalar_offset = other.scalar_offset;
+        scalar = other.scalar;
+        strides = other.strides;
+        sel = other.sel;
+        buf = other.buf;
+    }
+
+
+
+
+    /**
+     * Assignment operators
+     * 
+     */
+    // ========================================================================
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    ndarray<T, R>& operator=(T value)
+    {
+        data()[scalar_offset] = value;
+        return *this;
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
+    ndarray<T, R>& operator=(T value)
+    {
+        for_each_element([value] (T& a) { a = value; });
+        return *this;
+    }
+
+    ndarray<T, R>& operator=(const ndarray<T, R>& other)
+    {
+        copy_internal(*this, other);
+        return *this;
+    }
+
+    void become(ndarray<T, R> other)
+    {
+        scalar_offset = other.scalar_offset;
+        scalar = other.scalar;
+        strides = other.strides;
+        sel = other.sel;
+        buf = other.buf;
+    }
+
+    template<typename... Sizes>
+    auto reshape(Sizes... sizes)
+    {
+        ND_OPERATION("ndarray::reshape");
+
+        if (! contiguous())
+        {
+            auto A = ndarray<T, sizeof...(Sizes)>(std::array<int, sizeof...(Sizes)>{int(sizes)...}, uninitialized);
+            copy_internal(A, *this);
+            return A;
+        }
+        return ndarray<T, sizeof...(Sizes)>({sizes...}, buf);
+    }
+
+    template<typename... Sizes>
+    const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
+    {
+        ND_OPERATION("ndarray::reshape");
+
+        if (! contiguous())
+        {
+            auto A = ndarray<T, sizeof...(Sizes)>(std::array<int, sizeof...(Sizes)>{int(sizes)...}, uninitialized);
+            copy_internal(A, *this);
+            return A;
+        }
+        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<buffer_ptr<T>&>(buf));
+    }
+
+
+
+
+    /**
+     * Shape and size query methods
+     * 
+     */
+    // ========================================================================
+    auto size() const { return sel.size(); }
+    bool empty() const { return sel.empty(); }
+    auto shape() const { return sel.shape(); }
+    auto shape(int axis) const { return sel.shape(axis); }
+    bool contiguous() const { return sel.contiguous(); }
+
+
+
+
+    /**
+     * Data accessors and selection methods
+     * 
+     */
+    // ========================================================================
+    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    ndarray<T, R - 1> operator[](int index)
+    {
+        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {offset_relative({index}), buf};
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    const ndarray<T, R - 1> operator[](int index) const
+    {
+        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {offset_relative({index}), const_cast<buffer_ptr<T>&>(buf)};
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    ndarray<T, R - 1> operator[](int index)
+    {
+        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {sel.select(index), buf};
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    const ndarray<T, R - 1> operator[](int index) const
+    {
+        if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
+            throw std::out_of_range("ndarray: index out of range");
+
+        return {sel.select(index), const_cast<buffer_ptr<T>&>(buf)};
+    }
+
+    template<typename... Index>
+    T& operator()(Index... index)
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: index out of range");
+
+        return data()[offset_relative({int(index)...})];
+    }
+
+    template<typename... Index>
+    const T& operator()(Index... index) const
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        return data()[offset_relative({int(index)...})];
+    }
+
+    template<typename... Index>
+    auto select(Index... index)
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        auto S = sel.select(index...);
+        return ndarray<T, S.rank>(S.reset(), buf);
+    }
+
+    template<typename... Index>
+    auto select(Index... index) const
+    {
+        if (! sel.contains(index...))
+            throw std::out_of_range("ndarray: selection out of range");
+
+        auto S = sel.select(index...);
+        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+    }
+
+    template<int Axis, typename Slice>
+    auto take(Slice slice)
+    {
+        auto taken_sel = sel.template on<Axis>().select(slice).reset();
+        return ndarray<T, R>(taken_sel, buf);
+    }
+
+    template<int Axis, typename Slice>
+    auto take(Slice slice) const
+    {
+        auto S = sel.template on<Axis>().select(slice).reset();
+        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+    }
+
+    template<int Axis>
+    auto shift(int distance)
+    {
+        auto shifted_sel = sel.template on<Axis>().shift(distance).reset();
+        return ndarray<T, R>(shifted_sel, buf);
+    }
+
+    template<int Axis>
+    auto shift(int distance) const
+    {
+        auto S = sel.template on<Axis>().shift(distance).reset();
+        return typename ndarray<T, S.rank>::const_ref(S.reset(), buf);
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
+    operator T() const
+    {
+        // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
+        return data()[scalar_offset];
+    }
+
+    ndarray<T, R> copy() const
+    {
+        ND_OPERATION("ndarray::copy");
+
+        if (buf && contiguous() && buf->size() == size())
+        {
+            auto d = make_buffer<T>(*buf);
+            return {shape(), d};
+        }
+        auto A = ndarray<T, R>(shape(), uninitialized);
+        copy_internal(A, *this);
+        return A;
+    }
+
+    /**
+     * Returns a copy of this array in a right-sized buffer if it addresses
+     * less than the given fraction of the buffer it keeps alive, and
+     * otherwise an array sharing its memory (copy-on-write, as for any copy
+     * of a const array). Small selections that outlive their parent, for
+     * example slices kept in a cache, should be compacted so that they do not
+     * pin the parent's memory. detach() copies unless the array addresses
+     * its entire buffer.
+     */
+    ndarray<T, R> compact(double fraction = 0.5) const
+    {
+        return compact_internal(fraction, std::integral_constant<bool, R == 0>());
+    }
+
+    ndarray<T, R> detach() const
+    {
+        return compact(1.0);
+    }
+
+    /**
+     * The bytes kept alive by this array (its whole buffer), and the bytes
+     * of it the array can address. Rank-0 arrays holding their value inline
+     * report zero for both.
+     */
+    std::size_t retained_bytes() const
+    {
+        return buf ? buf->size() * sizeof(T) : 0;
+    }
+
+    std::size_t addressable_bytes() const
+    {
+        return buf ? size() * sizeof(T) : 0;
+    }
+
+    template<typename new_type, typename std::enable_if<std::is_same<new_type, T>::value>::type* = nullptr>
+    ndarray<new_type, R> astype() const
+    {
+        return copy();
+    }
+
+    template<typename new_type, typename std::enable_if<! std::is_same<new_type, T>::value>::type* = nullptr>
+    ndarray<new_type, R> astype() const
+    {
+        ND_OPERATION("ndarray::astype");
+        return astype_internal<new_type>(std::integral_constant<bool, R == 0>());
+    }
+
+    const T* data() const
+    {
+        if (R == 0 && ! buf)
+        {
+            return scalar.data();
+        }
+        return buf->data();
+    }
+
+    T* data()
+    {
+        if (R == 0 && ! buf)
+        {
+            return scalar.data();
+        }
+        buf->prepare_write();
+        return buf->data();
+    }
+
+    /**
+     * Returns a non-owning view of the array's elements (see ndarray_view).
+     * The view is only valid while the array's memory is alive. Taking a
+     * view of a non-const array separates it from any copy-on-write copies,
+     * but writes made through the view are not seen by copy-on-write, so
+     * arrays should not be copied from const while views of them are in
+     * use for writing.
+     */
+    ndarray_view<T, R> view()
+    {
+        return {data() + offset_relative(constant_array<R>(0)), shape(), view_strides()};
+    }
+
+    ndarray_view<const T, R> view() const
+    {
+        return {data() + offset_relative(constant_array<R>(0)), shape(), view_strides()};
+    }
+
+    /**
+     * Visits the elements as runs along the last axis (see
+     * ndarray_view::for_each_run). As with view(), this separates a
+     * non-const array from its copy-on-write copies.
+     */
+    template<typename Function>
+    void for_each_run(Function function)
+    {
+        view().for_each_run(function);
+    }
+
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        view().for_each_run(function);
+    }
+
+    selector<R> get_selector() const
+    {
+        return sel;
+    }
+
+    bool is_const_ref() const
+    {
+        return false;
+    }
+
+
+
+
+    /**
+     * Operations
+     * 
+     */
+    // ========================================================================
+    template<typename U> struct OpEquals     { auto operator()(T a, U b) const { return a == b; } };
+    template<typename U> struct OpNotEquals  { auto operator()(T a, U b) const { return a != b; } };
+    template<typename U> struct OpGreaterEq  { auto operator()(T a, U b) const { return a >= b; } };
+    template<typename U> struct OpLessEq     { auto operator()(T a, U b) const { return a <= b; } };
+    template<typename U> struct OpGreater    { auto operator()(T a, U b) const { return a > b; } };
+    template<typename U> struct OpLess       { auto operator()(T a, U b) const { return a < b; } };
+    template<typename U> struct OpPlus       { auto operator()(T a, U b) const { return a + b; } };
+    template<typename U> struct OpMinus      { auto operator()(T a, U b) const { return a - b; } };
+    template<typename U> struct OpMultiplies { auto operator()(T a, U b) const { return a * b; } };
+    template<typename U> struct OpDivides    { auto operator()(T a, U b) const { return a / b; } };
+    struct OpIdentity { auto operator()(T a) const { return a; } };
+    struct OpNegate   { auto operator()(T a) const { return ! a; } };
+
+
+
+
+    /**
+     * Arithmetic operations
+     * 
+     */
+    // ========================================================================
+    template<typename U> auto& operator+=(U b) { for_each_element([b] (T& a) { a += b; }); return *this; }
+    template<typename U> auto& operator-=(U b) { for_each_element([b] (T& a) { a -= b; }); return *this; }
+    template<typename U> auto& operator*=(U b) { for_each_element([b] (T& a) { a *= b; }); return *this; }
+    template<typename U> auto& operator/=(U b) { for_each_element([b] (T& a) { a /= b; }); return *this; }
+    template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
+    template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
+
+    template<typename U> auto operator+(U b) const { auto A = copy(); A += b; return A; }
+    template<typename U> auto operator-(U b) const { auto A = copy(); A -= b; return A; }
+    template<typename U> auto operator*(U b) const { auto A = copy(); A *= b; return A; }
+    template<typename U> auto operator/(U b) const { auto A = copy(); A /= b; return A; }
+    template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
+    template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
+    template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
+    template<typename U> auto operator/(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); }
+
+
+
+
+    /**
+     * Comparison/equality methods and operators
+     * 
+     */
+    // ========================================================================
+    template<typename U> auto operator==(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, B); }
+    template<typename U> auto operator!=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, B); }
+    template<typename U> auto operator>=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, B); }
+    template<typename U> auto operator<=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, B); }
+    template<typename U> auto operator> (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, B); }
+    template<typename U> auto operator< (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, B); }
+
+    template<typename U> auto operator==(U b) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, b); }
+    template<typename U> auto operator!=(U b) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, b); }
+    template<typename U> auto operator>=(U b) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, b); }
+    template<typename U> auto operator<=(U b) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, b); }
+    template<typename U> auto operator> (U b) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, b); }
+    template<typename U> auto operator< (U b) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, b); }
+
+    auto operator!() const { return unary_op<T, R, OpNegate>::perform(*this); }
+    bool any() const { auto V = view(); return std::any_of(V.begin(), V.end(), [] (const T& x) { return bool(x); }); }
+    bool all() const { auto V = view(); return std::all_of(V.begin(), V.end(), [] (const T& x) { return bool(x); }); }
+
+    bool is(const ndarray<T, R>& other) const
+    {
+        return (scalar_offset == other.scalar_offset
+        && strides == other.strides
+        && sel == other.sel
+        && buf == other.buf
+        && (buf || this == &other));
+    }
+
+    template<int other_rank>
+    bool shares(const ndarray<T, other_rank>& other) const
+    {
+        return buf && other.buf && buf->root() == other.buf->root();
+    }
+
+
+
+
+    // ========================================================================
+    /**
+     * Dense arrays are walked with a flat pointer. Other arrays use
+     * ndarray_view's iterator, which seeks in O(R). Which path to take is
+     * decided when the iterator is constructed.
+     */
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+        using pointer = T*;
+        using reference = T&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        iterator() {}
+        iterator(ndarray<T, R>& array, std::size_t position)
+        {
+            auto view = ndarray_view<T, R>(array.buf->data() + array.offset_relative(constant_array<R>(0)), array.shape(), array.view_strides());
+
+            if ((dense = array.dense()))
+                flat = view.data() + position;
+            else
+                strided = {view, position};
+        }
+
+        iterator& operator++() { if (dense) ++flat; else ++strided; return *this; }
+        iterator& operator--() { if (dense) --flat; else --strided; return *this; }
+        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { if (dense) flat += n; else strided += n; return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return dense ? flat - other.flat : strided - other.strided; }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return dense ? flat == other.flat : strided == other.strided; }
+        bool operator!=(const iterator& other) const { return ! operator==(other); }
+        bool operator< (const iterator& other) const { return *this - other <  0; }
+        bool operator> (const iterator& other) const { return *this - other >  0; }
+        bool operator<=(const iterator& other) const { return *this - other <= 0; }
+        bool operator>=(const iterator& other) const { return *this - other >= 0; }
+        T& operator*() const { return dense ? *flat : *strided; }
+        T& operator[](difference_type n) const { return *(*this + n); }
+
+    private:
+        bool dense = false;
+        T* flat = nullptr;
+        typename ndarray_view<T, R>::iterator strided;
+    };
+
+    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); buf->prepare_write(); return {*this, 0}; }
+    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); buf->prepare_write(); return {*this, size()}; }
+
+
+
+
+    // ========================================================================
+    class const_iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+        using pointer = const T*;
+        using reference = const T&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        const_iterator() {}
+        const_iterator(const ndarray<T, R>& array, std::size_t position)
+        {
+            auto view = ndarray_view<const T, R>(array.buf->data() + array.offset_relative(constant_array<R>(0)), array.shape(), array.view_strides());
+
+            if ((dense = array.dense()))
+                flat = view.data() + position;
+            else
+                strided = {view, position};
+        }
+
+        const_iterator& operator++() { if (dense) ++flat; else ++strided; return *this; }
+        const_iterator& operator--() { if (dense) --flat; else --strided; return *this; }
+        const_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        const_iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        const_iterator& operator+=(difference_type n) { if (dense) flat += n; else strided += n; return *this; }
+        const_iterator& operator-=(difference_type n) { return *this += -n; }
+        const_iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        const_iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const const_iterator& other) const { return dense ? flat - other.flat : strided - other.strided; }
+        friend const_iterator operator+(difference_type n, const const_iterator& i) { return i + n; }
+        bool operator==(const const_iterator& other) const { return dense ? flat == other.flat : strided == other.strided; }
+        bool operator!=(const const_iterator& other) const { return ! operator==(other); }
+        bool operator< (const const_iterator& other) const { return *this - other <  0; }
+        bool operator> (const const_iterator& other) const { return *this - other >  0; }
+        bool operator<=(const const_iterator& other) const { return *this - other <= 0; }
+        bool operator>=(const const_iterator& other) const { return *this - other >= 0; }
+        const T& operator*() const { return dense ? *flat : *strided; }
+        const T& operator[](difference_type n) const { return *(*this + n); }
+
+    private:
+        bool dense = false;
+        const T* flat = nullptr;
+        typename ndarray_view<const T, R>::iterator strided;
+    };
+
+    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, 0}; }
+    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, size()}; }
+
+
+
+
+    /**
+     * Basic serialization operations
+     * 
+     */
+    // ========================================================================
+    std::string dumps() const
+    {
+        auto str = dumps_header(shape());
+        auto V = view();
+
+        if (V.contiguous())
+        {
+            str.append(reinterpret_cast<const char*>(V.data()), V.size() * sizeof(T));
+            return str;
+        }
+        for (const auto& x : V)
+        {
+            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
+        }
+        return str;
+    }
+
+    static ndarray<T, R> loads(const std::string& str)
+    {
+        ND_OPERATION("ndarray::loads");
+
+        auto S = loads_header(str);
+        auto it = str.begin() + header_size();
+
+        auto size = selector<R>(S).size();
+        auto wbuf = make_buffer<T>(size, uninitialized);
+
+        assert_valid_argument(std::size_t(str.end() - it) <= size * sizeof(T), "unexpected end of ndarray data string");
+        assert_valid_argument(std::size_t(str.end() - it) >= size * sizeof(T), "ndarray data string is too short");
+
+        if (size)
+        {
+            std::memcpy(wbuf->data(), &*it, size * sizeof(T));
+        }
+        return {S, wbuf};
+    }
+
+    /**
+     * The header written by dumps and expected by loads (and by memory-mapped
+     * files) has the following layout, and is followed by the array data:
+     */
+    static std::size_t header_size()
+    {
+        // dtype ... 8 char's
+        // rank  ... 1 int64
+        // shape ... rank int64's
+        // data  ... size T's
+
+        return sizeof(std::array<char, 8>) + sizeof(std::int64_t) + sizeof(std::array<std::int64_t, R>);
+    }
+
+    static std::string dumps_header(std::array<int, R> S)
+    {
+        auto D = dtype_str<T>::value();
+        auto Q = std::int64_t(rank);
+        auto E = std::array<std::int64_t, R>();
+        auto str = std::string();
+
+        std::copy(S.begin(), S.end(), E.begin());
+        str.insert(str.end(), (char*)&D, (char*)(&D + 1));
+        str.insert(str.end(), (char*)&Q, (char*)(&Q + 1));
+        str.insert(str.end(), (char*)&E, (char*)(&E + 1));
+        return str;
+    }
+
+    static std::array<int, R> loads_header(const std::string& str)
+    {
+        auto it = str.begin();
+        auto D = std::array<char, 8>();
+        auto Q = std::int64_t();
+        auto E = std::array<std::int64_t, R>();
+        auto S = constant_array<rank>(0);
+
+        assert_valid_argument(it + sizeof(D) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&D, &*it, sizeof(D));
+        it += sizeof(D);
+
+        assert_valid_argument(it + sizeof(Q) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&Q, &*it, sizeof(Q));
+        it += sizeof(Q);
+
+        assert_valid_argument(it + sizeof(E) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&E, &*it, sizeof(E));
+        it += sizeof(E);
+
+        assert_valid_argument(D == dtype_str<T>::value(), "ndarray string has wrong data type");
+        assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
+
+        for (int n = 0; n < rank; ++n)
+        {
+            assert_valid_argument(E[n] >= 0 && E[n] <= std::numeric_limits<int>::max(), "ndarray string has an invalid shape");
+            S[n] = int(E[n]);
+        }
+        return S;
+    }
+
+
+private:
+    /**
+     * Private utility methods
+     * 
+     */
+    // ========================================================================
+    std::ptrdiff_t offset_relative(std::array<int, R> index) const
+    {
+        std::ptrdiff_t m = scalar_offset;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m += (sel.start[n] + sel.skips[n] * index[n]) * strides[n];
+        }
+        return m;
+    }
+
+    std::ptrdiff_t offset_absolute(const std::array<std::ptrdiff_t, R>& index) const
+    {
+        std::ptrdiff_t m = scalar_offset;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            m += index[n] * strides[n];
+        }
+        return m;
+    }
+
+    template<typename new_type>
+    ndarray<new_type, R> astype_internal(std::true_type) const
+    {
+        return ndarray<new_type, R>(new_type(data()[scalar_offset]));
+    }
+
+    template<typename new_type>
+    ndarray<new_type, R> astype_internal(std::false_type) const
+    {
+        if (buf && contiguous() && buf->size() == size())
+        {
+            auto d = make_buffer<new_type>(buf->begin(), buf->end());
+            return {shape(), d};
+        }
+        auto A = ndarray<new_type, R>(shape(), uninitialized);
+        copy_internal(A, *this);
+        return A;
+    }
+
+    ndarray<T, R> compact_internal(double, std::true_type) const
+    {
+        return *this;
+    }
+
+    ndarray<T, R> compact_internal(double fraction, std::false_type) const
+    {
+        if (buf && double(size()) < fraction * double(buf->size()))
+        {
+            return copy();
+        }
+        auto A = ndarray<T, R>();
+        A.scalar_offset = scalar_offset;
+        A.sel = sel;
+        A.strides = strides;
+        A.buf = buf ? buffer<T>::snapshot(buf) : buf;
+        return A;
+    }
+
+    void copy_construct(const ndarray<T, R>& other, std::true_type)
+    {
+        *scalar.data() = other.data()[other.scalar_offset];
+    }
+
+    void copy_construct(const ndarray<T, R>& other, std::false_type)
+    {
+        if (other.contiguous())
+        {
+            scalar_offset = other.scalar_offset;
+            sel = other.sel;
+            strides = other.strides;
+            buf = buffer<T>::snapshot(other.buf);
+        }
+        else
+        {
+            sel = other.sel.shape();
+            strides = sel.strides();
+            buf = make_buffer<T>(size(), uninitialized);
+            copy_internal(*this, other);
+        }
+    }
+
+    /**
+     * Whether the elements occupy one contiguous run of memory in row-major
+     * order. Unlike contiguous(), this holds for leading-axis views like
+     * A[i] and A.take<0>(...), not only for arrays spanning their buffer.
+     */
+    bool dense() const
+    {
+        std::ptrdiff_t stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            if (sel.shape(n) != 1 && strides[n] * sel.skips[n] != stride)
+                return false;
+
+            stride *= sel.shape(n);
+        }
+        return true;
+    }
+
+    std::array<std::ptrdiff_t, R> view_strides() const
+    {
+        auto s = strides;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            s[n] *= sel.skips[n];
+        }
+        return s;
+    }
+
+    template<int length, typename Value>
+    static std::array<Value, length> constant_array(Value value)
+    {
+        std::array<Value, length> A;
+        for (auto& a : A) a = value;
+        return A;
+    }
+
+    static void assert_valid_argument(bool condition, const char* message)
+    {
+        if (! condition)
+        {
+            throw std::invalid_argument(message);
+        }
+    }
+
+    /**
+     * Applies a function to every element, as a flat loop over memory when
+     * the array is contiguous.
+     */
+    template<typename Function>
+    void for_each_element(Function function)
+    {
+        view().for_each_run([&function] (T* p, std::size_t n, std::ptrdiff_t s)
+        {
+            if (s == 1)
+                for (std::size_t i = 0; i < n; ++i) function(p[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) function(p[std::ptrdiff_t(i) * s]);
+        });
+    }
+
+    template<typename TT, int TR>
+    static void copy_internal(ndarray<TT, TR>& target, const ndarray<T, R>& source)
+    {
+        if (target.size() != source.size())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(source.shape())
+                + " to "
+                + shape::to_string(target.shape()));
+        }
+
+        auto a = target.view();
+        auto b = source.view();
+
+        if (a.contiguous() && b.contiguous())
+        {
+            auto pa = a.data();
+            auto pb = b.data();
+
+            for (std::size_t n = 0; n < a.size(); ++n)
+                pa[n] = pb[n];
+
+            return;
+        }
+        auto ib = source.begin();
+
+        for (auto ia = target.begin(); ia != target.end(); ++ia, ++ib)
+        {
+            *ia = *ib;
+        }
+    }
+
+    /**
+     * Copies between arrays of the same rank, converting the element type if
+     * it differs, run by run (see detail::for_each_run). Copies between ranks
+     * (reshapes) only need the sizes to agree, and go element by element
+     * unless both sides are contiguous.
+     */
+    template<typename TT>
+    static void copy_internal(ndarray<TT, R>& target, const ndarray<T, R>& source)
+    {
+        if (target.shape() != source.shape())
+        {
+            throw std::invalid_argument("incompatible assignment from "
+                + shape::to_string(source.shape())
+                + " to "
+                + shape::to_string(target.shape()));
+        }
+
+        detail::for_each_run([] (std::size_t n, auto a, auto b)
+        {
+            if (a.stride == 1 && b.stride == 1)
+                std::copy(b.data, b.data + n, a.data);
+            else
+                for (std::size_t i = 0; i < n; ++i) a[i] = b[i];
+        }, target.view(), source.view());
+    }
+
+
+
+    /**
+     * Data members
+     *
+     */
+    // ========================================================================
+    std::ptrdiff_t scalar_offset = 0;
+    detail::scalar_storage<T, R == 0> scalar;
+    selector<R> sel;
+    std::array<std::ptrdiff_t, R> strides;
+    buffer_ptr<T> buf;
+
+
+
+
+    /**
+     * Grant friendship to ndarray's of other ranks.
+     *
+     */
+    template<typename, int>
+    friend class ndarray;
+    friend class iterator;
+    friend class memory_report;
+};
+
+
+
+
+// ============================================================================
+class nd::memory_report
+{
+public:
+
+    /**
+     * Totals the memory kept alive by a set of arrays. Each buffer is counted
+     * once however many of the arrays share it; its addressable bytes are
+     * those of the arrays referring to it, up to the size of the buffer
+     * (overlapping selections may count the same elements twice). A large
+     * gap between the retained and addressable bytes means small views are
+     * pinning large buffers, and should be compacted.
+     */
+    template<typename T, int R>
+    memory_report& add(const ndarray<T, R>& array)
+    {
+        ++num_arrays;
+
+        if (array.buf)
+        {
+            auto& entry = entries[array.buf->root()];
+            entry.first = array.retained_bytes();
+            entry.second = std::min(entry.first, entry.second + array.addressable_bytes());
+        }
+        return *this;
+    }
+
+    template<typename Array>
+    memory_report& add(const Array& array)
+    {
+        return add(static_cast<const ndarray<typename Array::dtype, Array::rank>&>(array));
+    }
+
+    std::size_t arrays() const { return num_arrays; }
+    std::size_t buffers() const { return entries.size(); }
+
+    std::size_t retained_bytes() const
+    {
+        std::size_t total = 0;
+
+        for (const auto& entry : entries)
+            total += entry.second.first;
+
+        return total;
+    }
+
+    std::size_t addressable_bytes() const
+    {
+        std::size_t total = 0;
+
+        for (const auto& entry : entries)
+            total += entry.second.second;
+
+        return total;
+    }
+
+private:
+    std::size_t num_arrays = 0;
+    std::map<const void*, std::pair<std::size_t, std::size_t>> entries;
+};
+
+
+
+
+// ============================================================================
+template<typename... Arrays>
+nd::memory_report nd::retained_memory(const Arrays&... arrays)
+{
+    auto report = memory_report();
+    (void) std::initializer_list<int>{(report.add(arrays), 0)...};
+    return report;
+} 
+
+
+
+
+// ============================================================================
+#ifdef ND_HAVE_MMAP 
+/**
+ * Maps an existing file read-only. The returned array is a copy-on-write
+ * snapshot of the mapping, so writing to it (or to a copy of it) moves the
+ * data into memory rather than faulting on the read-only pages.
+ */
+template<typename T, int R>
+const nd::ndarray<T, R> nd::load_mapped(const std::string& filename)
+{
+    const auto mapping = detail::map_file<T, R>(filename, O_RDONLY, nullptr);
+    return ndarray<T, R>(mapping);
+}
+
+/**
+ * Maps an existing file read-write. Writes to the array (or to any of its
+ * views) are written through to the file.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::open_mapped(const std::string& filename)
+{
+    return detail::map_file<T, R>(filename, O_RDWR, nullptr);
+}
+
+/**
+ * Creates (or truncates) a file large enough to hold an array of the given
+ * shape, writes its header, and maps it read-write. Elements start at zero.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::create_mapped(const std::string& filename, std::array<int, R> shape)
+{
+    return detail::map_file<T, R>(filename, O_RDWR | O_CREAT | O_TRUNC, &shape);
+}
+
+/**
+ * Attaches to an existing shared-memory segment read-only. As with
+ * load_mapped, writing to the array moves its data into private memory.
+ */
+template<typename T, int R>
+const nd::ndarray<T, R> nd::load_shared(const std::string& name)
+{
+    const auto mapping = detail::map_shared<T, R>(name, O_RDONLY, nullptr);
+    return ndarray<T, R>(mapping);
+}
+
+/**
+ * Attaches to an existing shared-memory segment read-write. Writes are seen
+ * by every process mapping the segment.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::open_shared(const std::string& name)
+{
+    return detail::map_shared<T, R>(name, O_RDWR, nullptr);
+}
+
+/**
+ * Creates (or truncates) a shared-memory segment holding an array of the
+ * given shape, and maps it read-write. Elements start at zero.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::create_shared(const std::string& name, std::array<int, R> shape)
+{
+    return detail::map_shared<T, R>(name, O_RDWR | O_CREAT | O_TRUNC, &shape);
+}
+
+void nd::unlink_shared(const std::string& name)
+{
+    if (::shm_unlink(name.data()) == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "unlink_shared: could not unlink " + name);
+    }
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_file(const std::string& filename, int flags, const std::array<int, R>* shape)
+{
+    auto fd = ::open(filename.data(), flags, 0644);
+
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "map_file: could not open " + filename);
+    }
+    return map_descriptor<T, R>(fd, filename, flags, shape);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_shared(const std::string& name, int flags, const std::array<int, R>* shape)
+{
+    auto fd = ::shm_open(name.data(), flags, 0644);
+
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "map_shared: could not open " + name);
+    }
+    return map_descriptor<T, R>(fd, name, flags, shape);
+}
+
+/**
+ * Maps the file or segment open on fd, which this function closes, and
+ * wraps it as an array. If a shape is given, the file is first sized for it
+ * and the header is written into the mapping.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_descriptor(int fd, const std::string& name, int flags, const std::array<int, R>* shape)
+{
+    auto header_size = ndarray<T, R>::header_size();
+
+    auto fail = [fd, &name] (const char* what)
+    {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), what + name);
+    };
+
+    if (header_size % alignof(T) != 0)
+    {
+        ::close(fd);
+        throw std::invalid_argument("map_file: array data in " + name + " is not aligned for its dtype");
+    }
+
+    if (shape)
+    {
+        auto length = header_size + selector<R>(*shape).size() * sizeof(T);
+
+        if (::ftruncate(fd, length) == -1)
+            fail("map_file: could not size ");
+    }
+
+    struct stat info;
+
+    if (::fstat(fd, &info) == -1)
+        fail("map_file: could not stat ");
+
+    auto length = std::size_t(info.st_size);
+
+    if (length == 0)
+    {
+        ::close(fd);
+        throw std::invalid_argument("map_file: cannot map an empty file " + name);
+    }
+    auto prot = (flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    auto base = ::mmap(nullptr, length, prot, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED)
+        fail("map_file: could not map ");
+
+    ::close(fd);
+
+    auto unmap = [base, length] (T*) { ::munmap(base, length); };
+    auto bytes = static_cast<const char*>(base);
+
+    try {
+        if (shape)
+        {
+            auto header = ndarray<T, R>::dumps_header(*shape);
+            std::memcpy(base, header.data(), header.size());
+        }
+        auto S = ndarray<T, R>::loads_header(std::string(bytes, bytes + std::min(length, header_size)));
+
+        if (length != header_size + selector<R>(S).size() * sizeof(T))
+        {
+            throw std::invalid_argument("map_file: size of " + name + " does not match its header");
+        }
+        return adopt<T, R>((T*)(bytes + header_size), S, unmap);
+    }
+    catch (...)
+    {
+        unmap(nullptr);
+        throw;
+    }
+}
+#endif // ND_HAVE_MMAP ND_IMPL_END
+
+
+
+
+// ============================================================================
+std::pair<std::size_t, std::size_t> nd::static_partition(std::size_t size, std::size_t num_parts, std::size_t part) 
+{
+    auto block = size / num_parts;
+    auto extra = size % num_parts;
+    auto begin = part * block + std::min(part, extra);
+    return std::make_pair(begin, begin + block + (part < extra ? 1 : 0));
+}
+
+std::size_t nd::detail::page_size()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    return std::size_t(::sysconf(_SC_PAGESIZE));
+#else
+    return 4096;
+#endif
+}
+
+std::vector<int> nd::page_nodes(const void* data, std::size_t bytes)
+{
+    auto page = detail::page_size();
+    auto first = reinterpret_cast<std::uintptr_t>(data) / page * page;
+    auto last = reinterpret_cast<std::uintptr_t>(data) + bytes;
+    auto pages = std::vector<void*>();
+    auto nodes = std::vector<int>();
+
+    for (auto address = first; address < last; address += page)
+    {
+        pages.push_back(reinterpret_cast<void*>(address));
+    }
+    nodes.resize(pages.size());
+
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (! pages.empty() && ::syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, nodes.data(), 0) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "page_nodes: move_pages failed");
+    }
+    return nodes;
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "page_nodes: page placement cannot be queried");
+#endif
+}
+
+template<typename T, int R>
+std::vector<int> nd::page_nodes(const ndarray<T, R>& array)
+{
+    auto view = array.view();
+    auto span = std::ptrdiff_t(view.size() ? 1 : 0);
+
+    for (int n = 0; n < R && view.size(); ++n)
+    {
+        span += (view.shape()[n] - 1) * view.strides()[n];
+    }
+    return page_nodes(view.data(), span * sizeof(T));
+}
+
+
+
+
+// ============================================================================
+template<typename T, typename Allocator>
+struct nd::first_touch_allocator
+{
+    /**
+     * An allocator adaptor which, after obtaining memory from the underlying
+     * allocator, touches its pages from num_threads threads, each touching
+     * the block given by static_partition. Under the Linux first-touch
+     * policy, each page then lives on the NUMA node of the thread that will
+     * later process it. Allocations smaller than one page per thread are
+     * touched serially.
+     */
+
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = first_touch_allocator<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>; };
+
+    first_touch_allocator(unsigned num_threads = std::thread::hardware_concurrency(), Allocator allocator = Allocator())
+    : num_threads(std::max(num_threads, 1u))
+    , allocator(allocator)
+    {
+    }
+
+    template<typename U, typename OtherAllocator>
+    first_touch_allocator(const first_touch_allocator<U, OtherAllocator>& other)
+    : num_threads(other.num_threads)
+    , allocator(other.allocator)
+    {
+    }
+
+    T* allocate(std::size_t count)
+    {
+        auto ptr = allocator.allocate(count);
+        auto bytes = count * sizeof(T);
+        auto page = detail::page_size();
+        auto touch = [ptr, bytes, page, this] (std::size_t part)
+        {
+            auto range = static_partition(bytes, num_threads, part);
+            auto first = reinterpret_cast<std::uintptr_t>(ptr) + range.first;
+            auto last = reinterpret_cast<std::uintptr_t>(ptr) + range.second;
+
+            for (auto address = first; address < last; address = (address / page + 1) * page)
+            {
+                *reinterpret_cast<volatile char*>(address) = 0;
+            }
+        };
+
+        if (bytes < page * num_threads)
+        {
+            for (unsigned n = 0; n < num_threads; ++n)
+            {
+                touch(n);
+            }
+        }
+        else
+        {
+            auto threads = std::vector<std::thread>();
+
+            for (unsigned n = 0; n < num_threads; ++n)
+            {
+                threads.emplace_back(touch, n);
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+        return ptr;
+    }
+
+    void deallocate(T* ptr, std::size_t count)
+    {
+        allocator.deallocate(ptr, count);
+    }
+
+    unsigned num_threads;
+    Allocator allocator;
+}; 
+
+
+
+
+// ============================================================================
+void nd::advise(const void* data, std::size_t bytes, access_hint hint) 
+{
+    if (bytes == 0)
     {
-        auto d = std::make_shared<buffer<new_type>>(begin(), end());
-        return {shape(), d};
+        return;
     }
+#if defined(__unix__) || defined(__APPLE__)
+    auto page = detail::page_size();
+    auto first = reinterpret_cast<std::uintptr_t>(data) / page * page;
+    auto last = reinterpret_cast<std::uintptr_t>(data) + bytes;
+    auto flag = MADV_NORMAL;
 
-    const T* data() const
+    switch (hint)
     {
-        return buf->data();
+        case access_hint::normal:     flag = MADV_NORMAL; break;
+        case access_hint::sequential: flag = MADV_SEQUENTIAL; break;
+        case access_hint::random:     flag = MADV_RANDOM; break;
+        case access_hint::willneed:   flag = MADV_WILLNEED; break;
     }
-
-    T* data()
+    if (::madvise(reinterpret_cast<void*>(first), last - first, flag) != 0)
     {
-        return buf->data();
+        throw std::system_error(errno, std::generic_category(), "advise: madvise failed");
     }
+#else
+    (void) data;
+    (void) hint;
+#endif
+}
 
-    selector<R> get_selector() const
+template<typename T, int R>
+void nd::advise(ndarray_view<T, R> view, access_hint hint)
+{
+    if (view.size() == 0)
     {
-        return sel;
+        return;
     }
+    std::ptrdiff_t lower = 0;
+    std::ptrdiff_t upper = 0;
 
-    bool is_const_ref() const
+    for (int n = 0; n < R; ++n)
     {
-        return false;
+        auto extent = (view.shape(n) - 1) * view.strides()[n];
+        lower += std::min(extent, std::ptrdiff_t(0));
+        upper += std::max(extent, std::ptrdiff_t(0));
     }
+    advise(view.data() + lower, (upper - lower + 1) * sizeof(T), hint);
+}
+
+template<typename Array>
+auto nd::advise(const Array& array, access_hint hint) -> decltype(array.view(), void())
+{
+    advise(array.view(), hint);
+}
 
 
 
 
+// ============================================================================
+template<typename T>
+struct nd::huge_page_allocator
+{
     /**
-     * Operations
-     * 
+     * An allocator for very large arrays, which are accessed with strides
+     * spanning many pages and so miss the TLB on nearly every element. Blocks
+     * of at least threshold_bytes are aligned to ND_HUGE_PAGE_SIZE, and the
+     * kernel is asked to back them with transparent huge pages
+     * (madvise(MADV_HUGEPAGE) on Linux). The request is only a hint: it is
+     * ignored where THP is unavailable or disabled, and the memory is then
+     * ordinary. Smaller blocks are allocated like default_allocator.
      */
-    // ========================================================================
-    template<typename U> struct OpEquals     { auto operator()(T a, U b) const { return a == b; } };
-    template<typename U> struct OpNotEquals  { auto operator()(T a, U b) const { return a != b; } };
-    template<typename U> struct OpGreaterEq  { auto operator()(T a, U b) const { return a >= b; } };
-    template<typename U> struct OpLessEq     { auto operator()(T a, U b) const { return a <= b; } };
-    template<typename U> struct OpGreater    { auto operator()(T a, U b) const { return a > b; } };
-    template<typename U> struct OpLess       { auto operator()(T a, U b) const { return a < b; } };
-    template<typename U> struct OpPlus       { auto operator()(T a, U b) const { return a + b; } };
-    template<typename U> struct OpMinus      { auto operator()(T a, U b) const { return a - b; } };
-    template<typename U> struct OpMultiplies { auto operator()(T a, U b) const { return a * b; } };
-    template<typename U> struct OpDivides    { auto operator()(T a, U b) const { return a / b; } };
-    struct OpIdentity { auto operator()(T a) const { return a; } };
-    struct OpNegate   { auto operator()(T a) const { return ! a; } };
 
+    using value_type = T;
 
+    template<typename U>
+    struct rebind { using other = huge_page_allocator<U>; };
 
+    huge_page_allocator(std::size_t threshold_bytes = ND_HUGE_PAGE_SIZE) : threshold_bytes(threshold_bytes) {}
 
-    /**
-     * Arithmetic operations
-     * 
-     */
-    // ========================================================================
-    template<typename U> auto& operator+=(U b) { for (auto& a : *this) { a += b; } return *this; }
-    template<typename U> auto& operator-=(U b) { for (auto& a : *this) { a -= b; } return *this; }
-    template<typename U> auto& operator*=(U b) { for (auto& a : *this) { a *= b; } return *this; }
-    template<typename U> auto& operator/=(U b) { for (auto& a : *this) { a /= b; } return *this; }
-    template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
-    template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
+    template<typename U>
+    huge_page_allocator(const huge_page_allocator<U>& other) : threshold_bytes(other.threshold_bytes) {}
+
+    T* allocate(std::size_t count)
+    {
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        auto bytes = count * sizeof(T);
+
+        if (count == 0 || bytes < threshold_bytes)
+        {
+            return default_allocator<T>().allocate(count);
+        }
+        auto ptr = detail::aligned_malloc(bytes, ND_HUGE_PAGE_SIZE);
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        ::madvise(ptr, bytes / detail::page_size() * detail::page_size(), MADV_HUGEPAGE);
+#endif
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+        detail::aligned_free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const huge_page_allocator<U>& other) const { return threshold_bytes == other.threshold_bytes; }
+
+    template<typename U>
+    bool operator!=(const huge_page_allocator<U>& other) const { return threshold_bytes != other.threshold_bytes; }
+
+    std::size_t threshold_bytes;
+}; 
 
-    template<typename U> auto operator+(U b) const { auto A = copy(); for (auto& a : A) { a += b; } return A; }
-    template<typename U> auto operator-(U b) const { auto A = copy(); for (auto& a : A) { a -= b; } return A; }
-    template<typename U> auto operator*(U b) const { auto A = copy(); for (auto& a : A) { a *= b; } return A; }
-    template<typename U> auto operator/(U b) const { auto A = copy(); for (auto& a : A) { a /= b; } return A; }
-    template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
-    template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
-    template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
-    template<typename U> auto operator/(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); }
 
 
 
+// ============================================================================
+template<typename T, int R, typename Allocator> 
+class nd::growable_array
+{
+public:
 
     /**
-     * Comparison/equality methods and operators
-     * 
+     * An array that grows along its leading axis, for data arriving a row (or
+     * a block of rows) at a time. Its buffer reserves capacity for more rows
+     * than are filled, and the capacity doubles whenever it runs out, so
+     * appending is amortized O(1) per row.
+     *
+     * array() returns an ndarray sharing the filled rows. Such arrays stay
+     * valid when the growable array reallocates, since they keep the old
+     * buffer alive, but they are then detached from it: they do not see rows
+     * appended afterwards, and writes through them are not seen by the
+     * growable array. Reallocation increments generation(), and is_current
+     * says whether an array still shares the current buffer. Appending
+     * within the capacity never invalidates arrays already handed out.
      */
-    // ========================================================================
-    template<typename U> auto operator==(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, B); }
-    template<typename U> auto operator!=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, B); }
-    template<typename U> auto operator>=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, B); }
-    template<typename U> auto operator<=(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, B); }
-    template<typename U> auto operator> (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, B); }
-    template<typename U> auto operator< (const ndarray<U, R>& B) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, B); }
 
-    template<typename U> auto operator==(U b) const { return binary_op<T, U, R, OpEquals   <U>>::perform(*this, b); }
-    template<typename U> auto operator!=(U b) const { return binary_op<T, U, R, OpNotEquals<U>>::perform(*this, b); }
-    template<typename U> auto operator>=(U b) const { return binary_op<T, U, R, OpGreaterEq<U>>::perform(*this, b); }
-    template<typename U> auto operator<=(U b) const { return binary_op<T, U, R, OpLessEq   <U>>::perform(*this, b); }
-    template<typename U> auto operator> (U b) const { return binary_op<T, U, R, OpGreater  <U>>::perform(*this, b); }
-    template<typename U> auto operator< (U b) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, b); }
+    static_assert(R >= 1, "growable_array: rank must be at least 1");
 
-    auto operator!() const { return unary_op<T, R, OpNegate>::perform(*this); }
-    bool any() const { for (auto x : *this) if (x) return true; return false; }
-    bool all() const { for (auto x : *this) if (! x) return false; return true; }
+    using dtype = T;
+    enum { rank = R };
 
-    bool is(const ndarray<T, R>& other) const
+    growable_array(std::array<int, R - 1> row_shape = {}, std::size_t capacity = 0, Allocator allocator = Allocator())
+    : row_shape(row_shape)
+    , row_size(1)
+    , allocator(allocator)
     {
-        return (scalar_offset == other.scalar_offset
-        && strides == other.strides
-        && sel == other.sel
-        && buf == other.buf);
-    }
+        for (auto n : row_shape)
+        {
+            row_size *= n;
+        }
 
-    template<int other_rank>
-    bool shares(const ndarray<T, other_rank>& other) const
-    {
-        return buf == other.buf;
+        reallocate(capacity);
     }
 
 
 
 
     // ========================================================================
-    class iterator
+    std::size_t rows() const { return num_rows; }
+    std::size_t capacity() const { return capacity_rows; }
+    std::size_t size() const { return num_rows * row_size; }
+    std::size_t generation() const { return num_reallocations; }
+
+    std::array<int, R> shape() const
     {
-    public:
-        using difference_type = std::ptrdiff_t;
-        using value_type = T;
-        using pointer = T*;
-        using reference = T&;
-        using iterator_category = std::forward_iterator_tag;
+        auto s = std::array<int, R>();
+        s[0] = int(num_rows);
+        std::copy(row_shape.begin(), row_shape.end(), s.begin() + 1);
+        return s;
+    }
 
-        iterator() {}
-        iterator(ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+    /**
+     * Ensures there is room for at least the given number of rows.
+     */
+    void reserve(std::size_t rows)
+    {
+        if (rows > capacity_rows)
         {
+            reallocate(rows);
         }
+    }
 
-        iterator& operator++() { it.operator++(); return *this; }
-        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(iterator other) const { return mem != other.mem || it != other.it; }
-        T& operator*() { return mem[offset_absolute(*it)]; }
+    /**
+     * Returns an ndarray of the filled rows, sharing this array's memory.
+     */
+    ndarray<T, R> array()
+    {
+        auto dims = shape();
+        dims[0] = int(capacity_rows);
+        return ndarray<T, R>(dims, buf).template take<0>(axis::range(0, int(num_rows)));
+    }
 
-    private:
-        int offset_absolute(std::array<int, R> index) const
-        {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
-        }
-        T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
-    };
+    const ndarray<T, R> array() const
+    {
+        auto dims = shape();
+        dims[0] = int(capacity_rows);
+        auto shared = buffer_ptr<T>(buf);
+        return ndarray<T, R>(dims, shared).template take<0>(axis::range(0, int(num_rows)));
+    }
 
-    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+    template<int Rank>
+    bool is_current(const ndarray<T, Rank>& view) const
+    {
+        return array().shares(view);
+    }
 
 
 
 
     // ========================================================================
-    class const_iterator
+    template<int Rank = R, typename std::enable_if<Rank == 1>::type* = nullptr>
+    void append(const T& value)
     {
-    public:
-        using difference_type = std::ptrdiff_t;
-        using value_type = T;
-        using pointer = const T*;
-        using reference = const T&;
-        using iterator_category = std::forward_iterator_tag;
+        grow(1);
+        buf->data()[num_rows] = value;
+        num_rows += 1;
+    }
 
-        const_iterator() {}
-        const_iterator(const ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+    template<int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
+    void append(const ndarray<T, R - 1>& row)
+    {
+        if (row.shape() != row_shape)
         {
+            throw std::invalid_argument("growable_array::append: row shape does not match");
         }
+        grow(1);
+        std::copy(row.begin(), row.end(), buf->data() + num_rows * row_size);
+        num_rows += 1;
+    }
 
-        const_iterator& operator++() { it.operator++(); return *this; }
-        const_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(const_iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(const_iterator other) const { return mem != other.mem || it != other.it; }
-        const T& operator*() { return mem[offset_absolute(*it)]; }
-
-    private:
-        int offset_absolute(std::array<int, R> index) const
+    void extend(const ndarray<T, R>& block)
+    {
+        for (int n = 1; n < R; ++n)
         {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
+            if (block.shape(n) != row_shape[n - 1])
+            {
+                throw std::invalid_argument("growable_array::extend: block shape does not match");
+            }
         }
-        const T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
-    };
-
-    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
-
-
-
+        grow(block.shape(0));
+        std::copy(block.begin(), block.end(), buf->data() + num_rows * row_size);
+        num_rows += block.shape(0);
+    }
 
+private:
     /**
-     * Basic serialization operations
-     * 
+     * Makes room for count more rows, and separates the buffer from any
+     * copy-on-write snapshots taken of arrays sharing it.
      */
-    // ========================================================================
-    std::string dumps() const
+    void grow(std::size_t count)
     {
-        // dtype ... 8 char's
-        // rank  ... 1 int
-        // shape ... rank int's
-        // data  ... size T's
-
-        auto D = dtype_str<T>::value();
-        auto Q = int(rank);
-        auto S = shape();
-        auto str = std::string();
+        if (num_rows + count > capacity_rows)
+        {
+            reallocate(std::max(num_rows + count, 2 * capacity_rows));
+        }
+        buf->prepare_write();
+    }
 
-        str.insert(str.end(), (char*)&D, (char*)(&D + 1));
-        str.insert(str.end(), (char*)&Q, (char*)(&Q + 1));
-        str.insert(str.end(), (char*)&S, (char*)(&S + 1));
+    void reallocate(std::size_t capacity)
+    {
+        auto next = make_buffer<T>(capacity * row_size, uninitialized, allocator);
 
-        for (const auto& x : *this)
+        if (buf)
         {
-            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
+            std::copy(buf->begin(), buf->begin() + num_rows * row_size, next->begin());
+            num_reallocations += 1;
         }
-        return str;
+        buf = next;
+        capacity_rows = capacity;
     }
 
-    static ndarray<T, R> loads(const std::string& str)
-    {
-        auto it = str.begin();
-        auto D = std::array<char, 8>();
-        auto Q = int();
-        auto S = constant_array<rank>(0);
+    std::array<int, R - 1> row_shape;
+    std::size_t row_size;
+    std::size_t num_rows = 0;
+    std::size_t capacity_rows = 0;
+    std::size_t num_reallocations = 0;
+    Allocator allocator;
+    buffer_ptr<T> buf;
+}; 
 
-        assert_valid_argument(it + sizeof(D) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&D, &*it, sizeof(D));
-        it += sizeof(D);
 
-        assert_valid_argument(it + sizeof(Q) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&Q, &*it, sizeof(Q));
-        it += sizeof(Q);
 
-        assert_valid_argument(it + sizeof(S) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&S, &*it, sizeof(S));
-        it += sizeof(S);
 
-        assert_valid_argument(D == dtype_str<T>::value(), "ndarray string has wrong data type");
-        assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
+// ============================================================================
+template<typename T, int R> 
+class nd::array_group
+{
+public:
 
-        auto size = std::accumulate(S.begin(), S.end(), 1, std::multiplies<int>());
-        auto wbuf = std::make_shared<buffer<T>>(size);
-        auto dest = wbuf->begin();
+    /**
+     * A number of same-shape arrays (fields) packed into a single buffer.
+     * Fields are ordinary ndarray's sharing that buffer, so kernels written
+     * for separate arrays work unchanged, and the layout can be chosen for
+     * the access pattern: blocked fields stream as separate contiguous
+     * ranges, while interleaved fields keep everything a stencil needs at a
+     * cell within the same cache lines and pages.
+     */
 
-        while (it != str.end())
-        {
-            assert_valid_argument(dest != wbuf->end(), "unexpected end of ndarray data string");
-            std::memcpy(&*dest, &*it, sizeof(T));
-            ++dest;
-            it += sizeof(T);
-        }
+    static_assert(R > 0, "array_group: rank must be at least 1");
 
-        return {S, wbuf};
+    using dtype = T;
+    enum { rank = R };
+
+    template<typename Allocator = default_allocator<T>>
+    array_group(int num_fields, std::array<int, R> shape, group_layout layout = group_layout::blocked, Allocator allocator = Allocator())
+    : num_fields(num_fields)
+    , dims(shape)
+    , arrangement(layout)
+    , storage(storage_shape(num_fields, shape, layout), allocator)
+    {
     }
 
 
-private:
+
+
+    // ========================================================================
+    int size() const { return num_fields; }
+    std::array<int, R> shape() const { return dims; }
+    group_layout layout() const { return arrangement; }
+
     /**
-     * Private utility methods
-     * 
+     * Returns the given field, sharing the group's memory. Fields of a
+     * blocked group are contiguous; fields of an interleaved group have a
+     * stride of size() elements along the last axis.
      */
-    // ========================================================================
-    int offset_relative(std::array<int, R> index) const
+    ndarray<T, R> operator[](int field)
     {
-        int m = scalar_offset;
+        check_field(field);
 
-        for (int n = 0; n < rank; ++n)
+        if (arrangement == group_layout::blocked)
         {
-            m += (sel.start[n] + sel.skips[n] * index[n]) * strides[n];
+            return storage.template take<0>(axis::range(field * dims[0], (field + 1) * dims[0]));
         }
-        return m;
+        return storage.template take<R - 1>(axis::selection(field, dims[R - 1] * num_fields, num_fields));
     }
 
-    int offset_absolute(std::array<int, R> index) const
+    typename ndarray<T, R>::const_ref operator[](int field) const
     {
-        int m = scalar_offset;
+        check_field(field);
 
-        for (int n = 0; n < rank; ++n)
+        if (arrangement == group_layout::blocked)
         {
-            m += index[n] * strides[n];
+            return storage.template take<0>(axis::range(field * dims[0], (field + 1) * dims[0]));
         }
-        return m;
-    }
-
-    template<int length>
-    static std::array<int, length> constant_array(T value)
-    {
-        std::array<int, length> A;
-        for (auto& a : A) a = value;
-        return A;
+        return storage.template take<R - 1>(axis::selection(field, dims[R - 1] * num_fields, num_fields));
     }
 
-    static void assert_valid_argument(bool condition, const char* message)
+private:
+    static std::array<int, R> storage_shape(int num_fields, std::array<int, R> shape, group_layout layout)
     {
-        if (! condition)
+        if (num_fields < 0)
         {
-            throw std::invalid_argument(message);
+            throw std::invalid_argument("array_group: number of fields must be non-negative");
         }
-    }
-
-    template<typename TT, int TR>
-    static void copy_internal(ndarray<TT, TR>& target, const ndarray<T, R>& source)
-    {
-        if (target.size() != source.size())
+        if (layout == group_layout::blocked)
         {
-            throw std::invalid_argument("incompatible assignment from "
-                + shape::to_string(source.shape())
-                + " to "
-                + shape::to_string(target.shape()));
+            shape[0] *= num_fields;
         }
-
-        auto a = target.begin();
-        auto b = source.begin();
-
-        for (; a != target.end(); ++a, ++b)
+        else
         {
-            *a = *b;
+            shape[R - 1] *= num_fields;
         }
+        return shape;
     }
 
-    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+    void check_field(int field) const
     {
-        if (target.shape() != source.shape())
-        {
-            throw std::invalid_argument("incompatible assignment from "
-                + shape::to_string(source.shape())
-                + " to "
-                + shape::to_string(target.shape()));
-        }
-
-        auto a = target.begin();
-        auto b = source.begin();
-
-        for (; a != target.end(); ++a, ++b)
+        if (field < 0 || field >= num_fields)
         {
-            *a = *b;
+            throw std::out_of_range("array_group: field index out of range");
         }
     }
 
-
-
-    /**
-     * Data members
-     *
-     */
-    // ========================================================================
-    int scalar_offset = 0;
-    selector<R> sel;
-    std::array<int, R> strides;
-    std::shared_ptr<buffer<T>> buf;
-
-
-
-
-    /**
-     * Grant friendship to ndarray's of other ranks.
-     *
-     */
-    template<typename, int>
-    friend class ndarray;
-    friend class iterator;
+    int num_fields;
+    std::array<int, R> dims;
+    group_layout arrangement;
+    ndarray<T, R> storage;
 }; 
@@ -0,0 +1,369 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <system_error>
+#include "ndarray.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+/**
+ * Memory-mapped arrays are only available on POSIX systems. Files use the
+ * same layout as ndarray::dumps, so a file written with
+ *
+ * std::ofstream("A.bin") << A.dumps();
+ *
+ * can be mapped back with load_mapped<T, R>("A.bin"), and only the pages
+ * actually touched by selections or iteration are read from disk.
+ */
+#if defined(__unix__) || defined(__APPLE__)
+#define ND_HAVE_MMAP
+#endif
+
+/**
+ * Arrays may also live in named POSIX shared-memory segments (names look
+ * like "/my-array"), in the same layout, so that several processes can map
+ * one array without copying it. One process creates the segment with
+ * create_shared, and the others attach with load_shared (read-only) or
+ * open_shared. The segment persists until unlink_shared is called, and its
+ * memory is released once it is unlinked and no longer mapped anywhere.
+ */
+#ifdef ND_HAVE_MMAP
+    template<typename T, int R> const ndarray<T, R> static inline load_mapped(const std::string& filename);
+    template<typename T, int R> ndarray<T, R> static inline open_mapped(const std::string& filename);
+    template<typename T, int R> ndarray<T, R> static inline create_mapped(const std::string& filename, std::array<int, R> shape);
+
+    template<typename T, int R> const ndarray<T, R> static inline load_shared(const std::string& name);
+    template<typename T, int R> ndarray<T, R> static inline open_shared(const std::string& name);
+    template<typename T, int R> ndarray<T, R> static inline create_shared(const std::string& name, std::array<int, R> shape);
+    static inline void unlink_shared(const std::string& name);
+
+    namespace detail
+    {
+        template<typename T, int R>
+        static inline ndarray<T, R> map_file(const std::string& filename, int flags, const std::array<int, R>* shape);
+
+        template<typename T, int R>
+        static inline ndarray<T, R> map_shared(const std::string& name, int flags, const std::array<int, R>* shape);
+
+        template<typename T, int R>
+        static inline ndarray<T, R> map_descriptor(int fd, const std::string& name, int flags, const std::array<int, R>* shape);
+    }
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+#ifdef ND_HAVE_MMAP // ND_IMPL_START
+/**
+ * Maps an existing file read-only. The returned array is a copy-on-write
+ * snapshot of the mapping, so writing to it (or to a copy of it) moves the
+ * data into memory rather than faulting on the read-only pages.
+ */
+template<typename T, int R>
+const nd::ndarray<T, R> nd::load_mapped(const std::string& filename)
+{
+    const auto mapping = detail::map_file<T, R>(filename, O_RDONLY, nullptr);
+    return ndarray<T, R>(mapping);
+}
+
+/**
+ * Maps an existing file read-write. Writes to the array (or to any of its
+ * views) are written through to the file.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::open_mapped(const std::string& filename)
+{
+    return detail::map_file<T, R>(filename, O_RDWR, nullptr);
+}
+
+/**
+ * Creates (or truncates) a file large enough to hold an array of the given
+ * shape, writes its header, and maps it read-write. Elements start at zero.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::create_mapped(const std::string& filename, std::array<int, R> shape)
+{
+    return detail::map_file<T, R>(filename, O_RDWR | O_CREAT | O_TRUNC, &shape);
+}
+
+/**
+ * Attaches to an existing shared-memory segment read-only. As with
+ * load_mapped, writing to the array moves its data into private memory.
+ */
+template<typename T, int R>
+const nd::ndarray<T, R> nd::load_shared(const std::string& name)
+{
+    const auto mapping = detail::map_shared<T, R>(name, O_RDONLY, nullptr);
+    return ndarray<T, R>(mapping);
+}
+
+/**
+ * Attaches to an existing shared-memory segment read-write. Writes are seen
+ * by every process mapping the segment.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::open_shared(const std::string& name)
+{
+    return detail::map_shared<T, R>(name, O_RDWR, nullptr);
+}
+
+/**
+ * Creates (or truncates) a shared-memory segment holding an array of the
+ * given shape, and maps it read-write. Elements start at zero.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::create_shared(const std::string& name, std::array<int, R> shape)
+{
+    return detail::map_shared<T, R>(name, O_RDWR | O_CREAT | O_TRUNC, &shape);
+}
+
+void nd::unlink_shared(const std::string& name)
+{
+    if (::shm_unlink(name.data()) == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "unlink_shared: could not unlink " + name);
+    }
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_file(const std::string& filename, int flags, const std::array<int, R>* shape)
+{
+    auto fd = ::open(filename.data(), flags, 0644);
+
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "map_file: could not open " + filename);
+    }
+    return map_descriptor<T, R>(fd, filename, flags, shape);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_shared(const std::string& name, int flags, const std::array<int, R>* shape)
+{
+    auto fd = ::shm_open(name.data(), flags, 0644);
+
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "map_shared: could not open " + name);
+    }
+    return map_descriptor<T, R>(fd, name, flags, shape);
+}
+
+/**
+ * Maps the file or segment open on fd, which this function closes, and
+ * wraps it as an array. If a shape is given, the file is first sized for it
+ * and the header is written into the mapping.
+ */
+template<typename T, int R>
+nd::ndarray<T, R> nd::detail::map_descriptor(int fd, const std::string& name, int flags, const std::array<int, R>* shape)
+{
+    auto header_size = ndarray<T, R>::header_size();
+
+    auto fail = [fd, &name] (const char* what)
+    {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), what + name);
+    };
+
+    if (header_size % alignof(T) != 0)
+    {
+        ::close(fd);
+        throw std::invalid_argument("map_file: array data in " + name + " is not aligned for its dtype");
+    }
+
+    if (shape)
+    {
+        auto length = header_size + selector<R>(*shape).size() * sizeof(T);
+
+        if (::ftruncate(fd, length) == -1)
+            fail("map_file: could not size ");
+    }
+
+    struct stat info;
+
+    if (::fstat(fd, &info) == -1)
+        fail("map_file: could not stat ");
+
+    auto length = std::size_t(info.st_size);
+
+    if (length == 0)
+    {
+        ::close(fd);
+        throw std::invalid_argument("map_file: cannot map an empty file " + name);
+    }
+    auto prot = (flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    auto base = ::mmap(nullptr, length, prot, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED)
+        fail("map_file: could not map ");
+
+    ::close(fd);
+
+    auto unmap = [base, length] (T*) { ::munmap(base, length); };
+    auto bytes = static_cast<const char*>(base);
+
+    try {
+        if (shape)
+        {
+            auto header = ndarray<T, R>::dumps_header(*shape);
+            std::memcpy(base, header.data(), header.size());
+        }
+        auto S = ndarray<T, R>::loads_header(std::string(bytes, bytes + std::min(length, header_size)));
+
+        if (length != header_size + selector<R>(S).size() * sizeof(T))
+        {
+            throw std::invalid_argument("map_file: size of " + name + " does not match its header");
+        }
+        return adopt<T, R>((T*)(bytes + header_size), S, unmap);
+    }
+    catch (...)
+    {
+        unmap(nullptr);
+        throw;
+    }
+}
+#endif // ND_HAVE_MMAP ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_MAPPED
+#include <cerrno>
+#include <fstream>
+#include "catch.hpp"
+
+
+TEST_CASE("ndarray can be memory-mapped from a file", "[mapped]")
+{
+    auto _ = nd::axis::all();
+    auto filename = std::string("ndarray-test-mapped.bin");
+
+    SECTION("A file written by dumps can be mapped read-only")
+    {
+        std::ofstream(filename) << nd::arange<int>(24).reshape(4, 6).dumps();
+        const auto A = nd::load_mapped<int, 2>(filename);
+
+        REQUIRE(A.shape() == std::array<int, 2>{4, 6});
+        REQUIRE(A(3, 5) == 23);
+        REQUIRE(A.select(1, _|2|4)(1) == 9);
+        REQUIRE_THROWS_AS((nd::load_mapped<int, 1>(filename)), std::invalid_argument);
+        REQUIRE_THROWS_AS((nd::load_mapped<float, 2>(filename)), std::invalid_argument);
+    }
+
+    SECTION("Writing to a read-only mapping copies it into memory")
+    {
+        std::ofstream(filename) << nd::arange<int>(24).dumps();
+        auto A = nd::load_mapped<int, 1>(filename);
+        A(0) = 100;
+
+        REQUIRE(A(0) == 100);
+        REQUIRE(nd::load_mapped<int, 1>(filename)(0) == 0);
+    }
+
+    SECTION("Writes to a read-write mapping reach the file")
+    {
+        std::ofstream(filename) << nd::zeros<double>(8).dumps();
+        {
+            auto A = nd::open_mapped<double, 1>(filename);
+            A.select(_|4|8) = 2.0;
+        }
+        std::ifstream stream(filename);
+        auto B = nd::ndarray<double, 1>::loads(std::string(std::istreambuf_iterator<char>(stream), {}));
+
+        REQUIRE((B.select(_|0|4) == 0.0).all());
+        REQUIRE((B.select(_|4|8) == 2.0).all());
+    }
+
+    SECTION("A mapped file can be created from a shape")
+    {
+        {
+            auto A = nd::create_mapped<int, 3>(filename, {2, 3, 4});
+            A[1] = 7;
+        }
+        const auto B = nd::load_mapped<int, 3>(filename);
+
+        REQUIRE(B.shape() == std::array<int, 3>{2, 3, 4});
+        REQUIRE((B[0] == 0).all());
+        REQUIRE((B[1] == 7).all());
+    }
+
+    SECTION("Missing or truncated files are reported")
+    {
+        std::ofstream(filename) << nd::arange<int>(10).dumps().substr(0, 20);
+        REQUIRE_THROWS_AS((nd::load_mapped<int, 1>(filename)), std::invalid_argument);
+        REQUIRE_THROWS_AS((nd::load_mapped<int, 1>("no-such-file.bin")), std::system_error);
+    }
+
+    SECTION("Empty files are rejected as invalid")
+    {
+        std::ofstream(filename).close();
+        errno = ENOMEM;
+        REQUIRE_THROWS_AS((nd::load_mapped<int, 1>(filename)), std::invalid_argument);
+        REQUIRE_THROWS_AS((nd::open_mapped<int, 1>(filename)), std::invalid_argument);
+    }
+
+    std::remove(filename.data());
+}
+
+
+TEST_CASE("ndarray can be placed in POSIX shared memory", "[mapped] [shared]")
+{
+    auto name = std::string("/ndarray-test-shared");
+
+    SECTION("Processes attaching to a segment see the same data")
+    {
+        auto A = nd::create_shared<double, 2>(name, {10, 20});
+        const auto B = nd::load_shared<double, 2>(name);
+        auto C = nd::open_shared<double, 2>(name);
+
+        A[3] = 1.5;
+        C(9, 19) = 2.5;
+
+        REQUIRE(B.shape() == std::array<int, 2>{10, 20});
+        REQUIRE((B[3] == 1.5).all());
+        REQUIRE(B(9, 19) == 2.5);
+        REQUIRE(A(9, 19) == 2.5);
+        REQUIRE(B(0, 0) == 0.0);
+        REQUIRE_THROWS_AS((nd::load_shared<double, 3>(name)), std::invalid_argument);
+    }
+
+    SECTION("Read-only attachments copy on write")
+    {
+        auto A = nd::create_shared<int, 1>(name, {8});
+        auto B = nd::load_shared<int, 1>(name);
+        B(0) = 5;
+
+        REQUIRE(B(0) == 5);
+        REQUIRE(A(0) == 0);
+    }
+
+    SECTION("Segments persist until unlinked")
+    {
+        {
+            auto A = nd::create_shared<int, 1>(name, {4});
+            A = 3;
+        }
+        REQUIRE((nd::load_shared<int, 1>(name) == 3).all());
+    }
+
+    nd::unlink_shared(name);
+    REQUIRE_THROWS_AS((nd::load_shared<int, 1>(name)), std::system_error);
+    REQUIRE_THROWS_AS(nd::unlink_shared(name), std::system_error);
+}
+
+#endif // TEST_MAPPED
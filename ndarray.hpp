@@ -3,9 +3,16 @@
 #include <memory>
 #include <numeric>
 #include <cstring>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <initializer_list>
 #include "shape.hpp"
 #include "selector.hpp"
 #include "buffer.hpp"
+#include "view.hpp"
 
 
 
@@ -16,16 +23,35 @@ namespace nd // ND_API_START
     template<typename T, typename U, int R, typename Op> struct binary_op;
     template<typename T, int R, typename Op> struct unary_op;
     template<typename T, int R> class ndarray;
-    template<typename T> struct dtype_str;
+    class memory_report;
 
-    template<typename T> ndarray<T, 1> static inline arange(int size);
-    template<typename T> ndarray<T, 1> static inline linspace(T start, T end, int size);
-    template<typename T> ndarray<T, 1> static inline ones(int size);
-    template<typename T> ndarray<T, 1> static inline zeros(int size);
+    namespace detail
+    {
+        template<typename T, bool Inline> struct scalar_storage;
+    }
+
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline arange(int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline linspace(T start, T end, int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline ones(int size, Allocator allocator = Allocator());
+    template<typename T, typename Allocator = default_allocator<T>> ndarray<T, 1> static inline zeros(int size, Allocator allocator = Allocator());
+
+    template<typename T, typename... Dims> ndarray<T, sizeof...(Dims)> static inline empty(Dims... dims);
+
+    template<typename T, int R, typename Deleter> ndarray<T, R> static inline adopt(T* data, std::array<int, R> shape, Deleter deleter);
+    template<typename T, int R, typename Deleter> ndarray<T, R> static inline adopt(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides, Deleter deleter);
+    template<typename T, int R> ndarray<T, R> static inline borrow(T* data, std::array<int, R> shape);
+    template<typename T, int R> ndarray<T, R> static inline borrow(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides);
 
     template<typename T, int R>
     static inline nd::ndarray<T, R + 1> stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays);
 
+    /**
+     * Returns a memory_report for the given arrays (of any types and ranks),
+     * showing how much memory they keep alive compared with how much of it
+     * they can actually address.
+     */
+    template<typename... Arrays> static inline memory_report retained_memory(const Arrays&... arrays);
+
 /**
  * Unless you define the following macro, an alias nd::array will be created
  * for you, to make your declarations a little cleaner.
@@ -39,37 +65,107 @@ namespace nd // ND_API_START
 
 
 // ============================================================================
-template<typename T> nd::ndarray<T, 1> nd::arange(int size) // ND_IMPL_START
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::arange(int size, Allocator allocator) // ND_IMPL_START
 {
-    auto A = nd::ndarray<T, 1>(size);
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
     auto x = T();
     for (auto& a : A) a = x++;
     return A;
 }
 
-template<typename T> nd::ndarray<T, 1> nd::linspace(T start, T end, int size)
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::linspace(T start, T end, int size, Allocator allocator)
 {
-    auto A = nd::ndarray<T, 1>(size);
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
     auto h = (end - start) / (size - 1);
     auto x = start - h;
     for (auto& a : A) a = (x += h);
     return A;
 }
 
-template<typename T> nd::ndarray<T, 1> nd::ones(int size)
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::ones(int size, Allocator allocator)
 {
-    auto A = nd::ndarray<T, 1>(size);
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
     for (auto& a : A) a = 1;
     return A;
 }
 
-template<typename T> nd::ndarray<T, 1> nd::zeros(int size)
+template<typename T, typename Allocator> nd::ndarray<T, 1> nd::zeros(int size, Allocator allocator)
 {
-    auto A = nd::ndarray<T, 1>(size);
+    auto A = nd::ndarray<T, 1>(std::array<int, 1>{size}, allocator);
     for (auto& a : A) a = 0;
     return A;
 }
 
+template<typename T, typename... Dims> nd::ndarray<T, sizeof...(Dims)> nd::empty(Dims... dims)
+{
+    return nd::ndarray<T, sizeof...(Dims)>(std::array<int, sizeof...(Dims)>{int(dims)...}, uninitialized);
+}
+
+/**
+ * Wrap existing memory as an ndarray without copying it. adopt takes
+ * ownership, calling deleter(data) once the last array referring to the
+ * memory is gone; borrow never releases the memory, so the caller must keep
+ * it alive. Strides are given in elements (not bytes) and must be positive,
+ * each axis must fit inside the stride of the axis before it, and every
+ * stride other than the last two must divide the one before it.
+ */
+template<typename T, int R, typename Deleter>
+nd::ndarray<T, R> nd::adopt(T* data, std::array<int, R> shape, Deleter deleter)
+{
+    return adopt<T, R>(data, shape, selector<R>(shape).strides(), deleter);
+}
+
+template<typename T, int R, typename Deleter>
+nd::ndarray<T, R> nd::adopt(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides, Deleter deleter)
+{
+    static_assert(R > 0, "adopt: cannot wrap memory as a rank-0 array");
+
+    auto sel = selector<R>(shape);
+    auto extent = std::size_t(1);
+
+    for (int n = 0; n < R; ++n)
+    {
+        if (strides[n] <= 0)
+            throw std::invalid_argument("adopt: strides must be positive");
+
+        if (shape[n] == 0)
+            extent = 0;
+
+        if (extent)
+            extent += std::size_t(shape[n] - 1) * strides[n];
+    }
+
+    for (int n = R - 1; n > 0; --n)
+    {
+        if (std::size_t(shape[n] - 1) * strides[n] >= std::size_t(strides[n - 1]) && shape[n] > 0)
+            throw std::invalid_argument("adopt: strides describe overlapping axes");
+
+        if (n < R - 1 && strides[n - 1] % strides[n] != 0)
+            throw std::invalid_argument("adopt: strides are not representable by a selector");
+
+        sel.count[n] = n == R - 1 ? strides[n - 1] : strides[n - 1] / strides[n];
+    }
+
+    sel.count[0] = R == 1 ? std::ptrdiff_t(extent) : shape[0];
+    sel.skips[R - 1] = strides[R - 1];
+    sel.final[R - 1] = std::ptrdiff_t(shape[R - 1]) * strides[R - 1];
+
+    auto buf = make_buffer<T>(data, extent, deleter);
+    return ndarray<T, R>(sel, buf);
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::borrow(T* data, std::array<int, R> shape)
+{
+    return adopt<T, R>(data, shape, [] (T*) {});
+}
+
+template<typename T, int R>
+nd::ndarray<T, R> nd::borrow(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides)
+{
+    return adopt<T, R>(data, shape, strides, [] (T*) {});
+}
+
 template<typename T, int R> /* UNTESTED */
 nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arrays)
 {
@@ -87,7 +183,7 @@ nd::ndarray<T, R + 1> nd::stack(std::initializer_list<nd::ndarray<T, R - 1>> arr
     {
         dim_sizes[n] = required_shape[n - 1];
     }
-    auto A = nd::ndarray<T, R>(dim_sizes);
+    auto A = nd::ndarray<T, R>(dim_sizes, uninitialized);
     auto n = 0;
 
     for (const auto& array : arrays)
@@ -107,13 +203,18 @@ struct nd::unary_op
 {
     static auto perform(const ndarray<T, R>& A)
     {
+        ND_OPERATION("unary_op::perform");
+
         auto op = Op();
-        auto B = ndarray<decltype(op(T())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
+        auto B = ndarray<decltype(op(T())), R>(A.shape(), uninitialized);
 
-        for (; a != A.end(); ++a, ++b)
-            *b = op(*a);
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b)
+        {
+            if (a.stride == 1 && b.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) b.data[i] = op(a.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) b[i] = op(a[i]);
+        }, A.view(), B.view());
 
         return B;
     }
@@ -128,45 +229,59 @@ struct nd::binary_op
 {
     static auto perform(const ndarray<T, R>& A, const ndarray<U, R>& B)
     {
+        ND_OPERATION("binary_op::perform");
+
         if (A.shape() != B.shape())
             throw std::invalid_argument("incompatible shapes for binary operation");
 
         auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto b = B.begin();
-        auto c = C.begin();
+        auto C = ndarray<decltype(op(T(), U())), R>(A.shape(), uninitialized);
 
-        for (; a != A.end(); ++a, ++b, ++c)
-            *c = op(*a, *b);
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b, auto c)
+        {
+            if (a.stride == 1 && b.stride == 1 && c.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) c.data[i] = op(a.data[i], b.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) c[i] = op(a[i], b[i]);
+        }, A.view(), B.view(), C.view());
 
         return C;
     }
 
     static auto perform(const ndarray<T, R>& A, U b)
     {
+        ND_OPERATION("binary_op::perform");
+
         auto op = Op();
-        auto C = ndarray<decltype(op(T(), U())), R>(A.shape());
-        auto a = A.begin();
-        auto c = C.begin();
+        auto C = ndarray<decltype(op(T(), U())), R>(A.shape(), uninitialized);
 
-        for (; a != A.end(); ++a, ++c)
-            *c = op(*a, b);
+        detail::for_each_run([&op, b] (std::size_t n, auto a, auto c)
+        {
+            if (a.stride == 1 && c.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) c.data[i] = op(a.data[i], b);
+            else
+                for (std::size_t i = 0; i < n; ++i) c[i] = op(a[i], b);
+        }, A.view(), C.view());
 
         return C;
     }
 
     static void perform(ndarray<T, R>& A, const ndarray<U, R>& B)
     {
+        ND_OPERATION("binary_op::perform");
+
         if (A.shape() != B.shape())
             throw std::invalid_argument("incompatible shapes for binary operation");
 
         auto op = Op();
-        auto a = A.begin();
-        auto b = B.begin();
 
-        for (; a != A.end(); ++a, ++b)
-            *a = op(*a, *b);
+        detail::for_each_run([&op] (std::size_t n, auto a, auto b)
+        {
+            if (a.stride == 1 && b.stride == 1)
+                for (std::size_t i = 0; i < n; ++i) a.data[i] = op(a.data[i], b.data[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) a[i] = op(a[i], b[i]);
+        }, A.view(), B.view());
     }
 };
 
@@ -175,21 +290,25 @@ struct nd::binary_op
 
 // ============================================================================
 /**
- * This block can be expanded to accommodate new data types. Note: gcc requires
- * these template specializations to be declared directly inside the namespace.
+ * Rank-0 arrays which own their value (rather than viewing an element of
+ * another array) keep it inline, so creating, copying, and destroying them
+ * never touches the heap. Arrays of higher rank carry an empty member.
  */
 namespace nd {
-  template<> struct dtype_str<bool  > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<float > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<double> { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<int   > { static inline std::array<char, 8> value(); };
-  template<> struct dtype_str<long  > { static inline std::array<char, 8> value(); };
-
-  std::array<char, 8> dtype_str<bool  >::value() { return {'b','1',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<float >::value() { return {'f','4',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<double>::value() { return {'f','8',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<int   >::value() { return {'i','4',  0,  0,  0,  0,  0,  0}; }
-  std::array<char, 8> dtype_str<long  >::value() { return {'i','8',  0,  0,  0,  0,  0,  0}; }
+  namespace detail {
+    template<typename T> struct scalar_storage<T, true>
+    {
+        T* data() { return &value; }
+        const T* data() const { return &value; }
+        T value = T();
+    };
+
+    template<typename T> struct scalar_storage<T, false>
+    {
+        T* data() { return nullptr; }
+        const T* data() const { return nullptr; }
+    };
+  }
 }
 
 
@@ -220,7 +339,7 @@ public:
         using dtype = T;
         enum { rank = R };
 
-        const_ref(selector<R> sel, std::shared_ptr<buffer<T>> buf) : A(sel, buf) {}
+        const_ref(selector<R> sel, buffer_ptr<T> buf) : A(sel, buf) {}
         template<typename... Args> auto operator[](Args... args) const { return A.operator[](args...); }
         template<typename... Args> auto operator()(Args... args) const { return A.operator()(args...); }
         template<typename... Args> auto shape(const Args&... args) const { return A.shape(args...); }
@@ -228,12 +347,18 @@ public:
         template<typename... Args> auto shares(const Args&... args) const { return A.shares(args...); }
         template<int Axis, typename... Args> auto take(const Args&... args) const { return A.take<Axis>(args...); }
         template<int Axis, typename... Args> auto shift(const Args&... args) const { return A.shift<Axis>(args...); }
+        template<typename... Args> auto compact(const Args&... args) const { return A.compact(args...); }
+        auto detach() const { return A.detach(); }
+        auto retained_bytes() const { return A.retained_bytes(); }
+        auto addressable_bytes() const { return A.addressable_bytes(); }
 
         operator const ndarray<T, R>&() const { return A; }
         bool is_const_ref() const { return true; }
 
         auto begin() const { return A.begin(); }
         auto end() const { return A.end(); }
+        auto view() const { return A.view(); }
+        template<typename Function> void for_each_run(Function function) const { A.for_each_run(function); }
 
     private:
         friend class ndarray;
@@ -251,12 +376,12 @@ public:
     template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
     ndarray(T value=T())
     : scalar_offset(0)
-    , buf(std::make_shared<buffer<T>>(1, value))
     {
+        scalar.value = value;
     }
 
     template<int Rank = R, typename = typename std::enable_if<Rank == 0>::type>
-    ndarray(int scalar_offset, std::shared_ptr<buffer<T>>& buf)
+    ndarray(std::ptrdiff_t scalar_offset, buffer_ptr<T>& buf)
     : scalar_offset(scalar_offset)
     , buf(buf)
     {
@@ -264,9 +389,9 @@ public:
 
     template<int Rank = R, typename = typename std::enable_if<Rank == 1>::type>
     ndarray(std::initializer_list<T> elements)
-    : sel({elements.size()})
+    : sel(std::array<int, 1>{int(elements.size())})
     , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(elements.begin(), elements.end()))
+    , buf(make_buffer<T>(elements.begin(), elements.end()))
     {
     }
 
@@ -278,7 +403,7 @@ public:
     }
 
     template<typename SelectorType>
-    ndarray(SelectorType sel, std::shared_ptr<buffer<T>>& buf)
+    ndarray(SelectorType sel, buffer_ptr<T>& buf)
     : sel(sel)
     , strides(sel.strides())
     , buf(buf)
@@ -292,11 +417,27 @@ public:
     ndarray(std::array<int, R> dim_sizes)
     : sel(dim_sizes)
     , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(sel.size()))
+    , buf(R == 0 ? nullptr : make_buffer<T>(sel.size()))
     {
     }
 
-    ndarray(std::array<int, R> dim_sizes, std::shared_ptr<buffer<T>>& buf)
+    template<typename Allocator, typename = decltype(std::declval<Allocator&>().allocate(std::size_t()))>
+    ndarray(std::array<int, R> dim_sizes, Allocator allocator)
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(make_buffer<T>(sel.size(), T(), allocator))
+    {
+    }
+
+    template<typename Allocator = default_allocator<T>>
+    ndarray(std::array<int, R> dim_sizes, uninitialized_t, Allocator allocator = Allocator())
+    : sel(dim_sizes)
+    , strides(sel.strides())
+    , buf(make_buffer<T>(sel.size(), uninitialized, allocator))
+    {
+    }
+
+    ndarray(std::array<int, R> dim_sizes, buffer_ptr<T>& buf)
     : sel(dim_sizes)
     , strides(sel.strides())
     , buf(buf)
@@ -305,16 +446,28 @@ public:
             "Size of data buffer is not the product of dim sizes");
     }
 
+    /**
+     * Copies of const arrays share their memory copy-on-write when they cover
+     * the whole buffer: the data is only duplicated if either the copy or the
+     * original is later written to. Copies of partial views are compacted
+     * into a new buffer right away. Copies of rank-0 arrays hold their value
+     * inline.
+     */
     ndarray(const ndarray<T, R>& other)
-    : sel(other.sel.shape())
-    , strides(sel.strides())
-    , buf(std::make_shared<buffer<T>>(size()))
     {
-        copy_internal(*this, other);
+        ND_OPERATION("ndarray copy constructor (const)");
+
+        copy_construct(other, std::integral_constant<bool, R == 0>());
     }
 
+    /**
+     * Copies of non-const arrays share their memory, except for rank-0 arrays
+     * holding their value inline, which cannot be shared.
+     */
     ndarray(ndarray<T, R>& other)
     {
+        scalar_offset = other.scalar_offset;
+        scalar = other.scalar;
         strides = other.strides;
         sel = other.sel;
         buf = other.buf;
@@ -331,16 +484,14 @@ public:
     template <int Rank = R, typename std::enable_if<Rank == 0>::type* = nullptr>
     ndarray<T, R>& operator=(T value)
     {
-        buf->operator[](scalar_offset) = value;
+        data()[scalar_offset] = value;
         return *this;
     }
 
     template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
     ndarray<T, R>& operator=(T value)
     {
-        for (auto& a : *this)
-            a = value;
-
+        for_each_element([value] (T& a) { a = value; });
         return *this;
     }
 
@@ -352,6 +503,8 @@ public:
 
     void become(ndarray<T, R> other)
     {
+        scalar_offset = other.scalar_offset;
+        scalar = other.scalar;
         strides = other.strides;
         sel = other.sel;
         buf = other.buf;
@@ -360,9 +513,11 @@ public:
     template<typename... Sizes>
     auto reshape(Sizes... sizes)
     {
+        ND_OPERATION("ndarray::reshape");
+
         if (! contiguous())
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
+            auto A = ndarray<T, sizeof...(Sizes)>(std::array<int, sizeof...(Sizes)>{int(sizes)...}, uninitialized);
             copy_internal(A, *this);
             return A;
         }
@@ -372,13 +527,15 @@ public:
     template<typename... Sizes>
     const ndarray<T, sizeof...(Sizes)> reshape(Sizes... sizes) const
     {
+        ND_OPERATION("ndarray::reshape");
+
         if (! contiguous())
         {
-            auto A = ndarray<T, sizeof...(Sizes)>(sizes...);
+            auto A = ndarray<T, sizeof...(Sizes)>(std::array<int, sizeof...(Sizes)>{int(sizes)...}, uninitialized);
             copy_internal(A, *this);
             return A;
         }
-        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<std::shared_ptr<buffer<T>>&>(buf));
+        return ndarray<T, sizeof...(Sizes)>({sizes...}, const_cast<buffer_ptr<T>&>(buf));
     }
 
 
@@ -418,7 +575,7 @@ public:
         if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
             throw std::out_of_range("ndarray: index out of range");
 
-        return {offset_relative({index}), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        return {offset_relative({index}), const_cast<buffer_ptr<T>&>(buf)};
     }
 
     template <int Rank = R, typename std::enable_if<Rank != 1>::type* = nullptr>
@@ -436,7 +593,7 @@ public:
         if (index < 0 || index >= (sel.final[0] - sel.start[0]) / sel.skips[0])
             throw std::out_of_range("ndarray: index out of range");
 
-        return {sel.select(index), const_cast<std::shared_ptr<buffer<T>>&>(buf)};
+        return {sel.select(index), const_cast<buffer_ptr<T>&>(buf)};
     }
 
     template<typename... Index>
@@ -445,7 +602,7 @@ public:
         if (! sel.contains(index...))
             throw std::out_of_range("ndarray: index out of range");
 
-        return buf->operator[](offset_relative({int(index)...}));
+        return data()[offset_relative({int(index)...})];
     }
 
     template<typename... Index>
@@ -454,7 +611,7 @@ public:
         if (! sel.contains(index...))
             throw std::out_of_range("ndarray: selection out of range");
 
-        return buf->operator[](offset_relative({int(index)...}));
+        return data()[offset_relative({int(index)...})];
     }
 
     template<typename... Index>
@@ -509,32 +666,124 @@ public:
     operator T() const
     {
         // static_assert(rank == 0, "can only convert rank-0 array to scalar value");
-        return buf->operator[](scalar_offset);
+        return data()[scalar_offset];
     }
 
     ndarray<T, R> copy() const
     {
-        auto d = std::make_shared<buffer<T>>(begin(), end());
-        return {shape(), d};
+        ND_OPERATION("ndarray::copy");
+
+        if (buf && contiguous() && buf->size() == size())
+        {
+            auto d = make_buffer<T>(*buf);
+            return {shape(), d};
+        }
+        auto A = ndarray<T, R>(shape(), uninitialized);
+        copy_internal(A, *this);
+        return A;
+    }
+
+    /**
+     * Returns a copy of this array in a right-sized buffer if it addresses
+     * less than the given fraction of the buffer it keeps alive, and
+     * otherwise an array sharing its memory (copy-on-write, as for any copy
+     * of a const array). Small selections that outlive their parent, for
+     * example slices kept in a cache, should be compacted so that they do not
+     * pin the parent's memory. detach() copies unless the array addresses
+     * its entire buffer.
+     */
+    ndarray<T, R> compact(double fraction = 0.5) const
+    {
+        return compact_internal(fraction, std::integral_constant<bool, R == 0>());
     }
 
-    template<typename new_type>
+    ndarray<T, R> detach() const
+    {
+        return compact(1.0);
+    }
+
+    /**
+     * The bytes kept alive by this array (its whole buffer), and the bytes
+     * of it the array can address. Rank-0 arrays holding their value inline
+     * report zero for both.
+     */
+    std::size_t retained_bytes() const
+    {
+        return buf ? buf->size() * sizeof(T) : 0;
+    }
+
+    std::size_t addressable_bytes() const
+    {
+        return buf ? size() * sizeof(T) : 0;
+    }
+
+    template<typename new_type, typename std::enable_if<std::is_same<new_type, T>::value>::type* = nullptr>
+    ndarray<new_type, R> astype() const
+    {
+        return copy();
+    }
+
+    template<typename new_type, typename std::enable_if<! std::is_same<new_type, T>::value>::type* = nullptr>
     ndarray<new_type, R> astype() const
     {
-        auto d = std::make_shared<buffer<new_type>>(begin(), end());
-        return {shape(), d};
+        ND_OPERATION("ndarray::astype");
+        return astype_internal<new_type>(std::integral_constant<bool, R == 0>());
     }
 
     const T* data() const
     {
+        if (R == 0 && ! buf)
+        {
+            return scalar.data();
+        }
         return buf->data();
     }
 
     T* data()
     {
+        if (R == 0 && ! buf)
+        {
+            return scalar.data();
+        }
+        buf->prepare_write();
         return buf->data();
     }
 
+    /**
+     * Returns a non-owning view of the array's elements (see ndarray_view).
+     * The view is only valid while the array's memory is alive. Taking a
+     * view of a non-const array separates it from any copy-on-write copies,
+     * but writes made through the view are not seen by copy-on-write, so
+     * arrays should not be copied from const while views of them are in
+     * use for writing.
+     */
+    ndarray_view<T, R> view()
+    {
+        return {data() + offset_relative(constant_array<R>(0)), shape(), view_strides()};
+    }
+
+    ndarray_view<const T, R> view() const
+    {
+        return {data() + offset_relative(constant_array<R>(0)), shape(), view_strides()};
+    }
+
+    /**
+     * Visits the elements as runs along the last axis (see
+     * ndarray_view::for_each_run). As with view(), this separates a
+     * non-const array from its copy-on-write copies.
+     */
+    template<typename Function>
+    void for_each_run(Function function)
+    {
+        view().for_each_run(function);
+    }
+
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        view().for_each_run(function);
+    }
+
     selector<R> get_selector() const
     {
         return sel;
@@ -574,19 +823,19 @@ public:
      * 
      */
     // ========================================================================
-    template<typename U> auto& operator+=(U b) { for (auto& a : *this) { a += b; } return *this; }
-    template<typename U> auto& operator-=(U b) { for (auto& a : *this) { a -= b; } return *this; }
-    template<typename U> auto& operator*=(U b) { for (auto& a : *this) { a *= b; } return *this; }
-    template<typename U> auto& operator/=(U b) { for (auto& a : *this) { a /= b; } return *this; }
+    template<typename U> auto& operator+=(U b) { for_each_element([b] (T& a) { a += b; }); return *this; }
+    template<typename U> auto& operator-=(U b) { for_each_element([b] (T& a) { a -= b; }); return *this; }
+    template<typename U> auto& operator*=(U b) { for_each_element([b] (T& a) { a *= b; }); return *this; }
+    template<typename U> auto& operator/=(U b) { for_each_element([b] (T& a) { a /= b; }); return *this; }
     template<typename U> auto& operator+=(const ndarray<U, R>& B) { binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator-=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator*=(const ndarray<U, R>& B) { binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); return *this; }
     template<typename U> auto& operator/=(const ndarray<U, R>& B) { binary_op<T, U, R, OpDivides   <U>>::perform(*this, B); return *this; }
 
-    template<typename U> auto operator+(U b) const { auto A = copy(); for (auto& a : A) { a += b; } return A; }
-    template<typename U> auto operator-(U b) const { auto A = copy(); for (auto& a : A) { a -= b; } return A; }
-    template<typename U> auto operator*(U b) const { auto A = copy(); for (auto& a : A) { a *= b; } return A; }
-    template<typename U> auto operator/(U b) const { auto A = copy(); for (auto& a : A) { a /= b; } return A; }
+    template<typename U> auto operator+(U b) const { auto A = copy(); A += b; return A; }
+    template<typename U> auto operator-(U b) const { auto A = copy(); A -= b; return A; }
+    template<typename U> auto operator*(U b) const { auto A = copy(); A *= b; return A; }
+    template<typename U> auto operator/(U b) const { auto A = copy(); A /= b; return A; }
     template<typename U> auto operator+(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpPlus      <U>>::perform(*this, B); }
     template<typename U> auto operator-(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMinus     <U>>::perform(*this, B); }
     template<typename U> auto operator*(const ndarray<U, R>& B) const { return binary_op<T, U, R, OpMultiplies<U>>::perform(*this, B); }
@@ -615,27 +864,33 @@ public:
     template<typename U> auto operator< (U b) const { return binary_op<T, U, R, OpLess     <U>>::perform(*this, b); }
 
     auto operator!() const { return unary_op<T, R, OpNegate>::perform(*this); }
-    bool any() const { for (auto x : *this) if (x) return true; return false; }
-    bool all() const { for (auto x : *this) if (! x) return false; return true; }
+    bool any() const { auto V = view(); return std::any_of(V.begin(), V.end(), [] (const T& x) { return bool(x); }); }
+    bool all() const { auto V = view(); return std::all_of(V.begin(), V.end(), [] (const T& x) { return bool(x); }); }
 
     bool is(const ndarray<T, R>& other) const
     {
         return (scalar_offset == other.scalar_offset
         && strides == other.strides
         && sel == other.sel
-        && buf == other.buf);
+        && buf == other.buf
+        && (buf || this == &other));
     }
 
     template<int other_rank>
     bool shares(const ndarray<T, other_rank>& other) const
     {
-        return buf == other.buf;
+        return buf && other.buf && buf->root() == other.buf->root();
     }
 
 
 
 
     // ========================================================================
+    /**
+     * Dense arrays are walked with a flat pointer. Other arrays use
+     * ndarray_view's iterator, which seeks in O(R). Which path to take is
+     * decided when the iterator is constructed.
+     */
     class iterator
     {
     public:
@@ -643,36 +898,46 @@ public:
         using value_type = T;
         using pointer = T*;
         using reference = T&;
-        using iterator_category = std::forward_iterator_tag;
+        using iterator_category = std::random_access_iterator_tag;
 
         iterator() {}
-        iterator(ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+        iterator(ndarray<T, R>& array, std::size_t position)
         {
+            auto view = ndarray_view<T, R>(array.buf->data() + array.offset_relative(constant_array<R>(0)), array.shape(), array.view_strides());
+
+            if ((dense = array.dense()))
+                flat = view.data() + position;
+            else
+                strided = {view, position};
         }
 
-        iterator& operator++() { it.operator++(); return *this; }
+        iterator& operator++() { if (dense) ++flat; else ++strided; return *this; }
+        iterator& operator--() { if (dense) --flat; else --strided; return *this; }
         iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(iterator other) const { return mem != other.mem || it != other.it; }
-        T& operator*() { return mem[offset_absolute(*it)]; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { if (dense) flat += n; else strided += n; return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return dense ? flat - other.flat : strided - other.strided; }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return dense ? flat == other.flat : strided == other.strided; }
+        bool operator!=(const iterator& other) const { return ! operator==(other); }
+        bool operator< (const iterator& other) const { return *this - other <  0; }
+        bool operator> (const iterator& other) const { return *this - other >  0; }
+        bool operator<=(const iterator& other) const { return *this - other <= 0; }
+        bool operator>=(const iterator& other) const { return *this - other >= 0; }
+        T& operator*() const { return dense ? *flat : *strided; }
+        T& operator[](difference_type n) const { return *(*this + n); }
 
     private:
-        int offset_absolute(std::array<int, R> index) const
-        {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
-        }
-        T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
+        bool dense = false;
+        T* flat = nullptr;
+        typename ndarray_view<T, R>::iterator strided;
     };
 
-    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+    iterator begin() { static_assert(R > 0, "cannot iterate over scalar"); buf->prepare_write(); return {*this, 0}; }
+    iterator end()   { static_assert(R > 0, "cannot iterate over scalar"); buf->prepare_write(); return {*this, size()}; }
 
 
 
@@ -685,36 +950,46 @@ public:
         using value_type = T;
         using pointer = const T*;
         using reference = const T&;
-        using iterator_category = std::forward_iterator_tag;
+        using iterator_category = std::random_access_iterator_tag;
 
         const_iterator() {}
-        const_iterator(const ndarray<T, R>& array, typename selector<rank>::iterator it)
-        : mem(array.buf->data())
-        , strides(array.strides)
-        , it(it)
+        const_iterator(const ndarray<T, R>& array, std::size_t position)
         {
+            auto view = ndarray_view<const T, R>(array.buf->data() + array.offset_relative(constant_array<R>(0)), array.shape(), array.view_strides());
+
+            if ((dense = array.dense()))
+                flat = view.data() + position;
+            else
+                strided = {view, position};
         }
 
-        const_iterator& operator++() { it.operator++(); return *this; }
+        const_iterator& operator++() { if (dense) ++flat; else ++strided; return *this; }
+        const_iterator& operator--() { if (dense) --flat; else --strided; return *this; }
         const_iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(const_iterator other) const { return mem == other.mem && it == other.it; }
-        bool operator!=(const_iterator other) const { return mem != other.mem || it != other.it; }
-        const T& operator*() { return mem[offset_absolute(*it)]; }
+        const_iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        const_iterator& operator+=(difference_type n) { if (dense) flat += n; else strided += n; return *this; }
+        const_iterator& operator-=(difference_type n) { return *this += -n; }
+        const_iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        const_iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const const_iterator& other) const { return dense ? flat - other.flat : strided - other.strided; }
+        friend const_iterator operator+(difference_type n, const const_iterator& i) { return i + n; }
+        bool operator==(const const_iterator& other) const { return dense ? flat == other.flat : strided == other.strided; }
+        bool operator!=(const const_iterator& other) const { return ! operator==(other); }
+        bool operator< (const const_iterator& other) const { return *this - other <  0; }
+        bool operator> (const const_iterator& other) const { return *this - other >  0; }
+        bool operator<=(const const_iterator& other) const { return *this - other <= 0; }
+        bool operator>=(const const_iterator& other) const { return *this - other >= 0; }
+        const T& operator*() const { return dense ? *flat : *strided; }
+        const T& operator[](difference_type n) const { return *(*this + n); }
 
     private:
-        int offset_absolute(std::array<int, R> index) const
-        {
-            int m = 0;
-            for (int n = 0; n < rank; ++n) m += index[n] * strides[n];
-            return m;
-        }
-        const T* mem = nullptr;
-        std::array<int, R> strides = ndarray::constant_array<R>(0);
-        typename selector<rank>::iterator it;
+        bool dense = false;
+        const T* flat = nullptr;
+        typename ndarray_view<const T, R>::iterator strided;
     };
 
-    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.begin()}; }
-    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, sel.end()}; }
+    const_iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, 0}; }
+    const_iterator end()   const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, size()}; }
 
 
 
@@ -725,33 +1000,76 @@ public:
      */
     // ========================================================================
     std::string dumps() const
+    {
+        auto str = dumps_header(shape());
+        auto V = view();
+
+        if (V.contiguous())
+        {
+            str.append(reinterpret_cast<const char*>(V.data()), V.size() * sizeof(T));
+            return str;
+        }
+        for (const auto& x : V)
+        {
+            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
+        }
+        return str;
+    }
+
+    static ndarray<T, R> loads(const std::string& str)
+    {
+        ND_OPERATION("ndarray::loads");
+
+        auto S = loads_header(str);
+        auto it = str.begin() + header_size();
+
+        auto size = selector<R>(S).size();
+        auto wbuf = make_buffer<T>(size, uninitialized);
+
+        assert_valid_argument(std::size_t(str.end() - it) <= size * sizeof(T), "unexpected end of ndarray data string");
+        assert_valid_argument(std::size_t(str.end() - it) >= size * sizeof(T), "ndarray data string is too short");
+
+        if (size)
+        {
+            std::memcpy(wbuf->data(), &*it, size * sizeof(T));
+        }
+        return {S, wbuf};
+    }
+
+    /**
+     * The header written by dumps and expected by loads (and by memory-mapped
+     * files) has the following layout, and is followed by the array data:
+     */
+    static std::size_t header_size()
     {
         // dtype ... 8 char's
-        // rank  ... 1 int
-        // shape ... rank int's
+        // rank  ... 1 int64
+        // shape ... rank int64's
         // data  ... size T's
 
+        return sizeof(std::array<char, 8>) + sizeof(std::int64_t) + sizeof(std::array<std::int64_t, R>);
+    }
+
+    static std::string dumps_header(std::array<int, R> S)
+    {
         auto D = dtype_str<T>::value();
-        auto Q = int(rank);
-        auto S = shape();
+        auto Q = std::int64_t(rank);
+        auto E = std::array<std::int64_t, R>();
         auto str = std::string();
 
+        std::copy(S.begin(), S.end(), E.begin());
         str.insert(str.end(), (char*)&D, (char*)(&D + 1));
         str.insert(str.end(), (char*)&Q, (char*)(&Q + 1));
-        str.insert(str.end(), (char*)&S, (char*)(&S + 1));
-
-        for (const auto& x : *this)
-        {
-            str.insert(str.end(), (char*)&x, (char*)(&x + 1));
-        }
+        str.insert(str.end(), (char*)&E, (char*)(&E + 1));
         return str;
     }
 
-    static ndarray<T, R> loads(const std::string& str)
+    static std::array<int, R> loads_header(const std::string& str)
     {
         auto it = str.begin();
         auto D = std::array<char, 8>();
-        auto Q = int();
+        auto Q = std::int64_t();
+        auto E = std::array<std::int64_t, R>();
         auto S = constant_array<rank>(0);
 
         assert_valid_argument(it + sizeof(D) <= str.end(), "unexpected end of ndarray header string");
@@ -762,26 +1080,19 @@ public:
         std::memcpy(&Q, &*it, sizeof(Q));
         it += sizeof(Q);
 
-        assert_valid_argument(it + sizeof(S) <= str.end(), "unexpected end of ndarray header string");
-        std::memcpy(&S, &*it, sizeof(S));
-        it += sizeof(S);
+        assert_valid_argument(it + sizeof(E) <= str.end(), "unexpected end of ndarray header string");
+        std::memcpy(&E, &*it, sizeof(E));
+        it += sizeof(E);
 
         assert_valid_argument(D == dtype_str<T>::value(), "ndarray string has wrong data type");
         assert_valid_argument(Q == rank, "ndarray string has the wrong rank");
 
-        auto size = std::accumulate(S.begin(), S.end(), 1, std::multiplies<int>());
-        auto wbuf = std::make_shared<buffer<T>>(size);
-        auto dest = wbuf->begin();
-
-        while (it != str.end())
+        for (int n = 0; n < rank; ++n)
         {
-            assert_valid_argument(dest != wbuf->end(), "unexpected end of ndarray data string");
-            std::memcpy(&*dest, &*it, sizeof(T));
-            ++dest;
-            it += sizeof(T);
+            assert_valid_argument(E[n] >= 0 && E[n] <= std::numeric_limits<int>::max(), "ndarray string has an invalid shape");
+            S[n] = int(E[n]);
         }
-
-        return {S, wbuf};
+        return S;
     }
 
 
@@ -791,9 +1102,9 @@ private:
      * 
      */
     // ========================================================================
-    int offset_relative(std::array<int, R> index) const
+    std::ptrdiff_t offset_relative(std::array<int, R> index) const
     {
-        int m = scalar_offset;
+        std::ptrdiff_t m = scalar_offset;
 
         for (int n = 0; n < rank; ++n)
         {
@@ -802,9 +1113,9 @@ private:
         return m;
     }
 
-    int offset_absolute(std::array<int, R> index) const
+    std::ptrdiff_t offset_absolute(const std::array<std::ptrdiff_t, R>& index) const
     {
-        int m = scalar_offset;
+        std::ptrdiff_t m = scalar_offset;
 
         for (int n = 0; n < rank; ++n)
         {
@@ -813,10 +1124,101 @@ private:
         return m;
     }
 
-    template<int length>
-    static std::array<int, length> constant_array(T value)
+    template<typename new_type>
+    ndarray<new_type, R> astype_internal(std::true_type) const
+    {
+        return ndarray<new_type, R>(new_type(data()[scalar_offset]));
+    }
+
+    template<typename new_type>
+    ndarray<new_type, R> astype_internal(std::false_type) const
+    {
+        if (buf && contiguous() && buf->size() == size())
+        {
+            auto d = make_buffer<new_type>(buf->begin(), buf->end());
+            return {shape(), d};
+        }
+        auto A = ndarray<new_type, R>(shape(), uninitialized);
+        copy_internal(A, *this);
+        return A;
+    }
+
+    ndarray<T, R> compact_internal(double, std::true_type) const
+    {
+        return *this;
+    }
+
+    ndarray<T, R> compact_internal(double fraction, std::false_type) const
+    {
+        if (buf && double(size()) < fraction * double(buf->size()))
+        {
+            return copy();
+        }
+        auto A = ndarray<T, R>();
+        A.scalar_offset = scalar_offset;
+        A.sel = sel;
+        A.strides = strides;
+        A.buf = buf ? buffer<T>::snapshot(buf) : buf;
+        return A;
+    }
+
+    void copy_construct(const ndarray<T, R>& other, std::true_type)
+    {
+        *scalar.data() = other.data()[other.scalar_offset];
+    }
+
+    void copy_construct(const ndarray<T, R>& other, std::false_type)
+    {
+        if (other.contiguous())
+        {
+            scalar_offset = other.scalar_offset;
+            sel = other.sel;
+            strides = other.strides;
+            buf = buffer<T>::snapshot(other.buf);
+        }
+        else
+        {
+            sel = other.sel.shape();
+            strides = sel.strides();
+            buf = make_buffer<T>(size(), uninitialized);
+            copy_internal(*this, other);
+        }
+    }
+
+    /**
+     * Whether the elements occupy one contiguous run of memory in row-major
+     * order. Unlike contiguous(), this holds for leading-axis views like
+     * A[i] and A.take<0>(...), not only for arrays spanning their buffer.
+     */
+    bool dense() const
+    {
+        std::ptrdiff_t stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            if (sel.shape(n) != 1 && strides[n] * sel.skips[n] != stride)
+                return false;
+
+            stride *= sel.shape(n);
+        }
+        return true;
+    }
+
+    std::array<std::ptrdiff_t, R> view_strides() const
     {
-        std::array<int, length> A;
+        auto s = strides;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            s[n] *= sel.skips[n];
+        }
+        return s;
+    }
+
+    template<int length, typename Value>
+    static std::array<Value, length> constant_array(Value value)
+    {
+        std::array<Value, length> A;
         for (auto& a : A) a = value;
         return A;
     }
@@ -829,6 +1231,22 @@ private:
         }
     }
 
+    /**
+     * Applies a function to every element, as a flat loop over memory when
+     * the array is contiguous.
+     */
+    template<typename Function>
+    void for_each_element(Function function)
+    {
+        view().for_each_run([&function] (T* p, std::size_t n, std::ptrdiff_t s)
+        {
+            if (s == 1)
+                for (std::size_t i = 0; i < n; ++i) function(p[i]);
+            else
+                for (std::size_t i = 0; i < n; ++i) function(p[std::ptrdiff_t(i) * s]);
+        });
+    }
+
     template<typename TT, int TR>
     static void copy_internal(ndarray<TT, TR>& target, const ndarray<T, R>& source)
     {
@@ -840,16 +1258,35 @@ private:
                 + shape::to_string(target.shape()));
         }
 
-        auto a = target.begin();
-        auto b = source.begin();
+        auto a = target.view();
+        auto b = source.view();
+
+        if (a.contiguous() && b.contiguous())
+        {
+            auto pa = a.data();
+            auto pb = b.data();
+
+            for (std::size_t n = 0; n < a.size(); ++n)
+                pa[n] = pb[n];
+
+            return;
+        }
+        auto ib = source.begin();
 
-        for (; a != target.end(); ++a, ++b)
+        for (auto ia = target.begin(); ia != target.end(); ++ia, ++ib)
         {
-            *a = *b;
+            *ia = *ib;
         }
     }
 
-    static void copy_internal(ndarray<T, R>& target, const ndarray<T, R>& source)
+    /**
+     * Copies between arrays of the same rank, converting the element type if
+     * it differs, run by run (see detail::for_each_run). Copies between ranks
+     * (reshapes) only need the sizes to agree, and go element by element
+     * unless both sides are contiguous.
+     */
+    template<typename TT>
+    static void copy_internal(ndarray<TT, R>& target, const ndarray<T, R>& source)
     {
         if (target.shape() != source.shape())
         {
@@ -859,13 +1296,13 @@ private:
                 + shape::to_string(target.shape()));
         }
 
-        auto a = target.begin();
-        auto b = source.begin();
-
-        for (; a != target.end(); ++a, ++b)
+        detail::for_each_run([] (std::size_t n, auto a, auto b)
         {
-            *a = *b;
-        }
+            if (a.stride == 1 && b.stride == 1)
+                std::copy(b.data, b.data + n, a.data);
+            else
+                for (std::size_t i = 0; i < n; ++i) a[i] = b[i];
+        }, target.view(), source.view());
     }
 
 
@@ -875,10 +1312,11 @@ private:
      *
      */
     // ========================================================================
-    int scalar_offset = 0;
+    std::ptrdiff_t scalar_offset = 0;
+    detail::scalar_storage<T, R == 0> scalar;
     selector<R> sel;
-    std::array<int, R> strides;
-    std::shared_ptr<buffer<T>> buf;
+    std::array<std::ptrdiff_t, R> strides;
+    buffer_ptr<T> buf;
 
 
 
@@ -890,13 +1328,94 @@ private:
     template<typename, int>
     friend class ndarray;
     friend class iterator;
-}; // ND_IMPL_END
+    friend class memory_report;
+};
+
+
+
+
+// ============================================================================
+class nd::memory_report
+{
+public:
+
+    /**
+     * Totals the memory kept alive by a set of arrays. Each buffer is counted
+     * once however many of the arrays share it; its addressable bytes are
+     * those of the arrays referring to it, up to the size of the buffer
+     * (overlapping selections may count the same elements twice). A large
+     * gap between the retained and addressable bytes means small views are
+     * pinning large buffers, and should be compacted.
+     */
+    template<typename T, int R>
+    memory_report& add(const ndarray<T, R>& array)
+    {
+        ++num_arrays;
+
+        if (array.buf)
+        {
+            auto& entry = entries[array.buf->root()];
+            entry.first = array.retained_bytes();
+            entry.second = std::min(entry.first, entry.second + array.addressable_bytes());
+        }
+        return *this;
+    }
+
+    template<typename Array>
+    memory_report& add(const Array& array)
+    {
+        return add(static_cast<const ndarray<typename Array::dtype, Array::rank>&>(array));
+    }
+
+    std::size_t arrays() const { return num_arrays; }
+    std::size_t buffers() const { return entries.size(); }
+
+    std::size_t retained_bytes() const
+    {
+        std::size_t total = 0;
+
+        for (const auto& entry : entries)
+            total += entry.second.first;
+
+        return total;
+    }
+
+    std::size_t addressable_bytes() const
+    {
+        std::size_t total = 0;
+
+        for (const auto& entry : entries)
+            total += entry.second.second;
+
+        return total;
+    }
+
+private:
+    std::size_t num_arrays = 0;
+    std::map<const void*, std::pair<std::size_t, std::size_t>> entries;
+};
+
+
+
+
+// ============================================================================
+template<typename... Arrays>
+nd::memory_report nd::retained_memory(const Arrays&... arrays)
+{
+    auto report = memory_report();
+    (void) std::initializer_list<int>{(report.add(arrays), 0)...};
+    return report;
+} // ND_IMPL_END
 
 
 
 
 // ============================================================================
 #ifdef TEST_NDARRAY
+#if __cplusplus >= 201703L && __has_include(<execution>)
+#include <execution>
+#endif
+#include <thread>
 #include "catch.hpp"
 using T = double;
 
@@ -913,8 +1432,8 @@ TEST_CASE("ndarray can be constructed", "[ndarray]")
 
     SECTION("ndarray constructor throws if the data buffer has the wrong size")
     {
-        auto data_good = std::make_shared<buffer<T>>(1);
-        auto data_bad  = std::make_shared<buffer<T>>(2);
+        auto data_good = make_buffer<T>(1);
+        auto data_bad  = make_buffer<T>(2);
         REQUIRE_NOTHROW(ndarray<T, 1>({1}, data_good));
         REQUIRE_THROWS_AS((ndarray<T, 1>({1}, data_bad)), std::invalid_argument);
     }
@@ -923,6 +1442,22 @@ TEST_CASE("ndarray can be constructed", "[ndarray]")
 
 TEST_CASE("ndarray can be created from basic factories", "[ndarray] [factories]")
 {
+    SECTION("factories accept an allocator")
+    {
+        auto A = nd::zeros<double>(10, std::allocator<double>());
+        auto B = nd::arange<int>(10, nd::aligned_allocator<int, 256>());
+
+        REQUIRE(A.size() == 10);
+        REQUIRE(B(9) == 9);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(B.data()) % 256 == 0);
+    }
+
+    SECTION("default-constructed arrays have aligned data")
+    {
+        auto A = nd::ndarray<double, 3>(3, 5, 7);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(A.data()) % ND_DEFAULT_ALIGNMENT == 0);
+    }
+
     SECTION("arange works correctly")
     {
         auto A = nd::arange<double>(10);
@@ -937,6 +1472,15 @@ TEST_CASE("ndarray can be created from basic factories", "[ndarray] [factories]"
         }
     }
 
+    SECTION("empty works correctly")
+    {
+        auto A = nd::empty<double>(10, 20, 30);
+
+        REQUIRE(A.shape() == std::array<int, 3>{10, 20, 30});
+        REQUIRE(A.size() == 10 * 20 * 30);
+        REQUIRE(A.contiguous());
+    }
+
     SECTION("ones works correctly")
     {
         auto A = nd::ones<double>(10);
@@ -967,7 +1511,428 @@ TEST_CASE("ndarray can be copied and casted", "[ndarray]")
     REQUIRE_FALSE(C.shares(B));
     REQUIRE(D.shares(A));
     REQUIRE(E.shares(A));
+    REQUIRE(F.shares(A));
+
+    F(0) = 10.0;
+
     REQUIRE_FALSE(F.shares(A));
+    REQUIRE(A(0) == 0.0);
+    REQUIRE(F(0) == 10.0);
+    REQUIRE(F(9) == 9.0);
+
+    auto _ = nd::axis::all();
+    auto G = nd::arange<double>(60).reshape(3, 4, 5).select(_, _|1|3, _|0|5|2).astype<int>();
+
+    REQUIRE(G.shape() == std::array<int, 3>{3, 2, 3});
+    REQUIRE(G(0, 0, 1) == 7);
+    REQUIRE(G(2, 1, 2) == 54);
+}
+
+
+TEST_CASE("copies of const arrays are copy-on-write", "[ndarray] [cow]")
+{
+    auto _ = nd::axis::all();
+
+    SECTION("Writing to the original leaves the copy unchanged")
+    {
+        auto A = nd::arange<double>(10);
+        const auto& Aref = A;
+        auto B = Aref;
+
+        REQUIRE(B.shares(A));
+        A = 5.0;
+        REQUIRE_FALSE(B.shares(A));
+        REQUIRE(B(1) == 1.0);
+        REQUIRE((A == 5.0).all());
+    }
+
+    SECTION("Views of a copy share its memory after the copy is written")
+    {
+        const auto A = nd::arange<double>(10);
+        auto B = A;
+        auto C = B.select(_|2|4);
+
+        C = -1.0;
+
+        REQUIRE(B.shares(C));
+        REQUIRE_FALSE(B.shares(A));
+        REQUIRE(B(2) == -1.0);
+        REQUIRE(A(2) == 2.0);
+    }
+
+    SECTION("Copies of partial views are compacted immediately")
+    {
+        const auto A = nd::arange<double>(10);
+        const auto B = A.take<0>(_|2|4);
+        auto C = static_cast<const nd::ndarray<double, 1>&>(B);
+
+        REQUIRE(C.size() == 2);
+        REQUIRE(C.contiguous());
+        REQUIRE_FALSE(C.shares(A));
+    }
+
+    SECTION("Writing to the original makes one copy, shared by all its copies")
+    {
+        auto A = nd::arange<double>(10);
+        const auto& Aref = A;
+        auto B = Aref;
+        auto C = Aref;
+
+        A = 5.0;
+
+        REQUIRE(B.shares(C));
+        REQUIRE_FALSE(B.shares(A));
+        REQUIRE(B(1) == 1.0);
+        REQUIRE(C(1) == 1.0);
+    }
+
+    SECTION("Copies of a const array can be taken and written on several threads")
+    {
+        const auto A = nd::arange<double>(1000);
+        auto threads = std::vector<std::thread>();
+        auto sums = std::vector<double>(4);
+
+        for (std::size_t n = 0; n < sums.size(); ++n)
+        {
+            threads.emplace_back([&A, &sums, n] ()
+            {
+                for (int repeat = 0; repeat < 100; ++repeat)
+                {
+                    auto B = A;
+                    B(0) = double(n);
+                    sums[n] = std::accumulate(B.begin(), B.end(), 0.0);
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        for (std::size_t n = 0; n < sums.size(); ++n)
+        {
+            REQUIRE(sums[n] == 499500.0 + n);
+        }
+        REQUIRE(A(0) == 0.0);
+    }
+}
+
+
+TEST_CASE("small views can be compacted off their parent buffer", "[ndarray] [compact]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::ndarray<double, 2>(100, 10);
+    auto B = A[3];
+    auto C = A.take<0>(_|0|80);
+    auto D = A.select(_, _|0|10|2);
+    auto x = A[5][5];
+    A(3, 4) = 7.0;
+
+    SECTION("Views report the memory they retain and address")
+    {
+        REQUIRE(B.retained_bytes() == 8000);
+        REQUIRE(B.addressable_bytes() == 80);
+        REQUIRE(nd::ndarray<double, 0>(1.0).retained_bytes() == 0);
+    }
+
+    SECTION("compact copies only views addressing a small fraction of their buffer")
+    {
+        auto B1 = B.compact();
+        auto C1 = C.compact();
+        auto D1 = D.compact(0.6);
+
+        REQUIRE_FALSE(B1.shares(A));
+        REQUIRE(B1.retained_bytes() == 80);
+        REQUIRE(B1(4) == 7.0);
+        REQUIRE(C1.shares(A));
+        REQUIRE_FALSE(D1.shares(A));
+        REQUIRE(D1.shape() == std::array<int, 2>{100, 5});
+        REQUIRE(C.detach().retained_bytes() == 6400);
+        REQUIRE_FALSE(C.detach().shares(A));
+        REQUIRE(x.compact().retained_bytes() == 0);
+    }
+
+    SECTION("Compacted copies are copy-on-write when they span their buffer")
+    {
+        auto E = A.detach();
+        REQUIRE(E.shares(A));
+        E(0, 0) = 1.0;
+        REQUIRE_FALSE(E.shares(A));
+        REQUIRE(A(0, 0) == 0.0);
+    }
+
+    SECTION("retained_memory counts each buffer once")
+    {
+        const auto& Aref = A;
+        auto F = nd::arange<int>(10);
+        auto report = nd::retained_memory(B, C, Aref.select(0, _), F, x);
+
+        REQUIRE(report.arrays() == 5);
+        REQUIRE(report.buffers() == 2);
+        REQUIRE(report.retained_bytes() == 8040);
+        REQUIRE(report.addressable_bytes() == 80 + 6400 + 80 + 8 + 40);
+        REQUIRE(nd::retained_memory(B.compact(), C).retained_bytes() == 8080);
+    }
+}
+
+
+TEST_CASE("contiguous arrays and views take the flat fast paths", "[ndarray] [contiguous]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(60).reshape(3, 4, 5);
+    const auto& C = A;
+
+    SECTION("Leading-axis views iterate over the right elements")
+    {
+        auto B = A.take<0>(_|1|3);
+        auto D = A[2];
+        auto E = A.select(1, _|1|3, _);
+
+        REQUIRE(std::vector<int>(B.begin(), B.end()).front() == 20);
+        REQUIRE(std::vector<int>(B.begin(), B.end()).back() == 59);
+        REQUIRE(std::vector<int>(C[2].begin(), C[2].end()).size() == 20);
+        REQUIRE(*C[2][3].begin() == 55);
+        REQUIRE(std::distance(D.begin(), D.end()) == 20);
+        REQUIRE(std::vector<int>(E.begin(), E.end()).front() == 25);
+        REQUIRE(std::vector<int>(E.begin(), E.end()).back() == 34);
+        REQUIRE(A.select(_, _|0|1, _|2|3).size() == 3);
+        REQUIRE(std::vector<int>(C.select(_|2|3, _, _).begin(), C.select(_|2|3, _, _).end())[4] == 44);
+    }
+
+    SECTION("Operations on dense views agree with strided ones")
+    {
+        auto D = A[1] + A[2];
+        auto S = A.select(_, _, _|0|5|2) * 2;
+
+        REQUIRE(D(3, 4) == 39 + 59);
+        REQUIRE(S(2, 3, 2) == 2 * 59);
+        REQUIRE((A[0] < 20).all());
+        REQUIRE_FALSE((A[0] > 20).any());
+        REQUIRE((! A[0]).any());
+
+        A[2] = A[0];
+        A.take<0>(_|0|1) += 1;
+        REQUIRE(A(2, 3, 4) == 19);
+        REQUIRE(A(0, 3, 4) == 20);
+        REQUIRE(nd::ndarray<int, 2>::loads(C[1].dumps())(3, 4) == 39);
+        REQUIRE(nd::ndarray<int, 1>::loads(A.select(1, 2, _|0|5|2).dumps())(2) == 34);
+    }
+}
+
+
+TEST_CASE("ndarray visits sub-blocks as contiguous runs", "[ndarray] [runs]")
+{
+    auto _ = axis::all();
+    auto A = ndarray<double, 3>(4, 5, 6);
+    auto runs = std::vector<std::pair<std::size_t, std::ptrdiff_t>>();
+    auto record = [&runs] (const double*, std::size_t n, std::ptrdiff_t s) { runs.emplace_back(n, s); };
+
+    const auto& C = A;
+    C.for_each_run(record);
+    REQUIRE(runs == std::vector<std::pair<std::size_t, std::ptrdiff_t>>{{120, 1}});
+
+    runs.clear();
+    C.take<1>(_|1|4).for_each_run(record);
+    REQUIRE(runs.size() == 4);
+    REQUIRE(runs[0] == std::make_pair(std::size_t(18), std::ptrdiff_t(1)));
+
+    runs.clear();
+    C.select(_, _, _|0|6|3).for_each_run(record);
+    REQUIRE(runs == std::vector<std::pair<std::size_t, std::ptrdiff_t>>{{40, 3}});
+
+    runs.clear();
+    C.select(_, _|0|5|2, _|0|6|3).for_each_run(record);
+    REQUIRE(runs.size() == 12);
+    REQUIRE(runs[0] == std::make_pair(std::size_t(2), std::ptrdiff_t(3)));
+
+    auto B = A.take<1>(_|1|4);
+    B.for_each_run([] (double* p, std::size_t n, std::ptrdiff_t) { std::fill(p, p + n, 2.0); });
+    REQUIRE(A(0, 0, 0) == 0.0);
+    REQUIRE(A(3, 3, 5) == 2.0);
+    REQUIRE((B + A.take<1>(_|1|4) == 4.0).all());
+    REQUIRE((A.take<1>(_|0|3) + A.take<1>(_|2|5))(3, 0, 5) == 2.0);
+    REQUIRE((A.take<1>(_|0|3) + A.take<1>(_|2|5))(3, 1, 5) == 4.0);
+}
+
+
+TEST_CASE("allocation_guard names the ndarray operations that allocate", "[ndarray] [guard]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::ndarray<double, 2>(10, 10);
+    auto B = nd::ndarray<double, 2>(10, 10);
+    const auto C = nd::ndarray<double, 2>(10, 10);
+    auto operation = [] (const nd::allocation_guard& guard) { return std::string(guard.operations().back()); };
+
+    SECTION("Operations in place do not allocate")
+    {
+        nd::allocation_guard guard(nd::allocation_guard::policy::abort);
+        A += B;
+        A *= 2.0;
+        A.select(_|0|5, _) = B.select(_|5|10, _);
+        auto V = A.view();
+        V(1, 1) = C(1, 1);
+        auto D = A[3];
+        D = 1.0;
+    }
+
+    SECTION("Allocating operations are named")
+    {
+        nd::allocation_guard guard;
+
+        A + B;
+        REQUIRE(operation(guard) == "binary_op::perform");
+        A.select(_, _|0|10|2).copy();
+        REQUIRE(operation(guard) == "ndarray::copy");
+        A.select(_, _|0|4).reshape(40);
+        REQUIRE(operation(guard) == "ndarray::reshape");
+        ! A;
+        REQUIRE(operation(guard) == "unary_op::perform");
+        nd::ndarray<double, 2> D = C.select(_|0|2, _);
+        REQUIRE(operation(guard) == "ndarray copy constructor (const)");
+        auto E = C;
+        E(0, 0) = 1.0;
+        REQUIRE(operation(guard) == "copy-on-write separation");
+        REQUIRE(guard.allocations() == 6 + 7); // six element blocks, six buffer objects, one snapshot registry
+        REQUIRE(guard.allocated_bytes() > 8 * (100 + 50 + 40 + 0 + 20 + 100) + sizeof(bool) * 100);
+    }
+
+    SECTION("Copies of const arrays report their buffer objects")
+    {
+        const auto F = nd::arange<double>(1000);
+        nd::allocation_guard guard;
+        nd::ndarray<double, 1> G = F;
+
+        REQUIRE(G.shares(F));
+        REQUIRE(guard.allocations() == 2); // the snapshot buffer, and room for it in F's registry
+        REQUIRE(std::string(guard.operations()[0]) == "ndarray copy constructor (const)");
+        REQUIRE(std::string(guard.operations()[1]) == "ndarray copy constructor (const)");
+    }
+}
+
+
+TEST_CASE("expression temporaries can be placed in a scratch scope", "[ndarray] [scratch]")
+{
+    auto A = nd::arange<double>(100);
+    auto B = nd::ones<double>(100);
+    auto C = nd::ndarray<double, 1>(100);
+    auto escaped = nd::ndarray<double, 1>();
+
+    {
+        nd::scratch_scope scratch(1 << 16);
+
+        for (int n = 0; n < 10; ++n)
+        {
+            C = (A + B) * 2.0;
+        }
+        REQUIRE_FALSE(scratch.contains(C.data()));
+        REQUIRE(scratch.live_blocks() == 0);
+        REQUIRE(scratch.peak_bytes() < 4096);
+
+        auto D = A + B;
+        auto E = nd::ndarray<double, 1>({100}, nd::aligned_allocator<double, 4096>());
+        REQUIRE(scratch.contains(D.data()));
+        REQUIRE_FALSE(scratch.contains(E.data()));
+        REQUIRE(scratch.live_blocks() == 3); // D's memory and control block, E's control block
+
+        auto F = nd::ndarray<double, 1>(10000);
+        REQUIRE_FALSE(scratch.contains(F.data()));
+        REQUIRE(scratch.overflows() == 1);
+
+        escaped.become(D);
+    }
+    REQUIRE(C(99) == 200.0);
+    REQUIRE(escaped(99) == 100.0);
+    REQUIRE(escaped.copy()(99) == 100.0);
+
+    {
+        nd::scratch_scope scratch(1 << 16);
+        auto kept = A + B;
+
+        for (int n = 0; n < 100; ++n)
+        {
+            C = (A + B) * 2.0 + kept;
+        }
+        REQUIRE(scratch.contains(kept.data()));
+        REQUIRE(scratch.overflows() == 0);
+        REQUIRE(scratch.peak_bytes() < 4096);
+        REQUIRE(scratch.live_blocks() == 2);
+    }
+    REQUIRE(C(99) == 300.0);
+
+    {
+        nd::scratch_scope scratch(1 << 16);
+        auto handed_off = A + B;
+        REQUIRE(scratch.contains(handed_off.data()));
+
+        std::atomic<bool> looping {false};
+        auto other = std::thread([&handed_off, &looping] ()
+        {
+            while (! looping.load(std::memory_order_relaxed)) {}
+            handed_off.become(nd::ndarray<double, 1>());
+        });
+
+        for (int n = 0; n < 100; ++n)
+        {
+            C = (A + B) * 2.0;
+            looping.store(true, std::memory_order_relaxed);
+        }
+        other.join();
+
+        REQUIRE(scratch.live_blocks() == 0);
+    }
+    REQUIRE(C(99) == 200.0);
+}
+
+
+TEST_CASE("ndarray can wrap external memory without copying", "[ndarray] [adopt]")
+{
+    auto _ = nd::axis::all();
+
+    SECTION("borrowed memory is shared with the array and its views")
+    {
+        auto data = std::vector<double>(12);
+        auto A = nd::borrow<double, 2>(data.data(), {3, 4});
+
+        A.select(1, _) = 2.0;
+        A.take<1>(_|3|4) = 3.0;
+
+        REQUIRE(A.data() == data.data());
+        REQUIRE(A.contiguous());
+        REQUIRE(data[4] == 2.0);
+        REQUIRE(data[3] == 3.0);
+        REQUIRE(data[7] == 3.0);
+        REQUIRE(std::vector<double>(A[1].begin(), A[1].end()) == std::vector<double>{2, 2, 2, 3});
+    }
+
+    SECTION("adopted memory is released once, after the last view is gone")
+    {
+        auto released = 0;
+        {
+            auto A = nd::adopt<int, 1>(new int[10], {10}, [&released] (int* p) { delete [] p; ++released; });
+            auto B = A.select(_|2|8);
+            B = 1;
+            A.become(nd::arange<int>(4));
+            REQUIRE(released == 0);
+            REQUIRE((B == 1).all());
+        }
+        REQUIRE(released == 1);
+    }
+
+    SECTION("strided memory can be borrowed")
+    {
+        auto data = std::vector<int>(30);
+        std::iota(data.begin(), data.end(), 0);
+
+        auto A = nd::borrow<int, 2>(data.data(), {3, 4}, {10, 2});
+        auto B = nd::borrow<int, 1>(data.data() + 1, {5}, {3});
+
+        REQUIRE(A.shape() == std::array<int, 2>{3, 4});
+        REQUIRE(A(0, 1) == 2);
+        REQUIRE(A(2, 3) == 26);
+        REQUIRE(std::vector<int>(A.begin(), A.end()) == std::vector<int>{0, 2, 4, 6, 10, 12, 14, 16, 20, 22, 24, 26});
+        REQUIRE(std::vector<int>(B.begin(), B.end()) == std::vector<int>{1, 4, 7, 10, 13});
+        REQUIRE_THROWS_AS((nd::borrow<int, 2>(data.data(), {3, 4}, {4, 2})), std::invalid_argument);
+        REQUIRE_THROWS_AS((nd::borrow<int, 2>(data.data(), {3, 4}, {10, 0})), std::invalid_argument);
+    }
 }
 
 
@@ -1030,6 +1995,125 @@ TEST_CASE("ndarray leading axis slicing via operator[] works correctly", "[ndarr
 }
 
 
+TEST_CASE("rank-0 ndarray holds its value without allocating", "[ndarray] [scalar]")
+{
+    auto A = nd::arange<int>(24).reshape(2, 3, 4);
+    const auto& C = A;
+    nd::telemetry_scope scope;
+
+    SECTION("Rank-0 arrays created from values, copies, and defaults are inline")
+    {
+        auto a = nd::ndarray<T, 0>(1.5);
+        auto b = nd::ndarray<T, 0>();
+        const auto c = a;
+        auto d = c;
+        d = 2.5;
+
+        REQUIRE(double(a) == 1.5);
+        REQUIRE(double(b) == 0.0);
+        REQUIRE(double(c) == 1.5);
+        REQUIRE(double(d) == 2.5);
+        REQUIRE_FALSE(a.shares(c));
+        REQUIRE(scope.allocations() == 0);
+    }
+
+    SECTION("Chained operator[] reads and writes without allocating")
+    {
+        const auto v = C[1][2][3];
+        nd::ndarray<int, 0> x = v;
+        auto y = A[1][2][3];
+        auto z = y;
+        z = 100;
+
+        REQUIRE(int(x) == 23);
+        REQUIRE(int(C[1][2][3]) == 100);
+        REQUIRE(int(v) == 100);
+        REQUIRE(z.shares(A));
+        REQUIRE_FALSE(x.shares(A));
+        REQUIRE(scope.allocations() == 0);
+    }
+
+    SECTION("Inline scalars can be copied, cast, and used in expressions")
+    {
+        const auto x = nd::ndarray<T, 0>(3.0);
+        auto a = x.copy();
+        auto b = x.astype<int>();
+        auto c = x + 1.0;
+        auto d = x * x;
+
+        REQUIRE(double(a) == 3.0);
+        REQUIRE(int(b) == 3);
+        REQUIRE(double(c) == 4.0);
+        REQUIRE(double(d) == 9.0);
+        REQUIRE_FALSE(a.shares(x));
+    }
+}
+
+
+TEST_CASE("ndarray gives out non-owning views", "[ndarray] [view]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::arange<int>(60).reshape(3, 4, 5);
+    const auto& C = A;
+
+    SECTION("Views of whole arrays and selections index the same elements")
+    {
+        auto B = A.select(_|1|3, 2, _|0|5|2);
+        auto V = B.view();
+
+        REQUIRE(V.shape() == B.shape());
+        REQUIRE(V(1, 2) == B(1, 2));
+        REQUIRE(std::vector<int>(V.begin(), V.end()) == std::vector<int>(B.begin(), B.end()));
+        REQUIRE(A.view().select(_|1|3, 2, _|0|5|2)(1, 2) == B(1, 2));
+        REQUIRE(A.view().contiguous());
+    }
+
+    SECTION("Const arrays and const_refs give read-only views")
+    {
+        auto V = C.view();
+        auto W = C.select(1, _, _).view();
+
+        static_assert(std::is_same<decltype(V), nd::ndarray_view<const int, 3>>::value, "const arrays give const views");
+        REQUIRE(W(3, 4) == 39);
+        REQUIRE(V[2](3, 4) == 59);
+    }
+
+    SECTION("Writes through a view reach the array")
+    {
+        auto V = A.take<2>(_|1|2).view();
+
+        for (auto& x : V)
+            x = 0;
+
+        REQUIRE((A.take<2>(_|1|2) == 0).all());
+        REQUIRE(A(0, 0, 0) == 0);
+        REQUIRE(A(0, 0, 2) == 2);
+    }
+
+    SECTION("Shifted views agree with shifted arrays, but stay inside a sub-array")
+    {
+        auto whole = A.view().shift<2>(+1);
+        auto B = A.take<2>(_|1|4);
+        auto V = B.view().shift<2>(+1);
+        auto S = B.shift<2>(+1);
+
+        REQUIRE(whole.shape() == A.shift<2>(+1).shape());
+        REQUIRE(std::vector<int>(whole.begin(), whole.end()) == std::vector<int>(A.shift<2>(+1).begin(), A.shift<2>(+1).end()));
+        REQUIRE(S.shape() == std::array<int, 3>{3, 4, 3});
+        REQUIRE(V.shape() == std::array<int, 3>{3, 4, 2});
+        REQUIRE(S(0, 0, 2) == 4);
+        REQUIRE(std::vector<int>(V.begin(), V.end()) == std::vector<int>(S.take<2>(_|0|2).begin(), S.take<2>(_|0|2).end()));
+    }
+
+    SECTION("Rank-0 arrays give rank-0 views")
+    {
+        auto x = nd::ndarray<int, 0>(3);
+        REQUIRE(x.view()() == 3);
+        REQUIRE(A[1][2][3].view()() == 33);
+    }
+}
+
+
 TEST_CASE("ndarray selection works correctly", "[ndarray] [select]")
 {
     auto A = ndarray<T, 2>(3, 4);
@@ -1069,6 +2153,19 @@ TEST_CASE("ndarray can be serialized to and loaded from a string", "[ndarray] [s
         REQUIRE_THROWS_AS((ndarray<T, 1>::loads("")), std::invalid_argument);
         REQUIRE_THROWS_AS((ndarray<T, 1>::loads(nd::arange<T>(10).dumps() + "1234")), std::invalid_argument);
         REQUIRE_THROWS_AS((ndarray<T, 1>::loads(nd::arange<T>(10).dumps() + "12345678")), std::invalid_argument);
+        REQUIRE_THROWS_AS((ndarray<T, 1>::loads(nd::arange<T>(10).dumps().substr(0, 80))), std::invalid_argument);
+    }
+
+    SECTION("ndarray header stores rank and shape as 64-bit integers")
+    {
+        auto str = nd::arange<T>(12).reshape(3, 4).dumps();
+        auto dim = std::int64_t(-1);
+
+        REQUIRE(ndarray<T, 2>::header_size() == 32);
+        REQUIRE(str.size() == 32 + 12 * sizeof(T));
+
+        str.replace(16, sizeof(dim), (char*)&dim, sizeof(dim));
+        REQUIRE_THROWS_AS((ndarray<T, 2>::loads(str)), std::invalid_argument);
     }
 
     SECTION("ndarray dtype strings are as expected")
@@ -1138,6 +2235,65 @@ TEST_CASE("ndarrays iterators respect const correctness", "[ndarray] [iterator]"
 }
 
 
+TEST_CASE("ndarray iterators are random access", "[ndarray] [iterator]")
+{
+    auto _ = axis::all();
+    auto A = ndarray<int, 2>(512, 256);
+    auto seed = 1u;
+
+    for (auto& a : A)
+        a = int((seed = seed * 1103515245u + 12345u) >> 16);
+
+    SECTION("Iterator arithmetic agrees with stepping, for dense and strided arrays")
+    {
+        for (auto B : {A.select(_|0|4, _), A.select(_|1|5|2, _|3|20|3)})
+        {
+            auto first = B.begin();
+            auto last = B.end();
+            auto it = first;
+
+            REQUIRE(last - first == std::ptrdiff_t(B.size()));
+
+            for (std::ptrdiff_t n = 0; n < last - first; ++n, ++it)
+            {
+                REQUIRE(&first[n] == &*it);
+                REQUIRE(it - first == n);
+                REQUIRE(first + n == it);
+                REQUIRE((it + 1) - 1 == it);
+            }
+            REQUIRE(it == last);
+            REQUIRE(&*--it == &*(last - 1));
+        }
+    }
+
+    SECTION("Standard algorithms work on strided arrays")
+    {
+        auto B = A.select(_, _|1|256|2);
+        auto C = A.select(_, _|0|256|2).copy();
+        std::sort(B.begin(), B.end());
+
+        REQUIRE(std::is_sorted(B.begin(), B.end()));
+        REQUIRE((A.select(_, _|0|256|2) == C).all());
+        REQUIRE(std::lower_bound(B.begin(), B.end(), B(100, 50)) - B.begin() <= 100 * 128 + 50);
+        REQUIRE(*std::lower_bound(B.begin(), B.end(), B(100, 50)) == B(100, 50));
+
+        auto D = C[7];
+        std::nth_element(D.begin(), D.begin() + 64, D.end());
+        REQUIRE(std::all_of(D.begin(), D.begin() + 64, [&] (int d) { return d <= D(64); }));
+        REQUIRE(std::all_of(D.begin() + 64, D.end(), [&] (int d) { return d >= D(64); }));
+    }
+
+#if __cplusplus >= 201703L && __has_include(<execution>)
+    SECTION("Parallel algorithms work on strided arrays")
+    {
+        auto B = A.select(_, _|0|256|2);
+        std::sort(std::execution::par, B.begin(), B.end());
+        REQUIRE(std::is_sorted(B.begin(), B.end()));
+    }
+#endif
+}
+
+
 TEST_CASE("ndarrays respect const correctness", "[ndarray]")
 {
     auto _ = axis::all();
@@ -1175,13 +2331,16 @@ TEST_CASE("ndarrays respect const correctness", "[ndarray]")
 
 
     // ========================================================================
-    SECTION("Non-const array B constructed from const A does not share A")
+    SECTION("Non-const array B constructed from const A shares A until B is modified")
     {
         const auto A = ndarray<double, 1>(10);
         auto B = A;
-        CHECK_FALSE(B.shares(A));
+        CHECK(B.shares(A));
         CHECK_FALSE(B.is_const_ref());
         CHECK(B.size() == A.size());
+        B(0) = 1.0;
+        CHECK_FALSE(B.shares(A));
+        CHECK(A(0) == 0.0);
     }
     SECTION("Non-const array B selected from const A does not share A")
     {
@@ -1192,11 +2351,11 @@ TEST_CASE("ndarrays respect const correctness", "[ndarray]")
 
 
     // ========================================================================
-    SECTION("Const array B constructed from const A *DOES NOT* share A (is there a way?)")
+    SECTION("Const array B constructed from const A shares A (copy-on-write)")
     {
         const auto A = ndarray<double, 1>(10);
         const auto B = A;
-        CHECK_FALSE(B.shares(A));
+        CHECK(B.shares(A));
     }
     SECTION("Const array B selected from const A shares A")
     {
@@ -0,0 +1,242 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <utility>
+#include <system_error>
+#include "ndarray.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, typename Allocator = default_allocator<T>> struct first_touch_allocator;
+
+    /**
+     * Returns the half-open range [begin, end) of the given part, when size
+     * items are divided into num_parts nearly equal contiguous blocks. This is
+     * the static partitioning used by first_touch_allocator; parallel kernels
+     * that split their work the same way (over flat elements of a contiguous
+     * array) run each block on the NUMA node that holds its memory.
+     */
+    static inline std::pair<std::size_t, std::size_t> static_partition(std::size_t size, std::size_t num_parts, std::size_t part);
+
+    /**
+     * Returns the NUMA node holding each page spanned by the given memory
+     * range, or a negative errno value for pages that are not resident (for
+     * example -ENOENT for pages that were never touched). Throws
+     * std::system_error where page placement cannot be queried (on systems
+     * other than Linux, or if the kernel refuses the request). For an array,
+     * the range runs from its first element to its last, so selections and
+     * strided views report the pages they actually address.
+     */
+    static inline std::vector<int> page_nodes(const void* data, std::size_t bytes);
+
+    template<typename T, int R>
+    static inline std::vector<int> page_nodes(const ndarray<T, R>& array);
+
+    namespace detail
+    {
+        static inline std::size_t page_size();
+    }
+} // ND_API_END
+
+
+
+
+// ============================================================================
+std::pair<std::size_t, std::size_t> nd::static_partition(std::size_t size, std::size_t num_parts, std::size_t part) // ND_IMPL_START
+{
+    auto block = size / num_parts;
+    auto extra = size % num_parts;
+    auto begin = part * block + std::min(part, extra);
+    return std::make_pair(begin, begin + block + (part < extra ? 1 : 0));
+}
+
+std::size_t nd::detail::page_size()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    return std::size_t(::sysconf(_SC_PAGESIZE));
+#else
+    return 4096;
+#endif
+}
+
+std::vector<int> nd::page_nodes(const void* data, std::size_t bytes)
+{
+    auto page = detail::page_size();
+    auto first = reinterpret_cast<std::uintptr_t>(data) / page * page;
+    auto last = reinterpret_cast<std::uintptr_t>(data) + bytes;
+    auto pages = std::vector<void*>();
+    auto nodes = std::vector<int>();
+
+    for (auto address = first; address < last; address += page)
+    {
+        pages.push_back(reinterpret_cast<void*>(address));
+    }
+    nodes.resize(pages.size());
+
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (! pages.empty() && ::syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, nodes.data(), 0) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "page_nodes: move_pages failed");
+    }
+    return nodes;
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "page_nodes: page placement cannot be queried");
+#endif
+}
+
+template<typename T, int R>
+std::vector<int> nd::page_nodes(const ndarray<T, R>& array)
+{
+    auto view = array.view();
+    auto span = std::ptrdiff_t(view.size() ? 1 : 0);
+
+    for (int n = 0; n < R && view.size(); ++n)
+    {
+        span += (view.shape()[n] - 1) * view.strides()[n];
+    }
+    return page_nodes(view.data(), span * sizeof(T));
+}
+
+
+
+
+// ============================================================================
+template<typename T, typename Allocator>
+struct nd::first_touch_allocator
+{
+    /**
+     * An allocator adaptor which, after obtaining memory from the underlying
+     * allocator, touches its pages from num_threads threads, each touching
+     * the block given by static_partition. Under the Linux first-touch
+     * policy, each page then lives on the NUMA node of the thread that will
+     * later process it. Allocations smaller than one page per thread are
+     * touched serially.
+     */
+
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = first_touch_allocator<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>; };
+
+    first_touch_allocator(unsigned num_threads = std::thread::hardware_concurrency(), Allocator allocator = Allocator())
+    : num_threads(std::max(num_threads, 1u))
+    , allocator(allocator)
+    {
+    }
+
+    template<typename U, typename OtherAllocator>
+    first_touch_allocator(const first_touch_allocator<U, OtherAllocator>& other)
+    : num_threads(other.num_threads)
+    , allocator(other.allocator)
+    {
+    }
+
+    T* allocate(std::size_t count)
+    {
+        auto ptr = allocator.allocate(count);
+        auto bytes = count * sizeof(T);
+        auto page = detail::page_size();
+        auto touch = [ptr, bytes, page, this] (std::size_t part)
+        {
+            auto range = static_partition(bytes, num_threads, part);
+            auto first = reinterpret_cast<std::uintptr_t>(ptr) + range.first;
+            auto last = reinterpret_cast<std::uintptr_t>(ptr) + range.second;
+
+            for (auto address = first; address < last; address = (address / page + 1) * page)
+            {
+                *reinterpret_cast<volatile char*>(address) = 0;
+            }
+        };
+
+        if (bytes < page * num_threads)
+        {
+            for (unsigned n = 0; n < num_threads; ++n)
+            {
+                touch(n);
+            }
+        }
+        else
+        {
+            auto threads = std::vector<std::thread>();
+
+            for (unsigned n = 0; n < num_threads; ++n)
+            {
+                threads.emplace_back(touch, n);
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+        return ptr;
+    }
+
+    void deallocate(T* ptr, std::size_t count)
+    {
+        allocator.deallocate(ptr, count);
+    }
+
+    unsigned num_threads;
+    Allocator allocator;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_NUMA
+#include "catch.hpp"
+
+
+TEST_CASE("static_partition covers a range in contiguous blocks", "[numa]")
+{
+    auto end = std::size_t(0);
+
+    for (std::size_t part = 0; part < 7; ++part)
+    {
+        auto range = nd::static_partition(100, 7, part);
+        REQUIRE(range.first == end);
+        REQUIRE(range.second - range.first >= 14);
+        REQUIRE(range.second - range.first <= 15);
+        end = range.second;
+    }
+    REQUIRE(end == 100);
+}
+
+
+TEST_CASE("first_touch_allocator makes every page resident", "[numa]")
+{
+    auto A = nd::ndarray<double, 2>({1024, 1024}, nd::uninitialized, nd::first_touch_allocator<double>(4));
+    auto B = nd::zeros<int>(100, nd::first_touch_allocator<int, std::allocator<int>>(4));
+    auto nodes = nd::page_nodes(A);
+
+    REQUIRE(nodes.size() >= 1024 * 1024 * sizeof(double) / 4096);
+    REQUIRE(std::all_of(nodes.begin(), nodes.end(), [] (int node) { return node >= 0; }));
+    REQUIRE((B == 0).all());
+}
+
+
+TEST_CASE("page_nodes covers the pages a sub-view addresses", "[numa]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::ndarray<double, 2>({64, 1024}, nd::uninitialized, nd::first_touch_allocator<double>(4));
+    auto rows = A.select(_|32|34, _);
+    auto column = A.select(_|8|64|16, _|5|6);
+
+    REQUIRE(nd::page_nodes(rows) == nd::page_nodes(&A(32, 0), 2 * 1024 * sizeof(double)));
+    REQUIRE(nd::page_nodes(column) == nd::page_nodes(&A(8, 5), (48 * 1024 + 1) * sizeof(double)));
+    REQUIRE(nd::page_nodes(column).size() >= 48 * 1024 * sizeof(double) / 4096);
+}
+
+#endif // TEST_NUMA
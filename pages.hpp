@@ -0,0 +1,211 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <system_error>
+#include "ndarray.hpp"
+#include "numa.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+/**
+ * Size (in bytes) of a transparent huge page, and so the alignment of large
+ * blocks handed out by nd::huge_page_allocator. 2 MB on x86-64 and on most
+ * aarch64 kernels.
+ */
+#ifndef ND_HUGE_PAGE_SIZE
+#define ND_HUGE_PAGE_SIZE (std::size_t(1) << 21)
+#endif
+
+    template<typename T> struct huge_page_allocator;
+
+    /**
+     * Access patterns that may be declared for a range of memory with
+     * nd::advise. They map onto the madvise flags of the same names.
+     */
+    enum class access_hint { normal, sequential, random, willneed };
+
+    /**
+     * Tells the kernel how the memory spanned by an array, selection, or view
+     * will be accessed: sequential read-ahead, no read-ahead for random
+     * access, or to start paging in now. The hint applies to whole pages, so
+     * it also covers any memory sharing the first and last pages with the
+     * array. Hints are most useful on memory-mapped arrays; they do nothing
+     * on systems without madvise. Throws std::system_error if the kernel
+     * rejects the request.
+     */
+    static inline void advise(const void* data, std::size_t bytes, access_hint hint);
+
+    template<typename T, int R>
+    static inline void advise(ndarray_view<T, R> view, access_hint hint);
+
+    template<typename Array>
+    static inline auto advise(const Array& array, access_hint hint) -> decltype(array.view(), void());
+} // ND_API_END
+
+
+
+
+// ============================================================================
+void nd::advise(const void* data, std::size_t bytes, access_hint hint) // ND_IMPL_START
+{
+    if (bytes == 0)
+    {
+        return;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    auto page = detail::page_size();
+    auto first = reinterpret_cast<std::uintptr_t>(data) / page * page;
+    auto last = reinterpret_cast<std::uintptr_t>(data) + bytes;
+    auto flag = MADV_NORMAL;
+
+    switch (hint)
+    {
+        case access_hint::normal:     flag = MADV_NORMAL; break;
+        case access_hint::sequential: flag = MADV_SEQUENTIAL; break;
+        case access_hint::random:     flag = MADV_RANDOM; break;
+        case access_hint::willneed:   flag = MADV_WILLNEED; break;
+    }
+    if (::madvise(reinterpret_cast<void*>(first), last - first, flag) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "advise: madvise failed");
+    }
+#else
+    (void) data;
+    (void) hint;
+#endif
+}
+
+template<typename T, int R>
+void nd::advise(ndarray_view<T, R> view, access_hint hint)
+{
+    if (view.size() == 0)
+    {
+        return;
+    }
+    std::ptrdiff_t lower = 0;
+    std::ptrdiff_t upper = 0;
+
+    for (int n = 0; n < R; ++n)
+    {
+        auto extent = (view.shape(n) - 1) * view.strides()[n];
+        lower += std::min(extent, std::ptrdiff_t(0));
+        upper += std::max(extent, std::ptrdiff_t(0));
+    }
+    advise(view.data() + lower, (upper - lower + 1) * sizeof(T), hint);
+}
+
+template<typename Array>
+auto nd::advise(const Array& array, access_hint hint) -> decltype(array.view(), void())
+{
+    advise(array.view(), hint);
+}
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::huge_page_allocator
+{
+    /**
+     * An allocator for very large arrays, which are accessed with strides
+     * spanning many pages and so miss the TLB on nearly every element. Blocks
+     * of at least threshold_bytes are aligned to ND_HUGE_PAGE_SIZE, and the
+     * kernel is asked to back them with transparent huge pages
+     * (madvise(MADV_HUGEPAGE) on Linux). The request is only a hint: it is
+     * ignored where THP is unavailable or disabled, and the memory is then
+     * ordinary. Smaller blocks are allocated like default_allocator.
+     */
+
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = huge_page_allocator<U>; };
+
+    huge_page_allocator(std::size_t threshold_bytes = ND_HUGE_PAGE_SIZE) : threshold_bytes(threshold_bytes) {}
+
+    template<typename U>
+    huge_page_allocator(const huge_page_allocator<U>& other) : threshold_bytes(other.threshold_bytes) {}
+
+    T* allocate(std::size_t count)
+    {
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        auto bytes = count * sizeof(T);
+
+        if (count == 0 || bytes < threshold_bytes)
+        {
+            return default_allocator<T>().allocate(count);
+        }
+        auto ptr = detail::aligned_malloc(bytes, ND_HUGE_PAGE_SIZE);
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        ::madvise(ptr, bytes / detail::page_size() * detail::page_size(), MADV_HUGEPAGE);
+#endif
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+        detail::aligned_free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const huge_page_allocator<U>& other) const { return threshold_bytes == other.threshold_bytes; }
+
+    template<typename U>
+    bool operator!=(const huge_page_allocator<U>& other) const { return threshold_bytes != other.threshold_bytes; }
+
+    std::size_t threshold_bytes;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_PAGES
+#include "catch.hpp"
+
+
+TEST_CASE("huge_page_allocator aligns large blocks to huge pages", "[pages]")
+{
+    auto A = nd::ndarray<double, 2>({1024, 1024}, nd::uninitialized, nd::huge_page_allocator<double>());
+    auto B = nd::zeros<int>(100, nd::huge_page_allocator<int>());
+    auto C = nd::zeros<char>(4096, nd::huge_page_allocator<char>(4096));
+
+    REQUIRE(reinterpret_cast<std::uintptr_t>(A.data()) % ND_HUGE_PAGE_SIZE == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(B.data()) % ND_DEFAULT_ALIGNMENT == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(C.data()) % ND_HUGE_PAGE_SIZE == 0);
+    REQUIRE((B == 0).all());
+    REQUIRE(nd::huge_page_allocator<int>().allocate(0) == nullptr);
+
+    A(1023, 1023) = 1.0;
+    REQUIRE(A(1023, 1023) == 1.0);
+}
+
+
+TEST_CASE("advise accepts arrays, selections, and views", "[pages]")
+{
+    auto _ = nd::axis::all();
+    auto A = nd::ndarray<double, 3>(64, 64, 64);
+    const auto& C = A;
+
+    REQUIRE_NOTHROW(nd::advise(A, nd::access_hint::sequential));
+    REQUIRE_NOTHROW(nd::advise(C.select(_|10|20, _, 3), nd::access_hint::random));
+    REQUIRE_NOTHROW(nd::advise(A.take<0>(_|0|8), nd::access_hint::willneed));
+    REQUIRE_NOTHROW(nd::advise(A.view().select(1, _, _|0|64|2), nd::access_hint::normal));
+    REQUIRE_NOTHROW(nd::advise(A.select(_|0|0, _, _), nd::access_hint::random));
+    REQUIRE(A(63, 63, 63) == 0.0);
+}
+
+#endif // TEST_PAGES
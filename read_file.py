@@ -6,8 +6,8 @@ def load(filename):
 
     with open(filename, 'rb') as f:
         dtype = struct.unpack('8s', f.read(8))[0].decode('utf-8').strip('\x00')
-        rank = struct.unpack('i', f.read(4))[0]
-        dims = struct.unpack('i' * rank, f.read(4 * rank))
+        rank = struct.unpack('q', f.read(8))[0]
+        dims = struct.unpack('q' * rank, f.read(8 * rank))
         data = f.read()
         return np.frombuffer(data, dtype=dtype).reshape(dims)
 
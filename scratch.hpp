@@ -0,0 +1,341 @@
+#pragma once
+#include <new>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include "allocator.hpp"
+#include "telemetry.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    class scratch_scope;
+
+    namespace detail
+    {
+        class scratch_region;
+        template<typename T> struct scratch_allocator;
+    }
+} // ND_API_END
+
+
+
+
+// ============================================================================
+class nd::detail::scratch_region // ND_IMPL_START
+{
+public:
+
+    /**
+     * A block of memory handed out by bumping an offset, which is kept at a
+     * multiple of ND_DEFAULT_ALIGNMENT so that every block starts where the
+     * previous one ends. The region counts the blocks it has handed out
+     * which are still alive, plus one for the scratch_scope that created it,
+     * and deletes itself when the count reaches zero. Blocks are only handed
+     * out on the thread that owns the scope, but may be released from any
+     * thread.
+     */
+    scratch_region(std::size_t capacity)
+    : memory(static_cast<char*>(aligned_malloc(capacity, ND_DEFAULT_ALIGNMENT)))
+    , capacity(capacity)
+    , owner(std::this_thread::get_id())
+    {
+    }
+
+    ~scratch_region()
+    {
+        aligned_free(memory);
+    }
+
+    scratch_region(const scratch_region&) = delete;
+    scratch_region& operator=(const scratch_region&) = delete;
+
+    /**
+     * Returns the next block of the given size and alignment, or nullptr if
+     * the region cannot hold it. The offset returns to the start of the
+     * region whenever no blocks are alive, and to the start of the topmost
+     * block when it is released on the owning thread.
+     */
+    void* allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (live.load(std::memory_order_acquire) == 1)
+        {
+            offset = 0;
+        }
+        auto start = offset;
+
+        if (alignment > ND_DEFAULT_ALIGNMENT || bytes > capacity - start)
+        {
+            ++num_overflows;
+            return nullptr;
+        }
+        offset = std::min(rounded(start + bytes), capacity);
+        peak = std::max(peak, offset);
+        retain();
+        return memory + start;
+    }
+
+    bool contains(const void* ptr) const
+    {
+        auto p = static_cast<const char*>(ptr);
+        return p >= memory && p < memory + capacity;
+    }
+
+    void retain()
+    {
+        live.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release()
+    {
+        if (live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    /**
+     * Releases a block of the given size. If it is the most recent block
+     * still alive, and the caller is the owning thread (the only one which
+     * moves the offset), its memory is reclaimed at once. Temporaries are
+     * destroyed in the reverse order of their creation, so a long-lived
+     * block lower in the region does not stop them from being recycled.
+     */
+    void release(const void* block, std::size_t bytes)
+    {
+        auto start = static_cast<const char*>(block) - memory;
+
+        if (std::this_thread::get_id() == owner && std::min(rounded(start + bytes), capacity) == offset)
+        {
+            offset = start;
+        }
+        release();
+    }
+
+private:
+    friend class nd::scratch_scope;
+
+    static std::size_t rounded(std::size_t bytes)
+    {
+        return (bytes + ND_DEFAULT_ALIGNMENT - 1) / ND_DEFAULT_ALIGNMENT * ND_DEFAULT_ALIGNMENT;
+    }
+
+    char* memory;
+    std::size_t capacity;
+    std::size_t offset = 0;
+    std::size_t peak = 0;
+    std::size_t num_overflows = 0;
+    std::thread::id owner;
+    std::atomic<std::size_t> live {1};
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::scratch_allocator
+{
+    /**
+     * Allocates from a scratch region, falling back to the heap when the
+     * region is full. Every block holds a reference to the region, so that
+     * deallocate can tell the two kinds of block apart. Used to place the
+     * control blocks of buffers created inside a scratch_scope.
+     */
+
+    using value_type = T;
+
+    scratch_allocator(scratch_region* region) : region(region) {}
+
+    template<typename U>
+    scratch_allocator(const scratch_allocator<U>& other) : region(other.region) {}
+
+    T* allocate(std::size_t count)
+    {
+        telemetry::allocated_object(count * sizeof(T), "nd::buffer object");
+
+        if (auto ptr = region->allocate(count * sizeof(T), alignof(T)))
+        {
+            return static_cast<T*>(ptr);
+        }
+        auto ptr = static_cast<T*>(::operator new(count * sizeof(T)));
+        region->retain();
+        return ptr;
+    }
+
+    void deallocate(T* ptr, std::size_t count)
+    {
+        if (region->contains(ptr))
+        {
+            region->release(ptr, count * sizeof(T));
+            return;
+        }
+        ::operator delete(ptr);
+        region->release();
+    }
+
+    template<typename U>
+    bool operator==(const scratch_allocator<U>& other) const { return region == other.region; }
+
+    template<typename U>
+    bool operator!=(const scratch_allocator<U>& other) const { return region != other.region; }
+
+    scratch_region* region;
+};
+
+
+
+
+// ============================================================================
+class nd::scratch_scope
+{
+public:
+
+    /**
+     * While a scratch_scope is alive, buffers created on its thread with the
+     * default allocator (the temporaries of array expressions, copies, and
+     * new arrays) are bump-allocated from a region of capacity_bytes reserved
+     * up front, and so are their reference counts (unless ND_SINGLE_THREADED
+     * is defined). Memory is reclaimed in stack order: the most recent
+     * block is reused as soon as it is freed, and the whole region once every
+     * block in it has been freed. Temporaries are freed in the reverse order
+     * of their creation, so each complete expression in a loop like
+     *
+     * nd::scratch_scope scratch(1 << 26);
+     * for (...) { u += (A + B) * dt; }
+     *
+     * reuses the memory of the previous one, even when arrays created before
+     * the loop are still alive. Only memory below a live block stays pinned.
+     * Blocks freed on other threads are reclaimed once the region empties.
+     *
+     * Requests the region cannot hold are served by the default allocator,
+     * and counted as overflows. Arrays created inside the scope may safely
+     * outlive it: the region stays allocated until its last block is
+     * released. live_blocks() reports how many blocks are still alive, and
+     * contains() tells whether an array's memory is in the region; copy()
+     * the array outside the scope to move it onto the heap. Scopes may be
+     * nested, the innermost one being in effect.
+     */
+    explicit scratch_scope(std::size_t capacity_bytes)
+    : region(new detail::scratch_region(capacity_bytes))
+    , parent(current())
+    {
+        current() = region;
+    }
+
+    ~scratch_scope()
+    {
+        current() = parent;
+        region->release();
+    }
+
+    scratch_scope(const scratch_scope&) = delete;
+    scratch_scope& operator=(const scratch_scope&) = delete;
+
+    std::size_t capacity() const { return region->capacity; }
+    std::size_t peak_bytes() const { return region->peak; }
+    std::size_t overflows() const { return region->num_overflows; }
+    std::size_t live_blocks() const { return region->live.load() - 1; }
+    bool contains(const void* ptr) const { return region->contains(ptr); }
+
+    /**
+     * Returns the region of the innermost scratch_scope on this thread, or
+     * nullptr if there is none.
+     */
+    static detail::scratch_region* active()
+    {
+        return current();
+    }
+
+private:
+    static detail::scratch_region*& current()
+    {
+        static thread_local detail::scratch_region* region = nullptr;
+        return region;
+    }
+
+    detail::scratch_region* region;
+    detail::scratch_region* parent;
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_SCRATCH
+#include "catch.hpp"
+
+
+TEST_CASE("scratch regions bump-allocate and recycle when empty", "[scratch]")
+{
+    nd::scratch_scope scratch(1024);
+    auto region = nd::scratch_scope::active();
+
+    auto a = region->allocate(100, 64);
+    auto b = region->allocate(100, 64);
+    REQUIRE(static_cast<char*>(b) - static_cast<char*>(a) == 128);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(a) % 64 == 0);
+    REQUIRE(region->allocate(1000, 8) == nullptr);
+    REQUIRE(scratch.overflows() == 1);
+    REQUIRE(scratch.live_blocks() == 2);
+
+    region->release();
+    region->release();
+    REQUIRE(scratch.live_blocks() == 0);
+    REQUIRE(region->allocate(100, 64) == a);
+    region->release();
+    REQUIRE(scratch.peak_bytes() == 256);
+}
+
+
+TEST_CASE("scratch regions reclaim the most recent block when it is freed", "[scratch]")
+{
+    nd::scratch_scope scratch(1024);
+    auto region = nd::scratch_scope::active();
+
+    auto kept = region->allocate(100, 64);
+    auto a = region->allocate(100, 64);
+    auto b = region->allocate(100, 64);
+
+    region->release(b, 100);
+    region->release(a, 100);
+    REQUIRE(region->allocate(100, 64) == a);
+    region->release(a, 100);
+
+    for (int n = 0; n < 100; ++n)
+    {
+        auto c = region->allocate(500, 64);
+        auto d = region->allocate(300, 64);
+        REQUIRE(c == a);
+        region->release(d, 300);
+        region->release(c, 500);
+    }
+    REQUIRE(scratch.overflows() == 0);
+    REQUIRE(scratch.live_blocks() == 1);
+    region->release(kept, 100);
+}
+
+
+TEST_CASE("scratch scopes nest", "[scratch]")
+{
+    REQUIRE(nd::scratch_scope::active() == nullptr);
+    {
+        nd::scratch_scope outer(64);
+        {
+            nd::scratch_scope inner(64);
+            REQUIRE(nd::scratch_scope::active() != nullptr);
+            REQUIRE(inner.contains(nd::scratch_scope::active()->allocate(8, 8)));
+            nd::scratch_scope::active()->release();
+        }
+        REQUIRE(outer.contains(nd::scratch_scope::active()->allocate(8, 8)));
+        nd::scratch_scope::active()->release();
+    }
+    REQUIRE(nd::scratch_scope::active() == nullptr);
+}
+
+#endif // TEST_SCRATCH
@@ -1,7 +1,11 @@
 #pragma once
 #include <array>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
 #include <numeric>
 #include <functional>
+#include <stdexcept>
 #include "shape.hpp"
 
 
@@ -44,10 +48,29 @@ namespace nd // ND_API_START
         }
         while (it != end)
         {
-            sel.count[n++] = int(*it++);
+            sel.count[n++] = std::ptrdiff_t(*it++);
         }
         return sel;
     }
+
+    namespace detail
+    {
+        /**
+         * Merges adjacent axes that can be traversed as one, in place: axes n
+         * and n + 1 merge when every set of strides has strides[n] equal to
+         * shape[n + 1] * strides[n + 1], so that stepping off the end of axis
+         * n + 1 lands on the next element of axis n. Merged axes are packed
+         * to the end, and the leading axes left over get length 1, so row-
+         * major traversal visits the same elements in the same order with a
+         * shorter loop nest and longer inner runs. Returns the number of
+         * axes remaining (at least 1). Shapes containing zero are left alone,
+         * as are merges whose length would not fit in an int. If outer is
+         * given, each remaining axis k records in (*outer)[k] the outermost
+         * original axis merged into it.
+         */
+        template<int R, std::size_t N>
+        static inline int coalesce_axes(std::array<int, R>& shape, std::array<std::array<std::ptrdiff_t, R>, N>& strides, std::array<int, R>* outer = nullptr);
+    }
 } // ND_API_END
 
 
@@ -81,10 +104,11 @@ struct nd::selector
             "selector: number of count arguments must match rank");
     }
 
-    selector(std::array<int, rank> count) : count(count)
+    selector(std::array<int, rank> shape)
     {
         for (int n = 0; n < rank; ++n)
         {
+            count[n] = shape[n];
             start[n] = 0;
             final[n] = count[n];
             skips[n] = 1;
@@ -92,10 +116,10 @@ struct nd::selector
     }
 
     selector(
-        std::array<int, rank> count,
-        std::array<int, rank> start,
-        std::array<int, rank> final,
-        std::array<int, rank> skips)
+        std::array<std::ptrdiff_t, rank> count,
+        std::array<std::ptrdiff_t, rank> start,
+        std::array<std::ptrdiff_t, rank> final,
+        std::array<std::ptrdiff_t, rank> skips)
     : count(count)
     , start(start)
     , final(final)
@@ -161,10 +185,10 @@ struct nd::selector
 
     selector<rank, axis + 1> skip(int skips_index) const
     {
-        return select(std::make_tuple(start[axis], final[axis], skips_index));
+        return slice(start[axis], final[axis], skips_index);
     }
 
-    selector<rank, axis + 1> slice(int lower_index, int upper_index, int skips_index) const
+    selector<rank, axis + 1> slice(std::ptrdiff_t lower_index, std::ptrdiff_t upper_index, int skips_index) const
     {
         static_assert(axis < rank, "selector: cannot select on axis greater than or equal to rank");
         auto res = selector<rank, axis + 1> { count,  start, final, skips };
@@ -238,14 +262,15 @@ struct nd::selector
         return {count, start, final, skips};
     }
 
-    std::array<int, rank> strides() const
+    std::array<std::ptrdiff_t, rank> strides() const
     {
-        std::array<int, rank> s;
-        s[rank - 1] = 1;
+        std::array<std::ptrdiff_t, rank> s;
+        std::ptrdiff_t stride = 1;
 
-        for (int n = rank - 2; n >= 0; --n)
+        for (int n = rank - 1; n >= 0; --n)
         {
-            s[n] = s[n + 1] * count[n + 1];
+            s[n] = stride;
+            stride *= count[n];
         }
         return s;
     }
@@ -263,7 +288,7 @@ struct nd::selector
 
     int shape(int axis) const
     {
-        return final[axis] / skips[axis] - start[axis] / skips[axis];
+        return int((final[axis] - start[axis] + skips[axis] - 1) / skips[axis]);
     }
 
     bool empty() const
@@ -293,7 +318,7 @@ struct nd::selector
     std::size_t size() const
     {
         auto s = shape();
-        return std::accumulate(s.begin(), s.end(), 1, std::multiplies<int>());
+        return std::accumulate(s.begin(), s.end(), std::size_t(1), std::multiplies<std::size_t>());
     }
 
     bool operator==(const selector<rank, axis>& other) const
@@ -312,7 +337,7 @@ struct nd::selector
         skips != other.skips;
     }
 
-    bool next(std::array<int, rank>& index) const
+    bool next(std::array<std::ptrdiff_t, rank>& index) const
     {
         int n = rank - 1;
 
@@ -334,6 +359,155 @@ struct nd::selector
         return true;
     }
 
+    bool prev(std::array<std::ptrdiff_t, rank>& index) const
+    {
+        if (index == final)
+        {
+            index = last();
+            return true;
+        }
+        int n = rank - 1;
+
+        while (index[n] == start[n])
+        {
+            if (n == 0)
+            {
+                return false;
+            }
+            index[n] = start[n] + (shape(n) - 1) * skips[n];
+            --n;
+        }
+        index[n] -= skips[n];
+        return true;
+    }
+
+    /**
+     * Returns the index of the last element visited on each axis.
+     */
+    std::array<std::ptrdiff_t, rank> last() const
+    {
+        auto index = start;
+
+        for (int n = 0; n < rank; ++n)
+        {
+            index[n] += (shape(n) - 1) * skips[n];
+        }
+        return index;
+    }
+
+    /**
+     * Returns the index visited at the given position of the iteration,
+     * which is final if the position is size() or more.
+     */
+    std::array<std::ptrdiff_t, rank> index_at(std::size_t position) const
+    {
+        if (position >= size())
+        {
+            return final;
+        }
+        auto index = start;
+
+        for (int n = rank - 1; n >= 0; --n)
+        {
+            auto s = std::size_t(shape(n));
+            index[n] += std::ptrdiff_t(position % s) * skips[n];
+            position /= s;
+        }
+        return index;
+    }
+
+    /**
+     * Returns a selector visiting the same memory offsets in the same order,
+     * with adjacent axes merged wherever detail::coalesce_axes would merge
+     * them for the selector's memory strides. Each merged axis counts the
+     * original axes it spans, so offsets are unchanged. Leftover leading
+     * axes have a count of 1.
+     */
+    selector<rank> coalesce() const
+    {
+        if (size() == 0)
+        {
+            return reset();
+        }
+        auto dims = shape();
+        auto rows = strides();
+        auto steps = std::array<std::array<std::ptrdiff_t, rank>, 1>();
+        auto outer = std::array<int, rank>();
+
+        for (int n = 0; n < rank; ++n)
+        {
+            steps[0][n] = skips[n] * rows[n];
+        }
+        auto first = rank - detail::coalesce_axes<rank>(dims, steps, &outer);
+        auto result = selector<rank>();
+
+        for (int k = 0; k < rank; ++k)
+        {
+            auto lower = k == first ? 0 : outer[k];
+            auto upper = k == rank - 1 ? rank - 1 : outer[k + 1] - 1;
+
+            result.count[k] = 1;
+            result.start[k] = 0;
+            result.final[k] = 1;
+            result.skips[k] = 1;
+
+            if (k < first)
+            {
+                continue;
+            }
+            for (int n = lower; n <= upper; ++n)
+            {
+                result.count[k] *= count[n];
+                result.start[k] += start[n] * rows[n] / rows[upper];
+            }
+            result.skips[k] = steps[0][k] / rows[upper];
+            result.final[k] = std::min(result.start[k] + dims[k] * result.skips[k], result.count[k]);
+        }
+        return result;
+    }
+
+    /**
+     * Visits the selected elements as runs along the last axis, calling
+     * function(std::ptrdiff_t offset, std::size_t length, std::ptrdiff_t
+     * stride) for each, where offsets are into row-major memory of the
+     * selector's count. Axes are coalesced first, so a contiguous selector,
+     * or a block of whole rows, is a single run.
+     */
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        if (size() == 0)
+        {
+            return;
+        }
+        auto sel = coalesce();
+        auto memory_strides = sel.strides();
+        auto index = sel.start;
+
+        while (true)
+        {
+            std::ptrdiff_t m = 0;
+
+            for (int n = 0; n < rank; ++n)
+            {
+                m += index[n] * memory_strides[n];
+            }
+            function(m, std::size_t(sel.shape(rank - 1)), sel.skips[rank - 1]);
+
+            int n = rank - 2;
+
+            while (n >= 0 && (index[n] += sel.skips[n]) >= sel.final[n])
+            {
+                index[n] = sel.start[n];
+                --n;
+            }
+            if (n < 0)
+            {
+                break;
+            }
+        }
+    }
+
     template<typename... Index>
     bool contains(Index... index) const
     {
@@ -346,7 +520,7 @@ struct nd::selector
             auto start_index = std::get<0>(S[n]);
             auto final_index = std::get<1>(S[n]);
 
-            if (start_index < 0 || final_index > final[n] / skips[n] - start[n] / skips[n])
+            if (start_index < 0 || final_index > shape(n))
             {
                 return false;
             }
@@ -357,7 +531,7 @@ struct nd::selector
     selector<rank, axis> shift(int dist) const
     {
         auto sel = *this;
-        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], 0);
+        sel.start[axis] = std::max(sel.start[axis] + dist * skips[axis], std::ptrdiff_t(0));
         sel.final[axis] = std::min(sel.final[axis] + dist * skips[axis], sel.count[axis]);
         return sel;
     }
@@ -369,29 +543,49 @@ struct nd::selector
     class iterator
     {
     public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::array<std::ptrdiff_t, rank>;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+        using iterator_category = std::random_access_iterator_tag;
+
         iterator() {}
-        iterator(selector<rank> sel, std::array<int, rank> ind) : sel(sel), ind(ind) {}
-        iterator& operator++() { sel.next(ind); return *this; }
+        iterator(selector<rank> sel, std::size_t position) : sel(sel), ind(sel.index_at(position)), position(position) {}
+        iterator& operator++() { sel.next(ind); ++position; return *this; }
+        iterator& operator--() { sel.prev(ind); --position; return *this; }
         iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
-        bool operator==(iterator other) const { return ind == other.ind; }
-        bool operator!=(iterator other) const { return ind != other.ind; }
-        const std::array<int, rank>& operator*() const { return ind; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { position += n; ind = sel.index_at(position); return *this; }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return difference_type(position - other.position); }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return position == other.position; }
+        bool operator!=(const iterator& other) const { return position != other.position; }
+        bool operator< (const iterator& other) const { return position <  other.position; }
+        bool operator> (const iterator& other) const { return position >  other.position; }
+        bool operator<=(const iterator& other) const { return position <= other.position; }
+        bool operator>=(const iterator& other) const { return position >= other.position; }
+        const std::array<std::ptrdiff_t, rank>& operator*() const { return ind; }
+        std::array<std::ptrdiff_t, rank> operator[](difference_type n) const { return *(*this + n); }
     private:
         selector<rank> sel;
-        std::array<int, rank> ind;
+        std::array<std::ptrdiff_t, rank> ind;
+        std::size_t position = 0;
     };
 
-    iterator begin() const { return {reset(), start}; }
-    iterator end() const { return {reset(), final}; }
+    iterator begin() const { return {reset(), 0}; }
+    iterator end() const { return {reset(), size()}; }
 
 
 
 
     // ========================================================================
-    std::array<int, rank> count;
-    std::array<int, rank> start;
-    std::array<int, rank> final;
-    std::array<int, rank> skips;
+    std::array<std::ptrdiff_t, rank> count;
+    std::array<std::ptrdiff_t, rank> start;
+    std::array<std::ptrdiff_t, rank> final;
+    std::array<std::ptrdiff_t, rank> skips;
 
 
 
@@ -399,13 +593,80 @@ struct nd::selector
     // ========================================================================
     template<int other_rank, int other_axis>
     friend struct selector;
-}; // ND_IMPL_END
+};
+
+
+
+
+// ============================================================================
+template<int R, std::size_t N>
+int nd::detail::coalesce_axes(std::array<int, R>& shape, std::array<std::array<std::ptrdiff_t, R>, N>& strides, std::array<int, R>* outer)
+{
+    auto merged = std::array<int, R>();
+
+    for (int n = 0; n < R; ++n)
+    {
+        merged[n] = n;
+    }
+    if (outer)
+    {
+        *outer = merged;
+    }
+    if (R <= 1 || std::find(shape.begin(), shape.end(), 0) != shape.end())
+    {
+        return R;
+    }
+    int m = R - 1;
+
+    for (int n = R - 2; n >= 0; --n)
+    {
+        auto mergeable = std::ptrdiff_t(shape[n]) * shape[m] <= std::numeric_limits<int>::max();
+
+        for (std::size_t k = 0; k < N && mergeable; ++k)
+        {
+            mergeable = strides[k][n] == shape[m] * strides[k][m];
+        }
+
+        if (shape[n] == 1)
+        {
+            continue;
+        }
+        else if (shape[m] == 1)
+        {
+            shape[m] = shape[n];
+            for (auto& s : strides) s[m] = s[n];
+        }
+        else if (mergeable)
+        {
+            shape[m] *= shape[n];
+        }
+        else
+        {
+            --m;
+            shape[m] = shape[n];
+            for (auto& s : strides) s[m] = s[n];
+        }
+        merged[m] = n;
+    }
+    for (int n = 0; n < m; ++n)
+    {
+        shape[n] = 1;
+        merged[n] = n;
+        for (auto& s : strides) s[n] = 0;
+    }
+    if (outer)
+    {
+        *outer = merged;
+    }
+    return R - m;
+} // ND_IMPL_END
 
 
 
 
 // ============================================================================
 #ifdef TEST_SELECTOR
+#include <vector>
 #include "catch.hpp"
 using namespace nd;
 
@@ -413,13 +674,24 @@ using namespace nd;
 TEST_CASE("selector<3> does construct and compare correctly", "[selector]")
 {
     auto S = selector<3>(10, 12, 14);
-    CHECK(S.strides() == std::array<int, 3>{168, 14, 1});
+    CHECK(S.strides() == std::array<std::ptrdiff_t, 3>{168, 14, 1});
     CHECK(S.shape() == std::array<int, 3>{10, 12, 14});
     CHECK(S == S.select(std::make_tuple(0, 10, 1)).on<0>());
     CHECK(S != S.select(std::make_tuple(0, 10, 2)).on<0>());
 }
 
 
+TEST_CASE("selector<3> indexes arrays with more than 2^31 elements", "[selector]")
+{
+    auto _ = axis::all();
+    auto S = selector<3>(2048, 2048, 2048);
+    CHECK(S.size() == std::size_t(1) << 33);
+    CHECK(S.strides()[0] == std::ptrdiff_t(1) << 22);
+    CHECK(S.select(2047).start[0] == std::ptrdiff_t(2047) << 11);
+    CHECK(S.select(_, 2047, 2047).final[0] == (std::ptrdiff_t(2048) << 22) + (std::ptrdiff_t(2047) << 11) + 2047);
+}
+
+
 TEST_CASE("make_selector works correctly", "[make_selector]")
 {
     auto _ = axis::all();
@@ -437,64 +709,64 @@ TEST_CASE("selector<2> does select-collapse operations correctly", "[selector::s
 
     SECTION("Selections collapsing axis 0 @ i = 0 have the correct count, stride, and shape")
     {
-        CHECK(S.select(0, std::make_tuple(0, 4)).count     == std::array<int, 1>{12});
-        CHECK(S.select(0, std::make_tuple(0, 4)).start     == std::array<int, 1>{0});
-        CHECK(S.select(0, std::make_tuple(0, 4)).final     == std::array<int, 1>{4});
-        CHECK(S.select(0, std::make_tuple(0, 4)).strides() == std::array<int, 1>{1});
+        CHECK(S.select(0, std::make_tuple(0, 4)).count     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(0, std::make_tuple(0, 4)).start     == std::array<std::ptrdiff_t, 1>{0});
+        CHECK(S.select(0, std::make_tuple(0, 4)).final     == std::array<std::ptrdiff_t, 1>{4});
+        CHECK(S.select(0, std::make_tuple(0, 4)).strides() == std::array<std::ptrdiff_t, 1>{1});
         CHECK(S.select(0, std::make_tuple(0, 4)).shape()   == std::array<int, 1>{4});
     }
 
     SECTION("Selections collapsing axis 0 @ i = 1 have the correct count, stride, and shape")
     {
-        CHECK(S.select(1, std::make_tuple(0, 4)).count     == std::array<int, 1>{12});
-        CHECK(S.select(1, std::make_tuple(0, 4)).start     == std::array<int, 1>{4});
-        CHECK(S.select(1, std::make_tuple(0, 4)).final     == std::array<int, 1>{8});
-        CHECK(S.select(1, std::make_tuple(0, 4)).skips     == std::array<int, 1>{1});
+        CHECK(S.select(1, std::make_tuple(0, 4)).count     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(1, std::make_tuple(0, 4)).start     == std::array<std::ptrdiff_t, 1>{4});
+        CHECK(S.select(1, std::make_tuple(0, 4)).final     == std::array<std::ptrdiff_t, 1>{8});
+        CHECK(S.select(1, std::make_tuple(0, 4)).skips     == std::array<std::ptrdiff_t, 1>{1});
         CHECK(S.select(1, std::make_tuple(0, 4)).shape()   == std::array<int, 1>{4});
     }
 
     SECTION("Selections collapsing a subset of axis 0 @ i = 0 have the correct count, stride, and shape")
     {
-        CHECK(S.select(0, std::make_tuple(0, 2)).count     == std::array<int, 1>{12});
-        CHECK(S.select(0, std::make_tuple(0, 2)).start     == std::array<int, 1>{0});
-        CHECK(S.select(0, std::make_tuple(0, 2)).final     == std::array<int, 1>{2});
-        CHECK(S.select(0, std::make_tuple(0, 2)).skips     == std::array<int, 1>{1});
+        CHECK(S.select(0, std::make_tuple(0, 2)).count     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(0, std::make_tuple(0, 2)).start     == std::array<std::ptrdiff_t, 1>{0});
+        CHECK(S.select(0, std::make_tuple(0, 2)).final     == std::array<std::ptrdiff_t, 1>{2});
+        CHECK(S.select(0, std::make_tuple(0, 2)).skips     == std::array<std::ptrdiff_t, 1>{1});
         CHECK(S.select(0, std::make_tuple(0, 2)).shape()   == std::array<int, 1>{2});
     }
 
     SECTION("Selections collapsing axis 1 at j = 0 have the correct count, stride, and shape")
     {
-        CHECK(S.select(std::make_tuple(0, 3), 0).count     == std::array<int, 1>{12});
-        CHECK(S.select(std::make_tuple(0, 3), 0).start     == std::array<int, 1>{0});
-        CHECK(S.select(std::make_tuple(0, 3), 0).final     == std::array<int, 1>{12});
-        CHECK(S.select(std::make_tuple(0, 3), 0).skips     == std::array<int, 1>{4});
+        CHECK(S.select(std::make_tuple(0, 3), 0).count     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(std::make_tuple(0, 3), 0).start     == std::array<std::ptrdiff_t, 1>{0});
+        CHECK(S.select(std::make_tuple(0, 3), 0).final     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(std::make_tuple(0, 3), 0).skips     == std::array<std::ptrdiff_t, 1>{4});
         CHECK(S.select(std::make_tuple(0, 3), 0).shape()   == std::array<int, 1>{3});
     }
 
     SECTION("Selections collapsing axis 1 at j = 1 have the correct count, stride, and shape")
     {
-        CHECK(S.select(std::make_tuple(0, 3), 1).count     == std::array<int, 1>{12}); // [1, 5, 9, 13)
-        CHECK(S.select(std::make_tuple(0, 3), 1).start     == std::array<int, 1>{1});
-        CHECK(S.select(std::make_tuple(0, 3), 1).final     == std::array<int, 1>{13});
-        CHECK(S.select(std::make_tuple(0, 3), 1).skips     == std::array<int, 1>{4});
+        CHECK(S.select(std::make_tuple(0, 3), 1).count     == std::array<std::ptrdiff_t, 1>{12}); // [1, 5, 9, 13)
+        CHECK(S.select(std::make_tuple(0, 3), 1).start     == std::array<std::ptrdiff_t, 1>{1});
+        CHECK(S.select(std::make_tuple(0, 3), 1).final     == std::array<std::ptrdiff_t, 1>{13});
+        CHECK(S.select(std::make_tuple(0, 3), 1).skips     == std::array<std::ptrdiff_t, 1>{4});
         CHECK(S.select(std::make_tuple(0, 3), 1).shape()   == std::array<int, 1>{3});
     }
 
     SECTION("Selections collapsing a subset of axis 1 at j = 0 have the correct count, stride, and shape")
     {
-        CHECK(S.select(std::make_tuple(0, 2), 0).count     == std::array<int, 1>{12});
-        CHECK(S.select(std::make_tuple(0, 2), 0).start     == std::array<int, 1>{0});
-        CHECK(S.select(std::make_tuple(0, 2), 0).final     == std::array<int, 1>{8});
-        CHECK(S.select(std::make_tuple(0, 2), 0).skips     == std::array<int, 1>{4});
+        CHECK(S.select(std::make_tuple(0, 2), 0).count     == std::array<std::ptrdiff_t, 1>{12});
+        CHECK(S.select(std::make_tuple(0, 2), 0).start     == std::array<std::ptrdiff_t, 1>{0});
+        CHECK(S.select(std::make_tuple(0, 2), 0).final     == std::array<std::ptrdiff_t, 1>{8});
+        CHECK(S.select(std::make_tuple(0, 2), 0).skips     == std::array<std::ptrdiff_t, 1>{4});
         CHECK(S.select(std::make_tuple(0, 2), 0).shape()   == std::array<int, 1>{2});
     }
 
     SECTION("Selections collapsing only axis 0 have the correct count, stride, and shape")
     {
-        CHECK(S.select(0).count == std::array<int, 1>{3 * 4});
-        CHECK(S.select(0).start == std::array<int, 1>{0});
-        CHECK(S.select(0).final == std::array<int, 1>{4});
-        CHECK(S.select(0).strides() == std::array<int, 1>{1});
+        CHECK(S.select(0).count == std::array<std::ptrdiff_t, 1>{3 * 4});
+        CHECK(S.select(0).start == std::array<std::ptrdiff_t, 1>{0});
+        CHECK(S.select(0).final == std::array<std::ptrdiff_t, 1>{4});
+        CHECK(S.select(0).strides() == std::array<std::ptrdiff_t, 1>{1});
         CHECK(S.select(0).shape()   == std::array<int, 1>{4});
     }
 }
@@ -544,6 +816,21 @@ TEST_CASE("selector<1> selects correctly with skip applied multiple times", "[se
 }
 
 
+TEST_CASE("selector shape counts every element visited by next", "[selector::skip]")
+{
+    auto _ = axis::all();
+    auto S = selector<2>(3, 5).select(_, _|0|5|2);
+    auto I = S.start;
+    auto n = std::size_t(1);
+
+    while (S.next(I))
+        ++n;
+
+    CHECK(S.shape() == std::array<int, 2>{3, 3});
+    CHECK(S.size() == n);
+}
+
+
 TEST_CASE("selector<4> skips on all dimensions correctly", "[selector::skip]")
 {
     auto S = selector<4>(2, 4, 6, 8);
@@ -554,7 +841,7 @@ TEST_CASE("selector<4> skips on all dimensions correctly", "[selector::skip]")
 TEST_CASE("selector<1> next advances properly", "[selector::next]")
 {
     auto S = selector<1>(10);
-    auto I = std::array<int, 1>{0};
+    auto I = std::array<std::ptrdiff_t, 1>{0};
     auto i = 0;
 
     do {
@@ -567,7 +854,7 @@ TEST_CASE("selector<1> next advances properly", "[selector::next]")
 TEST_CASE("selector<2> next advances properly", "[selector::next]")
 {
     auto S = selector<2>(10, 10);
-    auto I = std::array<int, 2>{0, 0};
+    auto I = std::array<std::ptrdiff_t, 2>{0, 0};
     auto i = 0;
     auto j = 0;
 
@@ -587,7 +874,7 @@ TEST_CASE("selector<2> next advances properly", "[selector::next]")
 TEST_CASE("selector<2> subset iterator passes sanity checks", "[selector::iterator]")
 {
     auto S = selector<2>(10, 10).slice(2, 8, 1).slice(4, 6, 1);    
-    auto I = std::array<int, 2>{2, 4};
+    auto I = std::array<std::ptrdiff_t, 2>{2, 4};
 
     for (auto index : S)
     {
@@ -597,6 +884,86 @@ TEST_CASE("selector<2> subset iterator passes sanity checks", "[selector::iterat
 }
 
 
+TEST_CASE("selector<2> iterator is random access", "[selector::iterator]")
+{
+    auto S = selector<2>(10, 10).slice(2, 8, 2).slice(4, 7, 1);
+    auto first = S.begin();
+    auto last = S.end();
+
+    CHECK(last - first == 9);
+    CHECK(*(first + 4) == std::array<std::ptrdiff_t, 2>{4, 5});
+    CHECK(*(last - 1) == std::array<std::ptrdiff_t, 2>{6, 6});
+    CHECK(*--(first + 3) == std::array<std::ptrdiff_t, 2>{2, 6});
+    CHECK(*--last == *(first + 8));
+    CHECK(first + 9 == S.end());
+}
+
+
+TEST_CASE("selector visits its elements as runs along the last axis", "[selector::for_each_run]")
+{
+    auto runs = std::vector<std::array<std::ptrdiff_t, 3>>();
+    auto record = [&runs] (std::ptrdiff_t offset, std::size_t length, std::ptrdiff_t stride)
+    {
+        runs.push_back({offset, std::ptrdiff_t(length), stride});
+    };
+
+    selector<2>(4, 5).for_each_run(record);
+    CHECK(runs == std::vector<std::array<std::ptrdiff_t, 3>>{{0, 20, 1}});
+
+    runs.clear();
+    selector<2>(4, 5).slice(1, 4, 2).slice(1, 5, 2).for_each_run(record);
+    CHECK(runs == std::vector<std::array<std::ptrdiff_t, 3>>{{6, 2, 2}, {16, 2, 2}});
+}
+
+
+TEST_CASE("selector coalesces mergeable axes", "[selector::coalesce]")
+{
+    auto _ = axis::all();
+    auto S = selector<3>(4, 5, 6);
+
+    CHECK(S.coalesce().shape() == std::array<int, 3>{1, 1, 120});
+    CHECK(S.select(_|1|3, _, _).coalesce().shape() == std::array<int, 3>{1, 1, 60});
+    CHECK(S.select(_|1|3, _, _).coalesce().start[2] == 30);
+    CHECK(S.select(_, _|1|3, _).coalesce().shape() == std::array<int, 3>{1, 4, 12});
+    CHECK(S.select(_, _, _|0|6|2).coalesce().shape() == std::array<int, 3>{1, 1, 60});
+    CHECK(S.select(_, _, _|0|6|2).coalesce().skips[2] == 2);
+    CHECK(S.select(_|0|4|2, _, _|0|6|3).coalesce().shape() == std::array<int, 3>{1, 2, 10});
+
+    auto offsets = [] (selector<3> sel)
+    {
+        auto result = std::vector<std::ptrdiff_t>();
+
+        for (auto index : sel)
+            result.push_back(index[0] * sel.strides()[0] + index[1] * sel.strides()[1] + index[2]);
+
+        return result;
+    };
+    CHECK(offsets(S.select(_|0|4|2, _, _|0|6|3).coalesce()) == offsets(S.select(_|0|4|2, _, _|0|6|3).reset()));
+    CHECK(offsets(S.select(_|1|3, _|2|3, _|1|6|2).reset().coalesce()) == offsets(S.select(_|1|3, _|2|3, _|1|6|2).reset()));
+    CHECK(S.select(_, _|0|5|2, _|0|6|2).coalesce() == S.select(_, _|0|5|2, _|0|6|2).reset());
+    CHECK(S.slice(2, 3, 1).coalesce().shape() == std::array<int, 3>{1, 1, 30});
+    CHECK(S.slice(2, 3, 1).coalesce().start[2] == 60);
+}
+
+
+TEST_CASE("coalesce_axes merges axes every layout can traverse as one", "[selector::coalesce]")
+{
+    auto shape = std::array<int, 3>{4, 5, 6};
+    auto strides = std::array<std::array<std::ptrdiff_t, 3>, 2>{{{60, 6, 1}, {30, 6, 1}}};
+
+    CHECK(detail::coalesce_axes<3>(shape, strides) == 2);
+    CHECK(shape == std::array<int, 3>{1, 4, 30});
+    CHECK(strides[0] == std::array<std::ptrdiff_t, 3>{0, 60, 1});
+    CHECK(strides[1] == std::array<std::ptrdiff_t, 3>{0, 30, 1});
+
+    shape = {4, 1, 6};
+    strides = {{{6, 100, 1}, {12, 0, 2}}};
+    CHECK(detail::coalesce_axes<3>(shape, strides) == 1);
+    CHECK(shape == std::array<int, 3>{1, 1, 24});
+    CHECK(strides[1][2] == 2);
+}
+
+
 TEST_CASE("selector can be shifed", "[selector::shift]")
 {
     CHECK(selector<2>(10, 5).on<0>().shift(+2).shape()[0] ==  8);
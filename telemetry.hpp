@@ -0,0 +1,695 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <typeinfo>
+#include <typeindex>
+#include <cstdio>
+#include <cstdlib>
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    struct allocation_stats;
+    class telemetry;
+    class telemetry_scope;
+    class allocation_guard;
+    template<typename T> struct dtype_str;
+
+    namespace detail
+    {
+        template<typename T, typename = void> struct dtype_label;
+        struct telemetry_record;
+        class operation_label;
+        template<typename T> struct object_allocator;
+    }
+
+/**
+ * Operations which may allocate (copies, expression temporaries, reshapes of
+ * non-contiguous views, copy-on-write separation, and so on) label
+ * themselves, so that an allocation_guard can say which one allocated. The
+ * labels cost a thread-local store per operation, and are compiled in
+ * unless NDEBUG is defined; define ND_TRACE_ALLOCATIONS to keep them in
+ * release builds.
+ */
+#if ! defined(NDEBUG) || defined(ND_TRACE_ALLOCATIONS)
+#define ND_OPERATION(name) nd::detail::operation_label nd_operation_label(name)
+#else
+#define ND_OPERATION(name)
+#endif
+} // ND_API_END
+
+
+
+
+// ============================================================================
+struct nd::allocation_stats // ND_IMPL_START
+{
+    /**
+     * A snapshot of the allocation counters, either for a single dtype or
+     * summed over all of them. Bin n of the histogram counts allocations of
+     * between 2^n and 2^(n+1) - 1 bytes (bin 0 also counts empty ones).
+     */
+    std::string dtype;
+    std::size_t live_bytes = 0;
+    std::size_t peak_bytes = 0;
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+    std::size_t allocated_bytes = 0;
+    std::array<std::size_t, 64> histogram = {};
+};
+
+
+
+
+// ============================================================================
+/**
+ * This block can be expanded to accommodate new data types. Note: gcc requires
+ * these template specializations to be declared directly inside the namespace.
+ */
+namespace nd {
+  template<> struct dtype_str<bool  > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<float > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<double> { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<int   > { static inline std::array<char, 8> value(); };
+  template<> struct dtype_str<long  > { static inline std::array<char, 8> value(); };
+
+  std::array<char, 8> dtype_str<bool  >::value() { return {'b','1',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<float >::value() { return {'f','4',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<double>::value() { return {'f','8',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<int   >::value() { return {'i','4',  0,  0,  0,  0,  0,  0}; }
+  std::array<char, 8> dtype_str<long  >::value() { return {'i','8',  0,  0,  0,  0,  0,  0}; }
+}
+
+
+
+
+// ============================================================================
+/**
+ * The name telemetry reports for a dtype: its dtype_str where one is
+ * declared, so labels match the dumps header, or else the compiler's name
+ * for the type. The string lives in a function-local static, so looking it
+ * up never allocates.
+ */
+namespace nd {
+  namespace detail {
+    template<typename T, typename>
+    struct dtype_label
+    {
+        static const char* name() { return typeid(T).name(); }
+    };
+
+    template<typename T>
+    struct dtype_label<T, decltype(void(dtype_str<T>::value()))>
+    {
+        static const char* name()
+        {
+            static const auto str = dtype_str<T>::value();
+            return str.data();
+        }
+    };
+  }
+}
+
+
+
+
+// ============================================================================
+struct nd::detail::telemetry_record
+{
+    telemetry_record(const std::type_info& type, const char* name) : type(type), name(name) {}
+
+    void allocated(std::size_t bytes)
+    {
+        auto live = live_bytes += bytes;
+        auto peak = peak_bytes.load(std::memory_order_relaxed);
+
+        while (live > peak && ! peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        histogram[bin(bytes)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void deallocated(std::size_t bytes)
+    {
+        live_bytes -= bytes;
+        deallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        peak_bytes = live_bytes.load();
+        allocations = 0;
+        deallocations = 0;
+        allocated_bytes = 0;
+
+        for (auto& count : histogram)
+        {
+            count = 0;
+        }
+    }
+
+    void add_to(allocation_stats& stats) const
+    {
+        stats.live_bytes      += live_bytes;
+        stats.peak_bytes      += peak_bytes;
+        stats.allocations     += allocations;
+        stats.deallocations   += deallocations;
+        stats.allocated_bytes += allocated_bytes;
+
+        for (std::size_t n = 0; n < histogram.size(); ++n)
+        {
+            stats.histogram[n] += histogram[n];
+        }
+    }
+
+    static std::size_t bin(std::size_t bytes)
+    {
+        std::size_t n = 0;
+        while (bytes >>= 1)
+        {
+            ++n;
+        }
+        return n;
+    }
+
+    std::type_index type;
+    const char* name;
+    std::atomic<std::size_t> live_bytes {0};
+    std::atomic<std::size_t> peak_bytes {0};
+    std::atomic<std::size_t> allocations {0};
+    std::atomic<std::size_t> deallocations {0};
+    std::atomic<std::size_t> allocated_bytes {0};
+    std::array<std::atomic<std::size_t>, 64> histogram = {};
+};
+
+
+
+
+// ============================================================================
+class nd::telemetry_scope
+{
+public:
+
+    /**
+     * Measures the buffer allocations made by the current thread while the
+     * scope is alive, whether or not global telemetry is enabled. Scopes may
+     * be nested; each one sees the allocations of the scopes inside it. The
+     * net bytes can go negative if the region frees memory that was allocated
+     * before it began.
+     */
+    telemetry_scope() : parent(current())
+    {
+        current() = this;
+    }
+
+    ~telemetry_scope()
+    {
+        current() = parent;
+    }
+
+    telemetry_scope(const telemetry_scope&) = delete;
+    telemetry_scope& operator=(const telemetry_scope&) = delete;
+
+    std::size_t allocations() const { return num_allocations; }
+    std::size_t deallocations() const { return num_deallocations; }
+    std::size_t allocated_bytes() const { return bytes_allocated; }
+    std::ptrdiff_t net_bytes() const { return bytes_net; }
+    std::ptrdiff_t peak_bytes() const { return bytes_peak; }
+
+private:
+    friend class telemetry;
+
+    static telemetry_scope*& current()
+    {
+        static thread_local telemetry_scope* scope = nullptr;
+        return scope;
+    }
+
+    telemetry_scope* parent = nullptr;
+    std::size_t num_allocations = 0;
+    std::size_t num_deallocations = 0;
+    std::size_t bytes_allocated = 0;
+    std::ptrdiff_t bytes_net = 0;
+    std::ptrdiff_t bytes_peak = 0;
+};
+
+
+
+
+// ============================================================================
+class nd::detail::operation_label
+{
+public:
+
+    /**
+     * Names the library operation in progress on this thread, for the
+     * duration of the label's scope. The innermost label wins.
+     */
+    operation_label(const char* name) : parent(current())
+    {
+        current() = name;
+    }
+
+    ~operation_label()
+    {
+        current() = parent;
+    }
+
+    operation_label(const operation_label&) = delete;
+    operation_label& operator=(const operation_label&) = delete;
+
+    static const char*& current()
+    {
+        static thread_local const char* name = nullptr;
+        return name;
+    }
+
+private:
+    const char* parent;
+};
+
+
+
+
+// ============================================================================
+class nd::allocation_guard
+{
+public:
+
+    /**
+     * Marks a region of code which must not allocate buffers: a real-time
+     * path or a solver's inner iteration. Every heap allocation the library
+     * makes on the current thread while the guard is alive is counted, along
+     * with the name of the operation that made it (see ND_OPERATION). That
+     * includes the buffer objects and reference counts behind new arrays and
+     * copy-on-write copies, as well as their elements. With the abort
+     * policy, the first such allocation instead prints a report to stderr
+     * and calls std::abort, so that violations fail loudly in tests.
+     * Allocations served by a scratch_scope are counted too. Guards may be
+     * nested; each one sees the allocations made inside it.
+     */
+    enum class policy { count, abort };
+
+    explicit allocation_guard(policy action = policy::count)
+    : action(action)
+    , parent(current())
+    {
+        names.reserve(max_operations);
+        current() = this;
+    }
+
+    ~allocation_guard()
+    {
+        current() = parent;
+    }
+
+    allocation_guard(const allocation_guard&) = delete;
+    allocation_guard& operator=(const allocation_guard&) = delete;
+
+    std::size_t allocations() const { return num_allocations; }
+    std::size_t allocated_bytes() const { return bytes_allocated; }
+
+    /**
+     * The operation responsible for each allocation, in order. Allocations
+     * made outside a labelled operation (or with labels compiled out) are
+     * attributed to "nd::buffer". Room for max_operations names is reserved
+     * when the guard is created, so that the guard itself never allocates;
+     * allocations beyond that are counted but not named.
+     */
+    const std::vector<const char*>& operations() const { return names; }
+
+    static constexpr std::size_t max_operations = 64;
+
+private:
+    friend class telemetry;
+
+    static allocation_guard*& current()
+    {
+        static thread_local allocation_guard* guard = nullptr;
+        return guard;
+    }
+
+    static void allocated(std::size_t bytes, const char* dtype)
+    {
+        auto name = detail::operation_label::current() ? detail::operation_label::current() : "nd::buffer";
+
+        for (auto guard = current(); guard; guard = guard->parent)
+        {
+            if (guard->action == policy::abort)
+            {
+                std::fprintf(stderr, "nd::allocation_guard: %zu bytes (%s) allocated by %s\n", bytes, dtype, name);
+                std::abort();
+            }
+            guard->num_allocations += 1;
+            guard->bytes_allocated += bytes;
+
+            if (guard->names.size() < guard->names.capacity())
+            {
+                guard->names.push_back(name);
+            }
+        }
+    }
+
+    policy action;
+    allocation_guard* parent = nullptr;
+    std::size_t num_allocations = 0;
+    std::size_t bytes_allocated = 0;
+    std::vector<const char*> names;
+};
+
+
+
+
+// ============================================================================
+class nd::telemetry
+{
+public:
+
+    /**
+     * Process-wide counters of the memory allocated by nd::buffer, broken
+     * down by element type. Telemetry is off by default, and costs a single
+     * relaxed atomic load per allocation while it stays off. Memory that
+     * buffers merely wrap (adopted, borrowed, or memory-mapped) is not
+     * counted. Allocations made while telemetry is disabled are not counted
+     * when they are released either, so the live bytes never underflow.
+     */
+    static void enable(bool on = true)
+    {
+        flag() = on;
+    }
+
+    static void disable()
+    {
+        flag() = false;
+    }
+
+    static bool enabled()
+    {
+        return flag().load(std::memory_order_relaxed);
+    }
+
+    static allocation_stats total()
+    {
+        auto stats = allocation_stats();
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        stats.dtype = "*";
+
+        for (const auto& record : registry())
+        {
+            record.add_to(stats);
+        }
+
+        return stats;
+    }
+
+    template<typename T>
+    static allocation_stats of()
+    {
+        auto stats = allocation_stats();
+        stats.dtype = detail::dtype_label<T>::name();
+        record<T>().add_to(stats);
+        return stats;
+    }
+
+    static std::vector<allocation_stats> by_dtype()
+    {
+        auto result = std::vector<allocation_stats>();
+        std::lock_guard<std::mutex> lock(registry_mutex());
+
+        for (const auto& record : registry())
+        {
+            result.emplace_back();
+            result.back().dtype = record.name;
+            record.add_to(result.back());
+        }
+        return result;
+    }
+
+    /**
+     * Zeroes the counters and sets each peak to the current live bytes.
+     */
+    static void reset()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+
+        for (auto& record : registry())
+        {
+            record.reset();
+        }
+    }
+
+    /**
+     * Called by nd::buffer when it obtains or releases memory. The return
+     * value of allocated says whether the global counters recorded the
+     * allocation, and must be passed back to deallocated.
+     */
+    template<typename T>
+    static bool allocated(std::size_t bytes)
+    {
+        for (auto scope = telemetry_scope::current(); scope; scope = scope->parent)
+        {
+            scope->num_allocations += 1;
+            scope->bytes_allocated += bytes;
+            scope->bytes_net += std::ptrdiff_t(bytes);
+            scope->bytes_peak = std::max(scope->bytes_peak, scope->bytes_net);
+        }
+        if (allocation_guard::current())
+        {
+            allocation_guard::allocated(bytes, detail::dtype_label<T>::name());
+        }
+        if (enabled())
+        {
+            record<T>().allocated(bytes);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Called when the library allocates bookkeeping rather than elements: a
+     * buffer object with its reference count, or a snapshot registry
+     * growing. Only allocation guards see these, since they are not memory
+     * of any dtype.
+     */
+    static void allocated_object(std::size_t bytes, const char* what)
+    {
+        if (allocation_guard::current())
+        {
+            allocation_guard::allocated(bytes, what);
+        }
+    }
+
+    template<typename T>
+    static void deallocated(std::size_t bytes, bool recorded)
+    {
+        for (auto scope = telemetry_scope::current(); scope; scope = scope->parent)
+        {
+            scope->num_deallocations += 1;
+            scope->bytes_net -= std::ptrdiff_t(bytes);
+        }
+        if (recorded)
+        {
+            record<T>().deallocated(bytes);
+        }
+    }
+
+private:
+    static std::atomic<bool>& flag()
+    {
+        static std::atomic<bool> on {false};
+        return on;
+    }
+
+    static std::mutex& registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::deque<detail::telemetry_record>& registry()
+    {
+        static std::deque<detail::telemetry_record> records;
+        return records;
+    }
+
+    template<typename T>
+    static detail::telemetry_record& record()
+    {
+        static detail::telemetry_record& r = find_or_add(typeid(T), detail::dtype_label<T>::name());
+        return r;
+    }
+
+    static detail::telemetry_record& find_or_add(const std::type_info& type, const char* name)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+
+        for (auto& record : registry())
+        {
+            if (record.type == type)
+                return record;
+        }
+
+        registry().emplace_back(type, name);
+        return registry().back();
+    }
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::object_allocator
+{
+    /**
+     * Allocates buffer objects together with their reference counts, from
+     * operator new as std::make_shared would, reporting each allocation to
+     * the active allocation guards.
+     */
+
+    using value_type = T;
+
+    object_allocator() {}
+
+    template<typename U>
+    object_allocator(const object_allocator<U>&) {}
+
+    T* allocate(std::size_t count)
+    {
+        telemetry::allocated_object(count * sizeof(T), "nd::buffer object");
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+        ::operator delete(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const object_allocator<U>&) const { return true; }
+
+    template<typename U>
+    bool operator!=(const object_allocator<U>&) const { return false; }
+}; // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_TELEMETRY
+#include "catch.hpp"
+
+
+TEST_CASE("telemetry counts allocations by dtype", "[telemetry]")
+{
+    nd::telemetry::enable();
+    nd::telemetry::reset();
+
+    auto before = nd::telemetry::of<float>();
+    auto a = nd::telemetry::allocated<float>(4000);
+    auto b = nd::telemetry::allocated<float>(96);
+    auto now = nd::telemetry::of<float>();
+
+    REQUIRE(a);
+    REQUIRE(b);
+    REQUIRE(now.live_bytes == before.live_bytes + 4096);
+    REQUIRE(now.peak_bytes >= now.live_bytes);
+    REQUIRE(now.allocations == 2);
+    REQUIRE(now.histogram[11] == 1);
+    REQUIRE(now.histogram[6] == 1);
+
+    nd::telemetry::deallocated<float>(4000, a);
+    nd::telemetry::deallocated<float>(96, b);
+    auto after = nd::telemetry::of<float>();
+
+    REQUIRE(after.live_bytes == before.live_bytes);
+    REQUIRE(after.peak_bytes == before.live_bytes + 4096);
+    REQUIRE(after.deallocations == 2);
+    REQUIRE(after.allocated_bytes == 4096);
+    REQUIRE(nd::telemetry::total().allocated_bytes >= 4096);
+
+    auto dtypes = nd::telemetry::by_dtype();
+    REQUIRE(std::any_of(dtypes.begin(), dtypes.end(), [] (const nd::allocation_stats& s) { return s.dtype == "f4"; }));
+
+    nd::telemetry::disable();
+    REQUIRE_FALSE(nd::telemetry::allocated<float>(8));
+    REQUIRE(nd::telemetry::of<float>().allocations == 2);
+}
+
+
+TEST_CASE("telemetry_scope measures allocations in a region of code", "[telemetry]")
+{
+    nd::telemetry_scope outer;
+    {
+        nd::telemetry_scope inner;
+        nd::telemetry::allocated<int>(400);
+        nd::telemetry::allocated<int>(400);
+        REQUIRE(inner.allocations() == 2);
+        REQUIRE(inner.net_bytes() == 800);
+        nd::telemetry::deallocated<int>(400, false);
+        nd::telemetry::deallocated<int>(400, false);
+    }
+    nd::telemetry::deallocated<int>(40, false);
+
+    REQUIRE(outer.allocations() == 2);
+    REQUIRE(outer.deallocations() == 3);
+    REQUIRE(outer.allocated_bytes() == 800);
+    REQUIRE(outer.peak_bytes() == 800);
+    REQUIRE(outer.net_bytes() == -40);
+}
+
+
+
+TEST_CASE("allocation_guard reports allocations and the operations making them", "[telemetry] [guard]")
+{
+    nd::allocation_guard outer;
+    {
+        nd::allocation_guard inner;
+        nd::detail::operation_label outer_label("outer operation");
+        nd::telemetry::allocated<int>(400);
+        {
+            nd::detail::operation_label inner_label("inner operation");
+            nd::telemetry::allocated<int>(40);
+        }
+        REQUIRE(inner.allocations() == 2);
+        REQUIRE(inner.allocated_bytes() == 440);
+        REQUIRE(std::string(inner.operations().front()) == "outer operation");
+        REQUIRE(std::string(inner.operations().back()) == "inner operation");
+        nd::telemetry::deallocated<int>(400, false);
+        nd::telemetry::deallocated<int>(40, false);
+    }
+    nd::telemetry::allocated<int>(4);
+    nd::telemetry::deallocated<int>(4, false);
+
+    REQUIRE(outer.allocations() == 3);
+    REQUIRE(std::string(outer.operations().back()) == "nd::buffer");
+}
+
+
+TEST_CASE("allocation_guard does not allocate to record operations", "[telemetry] [guard]")
+{
+    auto limit = std::size_t(nd::allocation_guard::max_operations);
+    nd::allocation_guard guard;
+    auto names = guard.operations().data();
+
+    for (std::size_t n = 0; n < limit + 10; ++n)
+    {
+        nd::telemetry::allocated<int>(4);
+        nd::telemetry::deallocated<int>(4, false);
+    }
+    REQUIRE(guard.allocations() == limit + 10);
+    REQUIRE(guard.operations().size() == limit);
+    REQUIRE(guard.operations().data() == names);
+}
+
+#endif // TEST_TELEMETRY
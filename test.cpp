@@ -2,8 +2,26 @@
 #define TEST_BUFFER
 #define TEST_NDARRAY
 #define TEST_SHAPE
+#define TEST_ALLOCATOR
+#define TEST_MAPPED
+#define TEST_NUMA
+#define TEST_TELEMETRY
+#define TEST_VIEW
+#define TEST_PAGES
+#define TEST_GROWABLE
+#define TEST_SCRATCH
+#define TEST_GROUP
 
 #include "selector.hpp"
 #include "ndarray.hpp"
 #include "shape.hpp"
+#include "allocator.hpp"
 #include "buffer.hpp"
+#include "mapped.hpp"
+#include "numa.hpp"
+#include "telemetry.hpp"
+#include "view.hpp"
+#include "pages.hpp"
+#include "growable.hpp"
+#include "scratch.hpp"
+#include "group.hpp"
@@ -0,0 +1,652 @@
+#pragma once
+#include <array>
+#include <tuple>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <iterator>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+#include "shape.hpp"
+#include "selector.hpp"
+
+
+
+
+// ============================================================================
+namespace nd // ND_API_START
+{
+    template<typename T, int R> class ndarray_view;
+
+    namespace detail
+    {
+        template<typename... Index> constexpr int count_integral();
+        template<typename T> struct strided_run;
+
+        /**
+         * Visits same-shape views in lockstep, as runs along the last axis:
+         * function(length, strided_run<T>...) is called once per row, or
+         * once in all if every view is contiguous. Axes that every view can
+         * merge are coalesced first, so runs are as long as the layouts
+         * allow. The row pointers are recomputed from the outer index, which
+         * costs O(R) per run rather than per element.
+         */
+        template<int R, typename Function, typename... T>
+        static inline void for_each_run(Function function, const ndarray_view<T, R>&... views);
+
+        template<int R, typename Function, typename... T, std::size_t... I>
+        static inline void for_each_coalesced_run(Function function, std::index_sequence<I...>, const ndarray_view<T, R>&... views);
+    }
+} // ND_API_END
+
+
+
+
+// ============================================================================
+template<typename... Index> // ND_IMPL_START
+constexpr int nd::detail::count_integral()
+{
+    bool flags[] = {false, (std::is_integral<Index>::value || std::is_same<Index, axis::index>::value)...};
+    int count = 0;
+
+    for (auto flag : flags)
+        count += flag;
+
+    return count;
+}
+
+
+
+
+// ============================================================================
+template<typename T, int R>
+class nd::ndarray_view
+{
+public:
+
+    /**
+     * A non-owning, trivially copyable view of array data: a pointer to the
+     * first element, plus the shape and the element strides of each axis.
+     * Views are obtained from ndarray::view() (or built over raw memory), and
+     * are meant to be passed by value to kernels and worker threads. They do
+     * not keep the memory alive, they are not copy-on-write aware, and they
+     * perform no bounds checking. Use ndarray_view<const T, R> for read-only
+     * access; that is what const arrays give out.
+     */
+
+    using dtype = T;
+    enum { rank = R };
+
+    ndarray_view() {}
+
+    ndarray_view(T* data, std::array<int, R> shape, std::array<std::ptrdiff_t, R> strides)
+    : mem(data)
+    , dims(shape)
+    , steps(strides)
+    {
+    }
+
+    template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    ndarray_view(const ndarray_view<U, R>& other)
+    : mem(other.mem)
+    , dims(other.dims)
+    , steps(other.steps)
+    {
+    }
+
+
+
+
+    // ========================================================================
+    T* data() const { return mem; }
+    std::array<int, R> shape() const { return dims; }
+    int shape(int axis) const { return dims[axis]; }
+    std::array<std::ptrdiff_t, R> strides() const { return steps; }
+
+    std::size_t size() const
+    {
+        std::size_t s = 1;
+
+        for (int n = 0; n < R; ++n)
+            s *= dims[n];
+
+        return s;
+    }
+
+    /**
+     * Returns a view of the same elements, in the same row-major order, with
+     * adjacent axes merged wherever the memory layout allows (see
+     * detail::coalesce_axes). Its leading axes may have length 1.
+     */
+    ndarray_view<T, R> coalesced() const
+    {
+        auto result = *this;
+        auto strides = std::array<std::array<std::ptrdiff_t, R>, 1>{{steps}};
+        detail::coalesce_axes<R, 1>(result.dims, strides);
+        result.steps = strides[0];
+        return result;
+    }
+
+    bool contiguous() const
+    {
+        std::ptrdiff_t stride = 1;
+
+        for (int n = R - 1; n >= 0; --n)
+        {
+            if (dims[n] != 1 && steps[n] != stride)
+                return false;
+
+            stride *= dims[n];
+        }
+        return true;
+    }
+
+
+
+
+    // ========================================================================
+    template<typename... Index>
+    T& operator()(Index... index) const
+    {
+        static_assert(sizeof...(Index) == R, "ndarray_view: number of indexes must match rank");
+        const std::ptrdiff_t i[] = {0, std::ptrdiff_t(index)...};
+        std::ptrdiff_t m = 0;
+
+        for (int n = 0; n < R; ++n)
+            m += i[n + 1] * steps[n];
+
+        return mem[m];
+    }
+
+    template <int Rank = R, typename std::enable_if<Rank != 0>::type* = nullptr>
+    ndarray_view<T, R - 1> operator[](int index) const
+    {
+        return select_leading(index);
+    }
+
+    template<typename... Index>
+    ndarray_view<T, R - detail::count_integral<Index...>()> select(Index... index) const
+    {
+        static_assert(sizeof...(Index) == R, "ndarray_view: number of selections must match rank");
+        auto result = ndarray_view<T, R - detail::count_integral<Index...>()>();
+        auto n = 0;
+        auto m = 0;
+
+        result.mem = mem;
+        (void) std::initializer_list<int>{(select_axis(result, n++, m, index), 0)...};
+        return result;
+    }
+
+    template<int Axis, typename Slice>
+    ndarray_view<T, R> take(Slice slice) const
+    {
+        static_assert(Axis >= 0 && Axis < R, "ndarray_view: invalid axis");
+        static_assert(! std::is_integral<Slice>::value, "ndarray_view: take requires a range or selection");
+        auto result = *this;
+        auto m = Axis;
+        select_axis(result, Axis, m, slice);
+        return result;
+    }
+
+    /**
+     * Shifts the view along one axis, dropping the elements moved past its
+     * end. A view does not know the extent of the array it was taken from,
+     * so unlike ndarray::shift, which moves a sub-array's window across its
+     * parent, the shifted view always stays inside the original view. The
+     * two agree for views of whole arrays.
+     */
+    template<int Axis>
+    ndarray_view<T, R> shift(int distance) const
+    {
+        static_assert(Axis >= 0 && Axis < R, "ndarray_view: invalid axis");
+        auto result = *this;
+
+        if (distance > 0)
+        {
+            distance = std::min(distance, dims[Axis]);
+            result.mem += distance * steps[Axis];
+        }
+        result.dims[Axis] = dims[Axis] - std::min(std::abs(distance), dims[Axis]);
+        return result;
+    }
+
+
+
+
+    // ========================================================================
+    /**
+     * Walks the view in row-major order by moving a pointer. Random access
+     * seeks in O(R); increments and decrements add a step, plus a carry
+     * when an axis wraps around.
+     */
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = typename std::remove_const<T>::type;
+        using pointer = T*;
+        using reference = T&;
+        using iterator_category = std::random_access_iterator_tag;
+
+        iterator() {}
+        iterator(const ndarray_view<T, R>& view, std::size_t position)
+        : view(view.coalesced())
+        , step(this->view.steps[R - 1])
+        , run(this->view.dims[R - 1])
+        {
+            for (int n = 1; n < R; ++n)
+                carry[n] = this->view.steps[n - 1] - this->view.dims[n] * this->view.steps[n];
+
+            seek(position);
+        }
+
+        /**
+         * Steps the pointer along the last axis. When that axis wraps around,
+         * the pointer moves by a precomputed amount that rewinds it and
+         * advances the axis before it, so a step never recomputes an offset
+         * from the index.
+         */
+        iterator& operator++()
+        {
+            ++position;
+            ptr += step;
+
+            if (++inner == run && R > 1)
+                carry_forward();
+
+            return *this;
+        }
+
+        iterator& operator--()
+        {
+            --position;
+            ptr -= step;
+
+            if (inner-- == 0 && R > 1)
+                carry_backward();
+
+            return *this;
+        }
+
+        iterator operator++(int) { auto ret = *this; this->operator++(); return ret; }
+        iterator operator--(int) { auto ret = *this; this->operator--(); return ret; }
+        iterator& operator+=(difference_type n) { seek(position + n); return *this; }
+        iterator& operator-=(difference_type n) { seek(position - n); return *this; }
+        iterator operator+(difference_type n) const { auto ret = *this; return ret += n; }
+        iterator operator-(difference_type n) const { auto ret = *this; return ret -= n; }
+        difference_type operator-(const iterator& other) const { return difference_type(position - other.position); }
+        friend iterator operator+(difference_type n, const iterator& i) { return i + n; }
+        bool operator==(const iterator& other) const { return position == other.position; }
+        bool operator!=(const iterator& other) const { return position != other.position; }
+        bool operator< (const iterator& other) const { return position <  other.position; }
+        bool operator> (const iterator& other) const { return position >  other.position; }
+        bool operator<=(const iterator& other) const { return position <= other.position; }
+        bool operator>=(const iterator& other) const { return position >= other.position; }
+        T& operator*() const { return *ptr; }
+        T& operator[](difference_type n) const { return *(*this + n); }
+
+    private:
+        void carry_forward()
+        {
+            int n = R - 2;
+            inner = 0;
+            ptr += carry[R - 1];
+
+            while (++index[n] == view.dims[n] && n > 0)
+            {
+                index[n] = 0;
+                ptr += carry[n];
+                --n;
+            }
+        }
+
+        void carry_backward()
+        {
+            int n = R - 2;
+            inner = run - 1;
+            ptr -= carry[R - 1];
+
+            while (index[n]-- == 0 && n > 0)
+            {
+                index[n] = view.dims[n] - 1;
+                ptr -= carry[n];
+                --n;
+            }
+        }
+
+        /**
+         * Moves to the given position in O(R). The index past the last
+         * element is {dims[0], 0, ...}, which is where operator++ leaves it.
+         */
+        void seek(std::size_t p)
+        {
+            position = p;
+            ptr = view.mem;
+            index = {};
+            inner = 0;
+
+            if (view.size() == 0)
+                return;
+
+            for (int n = R - 1; n > 0; --n)
+            {
+                index[n] = int(p % view.dims[n]);
+                p /= view.dims[n];
+                ptr += index[n] * view.steps[n];
+            }
+            index[0] = int(p);
+            ptr += index[0] * view.steps[0];
+            inner = index[R - 1];
+        }
+
+        ndarray_view<T, R> view;
+        T* ptr = nullptr;
+        std::size_t position = 0;
+        std::ptrdiff_t step = 0;
+        int inner = 0;
+        int run = 0;
+        std::array<int, R> index = {};
+        std::array<std::ptrdiff_t, R> carry = {};
+    };
+
+    iterator begin() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, 0}; }
+    iterator end() const { static_assert(R > 0, "cannot iterate over scalar"); return {*this, size()}; }
+
+
+
+
+    // ========================================================================
+    /**
+     * Visits the elements as a sequence of runs along the last axis, calling
+     * function(T* data, std::size_t length, std::ptrdiff_t stride) for each
+     * one, in row-major order. A contiguous view is a single run of stride
+     * 1, and views that are only contiguous along the last axis (sub-blocks
+     * taken along the leading axes) give runs of stride 1, so the function
+     * can run a tight inner loop that the compiler vectorizes:
+     *
+     * V.for_each_run([] (double* p, std::size_t n, std::ptrdiff_t s) {
+     *     if (s == 1) for (std::size_t i = 0; i < n; ++i) p[i] *= 2;
+     *     else        for (std::size_t i = 0; i < n; ++i) p[i * s] *= 2;
+     * });
+     */
+    template<typename Function>
+    void for_each_run(Function function) const
+    {
+        detail::for_each_run([&function] (std::size_t length, detail::strided_run<T> run)
+        {
+            function(run.data, length, run.stride);
+        }, *this);
+    }
+
+private:
+    template<typename, int>
+    friend class ndarray_view;
+
+    ndarray_view<T, R - 1> select_leading(int index) const
+    {
+        auto result = ndarray_view<T, R - 1>();
+        result.mem = mem + index * steps[0];
+
+        for (int n = 1; n < R; ++n)
+        {
+            result.dims[n - 1] = dims[n];
+            result.steps[n - 1] = steps[n];
+        }
+        return result;
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int&, int index) const
+    {
+        result.mem += index * steps[n];
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::index index) const
+    {
+        select_axis(result, n, m, index.lower);
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::all) const
+    {
+        result.dims[m] = dims[n];
+        result.steps[m] = steps[n];
+        ++m;
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::range range) const
+    {
+        select_axis(result, n, m, axis::selection(range.lower, range.upper, 1));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, std::tuple<int, int> range) const
+    {
+        select_axis(result, n, m, axis::selection(std::get<0>(range), std::get<1>(range), 1));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, std::tuple<int, int, int> selection) const
+    {
+        select_axis(result, n, m, axis::selection(std::get<0>(selection), std::get<1>(selection), std::get<2>(selection)));
+    }
+
+    template<typename View>
+    void select_axis(View& result, int n, int& m, axis::selection selection) const
+    {
+        result.mem += selection.lower * steps[n];
+        result.dims[m] = (selection.upper - selection.lower + selection.skips - 1) / selection.skips;
+        result.steps[m] = steps[n] * selection.skips;
+        ++m;
+    }
+
+    T* mem = nullptr;
+    std::array<int, R> dims = {};
+    std::array<std::ptrdiff_t, R> steps = {};
+};
+
+
+
+
+// ============================================================================
+template<typename T>
+struct nd::detail::strided_run
+{
+    T& operator[](std::size_t i) const { return data[std::ptrdiff_t(i) * stride]; }
+
+    T* data;
+    std::ptrdiff_t stride;
+};
+
+
+
+
+// ============================================================================
+template<int R, typename Function, typename... T>
+void nd::detail::for_each_run(Function function, const ndarray_view<T, R>&... views)
+{
+    const bool contiguous[] = {views.contiguous()...};
+    const auto size = std::get<0>(std::forward_as_tuple(views...)).size();
+
+    if (size == 0)
+    {
+        return;
+    }
+    if (std::all_of(std::begin(contiguous), std::end(contiguous), [] (bool c) { return c; }))
+    {
+        function(size, strided_run<T>{views.data(), 1}...);
+        return;
+    }
+    for_each_coalesced_run(function, std::index_sequence_for<T...>(), views...);
+}
+
+template<int R, typename Function, typename... T, std::size_t... I>
+void nd::detail::for_each_coalesced_run(Function function, std::index_sequence<I...>, const ndarray_view<T, R>&... views)
+{
+    auto shape = std::get<0>(std::forward_as_tuple(views...)).shape();
+    auto strides = std::array<std::array<std::ptrdiff_t, R>, sizeof...(T)>{{views.strides()...}};
+    auto first = R - coalesce_axes<R>(shape, strides);
+    auto index = std::array<int, R>();
+    auto offset = [&index] (const std::array<std::ptrdiff_t, R>& s)
+    {
+        std::ptrdiff_t m = 0;
+
+        for (int n = 0; n < R - 1; ++n)
+            m += index[n] * s[n];
+
+        return m;
+    };
+
+    while (true)
+    {
+        function(std::size_t(shape[R - 1]), strided_run<T>{views.data() + offset(strides[I]), strides[I][R - 1]}...);
+
+        int n = R - 2;
+
+        while (n >= first && ++index[n] == shape[n])
+        {
+            index[n] = 0;
+            --n;
+        }
+        if (n < first)
+        {
+            break;
+        }
+    }
+} // ND_IMPL_END
+
+
+
+
+// ============================================================================
+#ifdef TEST_VIEW
+#include <vector>
+#include "catch.hpp"
+
+
+TEST_CASE("ndarray_view indexes raw memory", "[view]")
+{
+    auto _ = nd::axis::all();
+    auto data = std::vector<int>(24);
+
+    for (int n = 0; n < 24; ++n)
+        data[n] = n;
+
+    auto V = nd::ndarray_view<int, 3>(data.data(), {2, 3, 4}, {12, 4, 1});
+
+    SECTION("Views are trivially copyable and index like arrays")
+    {
+        static_assert(std::is_trivially_copyable<nd::ndarray_view<int, 3>>::value, "ndarray_view must be trivially copyable");
+        REQUIRE(V.size() == 24);
+        REQUIRE(V.contiguous());
+        REQUIRE(V(1, 2, 3) == 23);
+        REQUIRE(V[1](0, 0) == 12);
+        REQUIRE(V[1][2](3) == 23);
+    }
+
+    SECTION("Selections reduce rank for integer indexes and apply skips")
+    {
+        auto A = V.select(1, _, _|0|4|2);
+        REQUIRE(A.shape() == std::array<int, 2>{3, 2});
+        REQUIRE(A(2, 1) == 22);
+        REQUIRE_FALSE(A.contiguous());
+        REQUIRE(V.select(_, 1, std::make_tuple(1, 3))(1, 1) == 18);
+        REQUIRE(V.select(0, 0, _|0|4|3).shape(0) == 2);
+        REQUIRE(V.select(1, _|2, _).shape() == std::array<int, 1>{4});
+        REQUIRE(V.select(1, _|2, _)(3) == 23);
+    }
+
+    SECTION("take and shift act along one axis")
+    {
+        REQUIRE(V.take<2>(_|1|3).shape() == std::array<int, 3>{2, 3, 2});
+        REQUIRE(V.take<2>(_|1|3)(1, 1, 0) == 17);
+        REQUIRE(V.shift<1>(+1).shape(1) == 2);
+        REQUIRE(V.shift<1>(+1)(0, 0, 0) == 4);
+        REQUIRE(V.shift<1>(-2).shape(1) == 1);
+        REQUIRE(V.shift<1>(-2)(0, 0, 0) == 0);
+    }
+
+    SECTION("Iteration visits elements in row-major order")
+    {
+        auto B = V.select(_, _|0|3|2, _|1|4|2);
+        auto visited = std::vector<int>(B.begin(), B.end());
+        REQUIRE(visited == std::vector<int>{1, 3, 9, 11, 13, 15, 21, 23});
+
+        for (auto& x : V.select(0, _, _))
+            x = -1;
+
+        REQUIRE(data[11] == -1);
+        REQUIRE(data[12] == 12);
+    }
+
+    SECTION("Iterators are random access")
+    {
+        auto B = V.select(_, _|0|3|2, _|1|4|2);
+        auto first = B.begin();
+        auto last = B.end();
+
+        REQUIRE(last - first == 8);
+        REQUIRE(*(first + 5) == 15);
+        REQUIRE(first[7] == 23);
+        REQUIRE(*(last - 1) == 23);
+        REQUIRE(*--(first + 4) == 11);
+        REQUIRE(*(last - 8) == 1);
+        REQUIRE(first + 8 == last);
+        REQUIRE(first < last);
+
+        auto it = last;
+        auto reversed = std::vector<int>();
+
+        while (it != first)
+            reversed.push_back(*--it);
+
+        REQUIRE(reversed == std::vector<int>{23, 21, 15, 13, 11, 9, 3, 1});
+    }
+
+    SECTION("Runs along the last axis cover the elements in row-major order")
+    {
+        auto visited = std::vector<int>();
+        auto lengths = std::vector<std::size_t>();
+        auto record = [&] (int* p, std::size_t n, std::ptrdiff_t s)
+        {
+            lengths.push_back(n);
+
+            for (std::size_t i = 0; i < n; ++i)
+                visited.push_back(p[std::ptrdiff_t(i) * s]);
+        };
+
+        V.select(_, _|0|3|2, _|1|4|2).for_each_run(record);
+        REQUIRE(visited == std::vector<int>{1, 3, 9, 11, 13, 15, 21, 23});
+        REQUIRE(lengths == std::vector<std::size_t>{2, 2, 2, 2});
+
+        visited.clear();
+        lengths.clear();
+        V.for_each_run(record);
+        REQUIRE(visited.size() == 24);
+        REQUIRE(lengths == std::vector<std::size_t>{24});
+    }
+
+    SECTION("Coalesced views visit the same elements in the same order")
+    {
+        auto B = V.select(_, _|1|3, _);
+        auto C = B.coalesced();
+        REQUIRE(C.shape() == std::array<int, 3>{1, 2, 8});
+        REQUIRE(std::vector<int>(B.begin(), B.end()) == std::vector<int>(C.begin(), C.end()));
+        REQUIRE(std::vector<int>(B.begin(), B.end()) == std::vector<int>{4, 5, 6, 7, 8, 9, 10, 11, 16, 17, 18, 19, 20, 21, 22, 23});
+        REQUIRE(*(B.end() - 9) == 11);
+        REQUIRE(*--(B.begin() + 8) == 11);
+        REQUIRE(V.coalesced().shape() == std::array<int, 3>{1, 1, 24});
+    }
+
+    SECTION("Views convert to read-only views")
+    {
+        nd::ndarray_view<const int, 3> C = V;
+        REQUIRE(C(1, 2, 3) == 23);
+        REQUIRE(C.data() == data.data());
+    }
+}
+
+#endif // TEST_VIEW